@@ -0,0 +1,404 @@
+/*
+ * The ahead-of-time compiler. Translates a program and the standard library in
+ * to C. Each list is built by a C function at start up, and each list the
+ * virtual machine would compile has its instructions translated in to a C
+ * function that vm_run calls in their place, so nothing is parsed or
+ * dispatched at run time. Functions are still called through lval_call --
+ * under dynamic scope what a symbol refers to is only known when it is looked
+ * up, so calls and lookups go through the same runtime as the interpreter.
+ */
+
+#include <limits.h>
+#include "builtin_symbols.h"
+#include "bytecode.h"
+
+#define AOT_DEFUN "defun"
+
+char *lookup_load_file(const char *filename);
+
+/**
+ * A C file being written.
+ */
+typedef struct
+{
+    FILE *out;
+    unsigned count;   // functions generated so far
+} aot;
+
+/**
+ * Returns true if every item in a list is a symbol.
+ */
+static bool aot_all_symbols(const lval *v)
+{
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+    {
+        if (lval_type(LVAL_EXPR_ITEM(v, i)) != LVAL_SYMBOL)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Returns true if v is the symbol name.
+ */
+static bool aot_is_symbol(const lval *v, const char *name)
+{
+    return lval_type(v) == LVAL_SYMBOL && !strcmp(v->value.sym.name, name);
+}
+
+/**
+ * Resolves the bodies of the functions a program defines the way lval_lambda
+ * will when they are made, so it finds nothing to change and keeps the lists,
+ * and the code attached to them, that the program built. Outer functions are
+ * resolved before the functions they make.
+ */
+static void aot_resolve(lval *v)
+{
+    if (lval_type(v) != LVAL_SEXPRESSION && lval_type(v) != LVAL_QEXPRESSION)
+    {
+        return;
+    }
+
+    if (LVAL_EXPR_CNT(v) == 3 && lval_type(LVAL_EXPR_ITEM(v, 1)) == LVAL_QEXPRESSION &&
+        lval_type(LVAL_EXPR_ITEM(v, 2)) == LVAL_QEXPRESSION && aot_all_symbols(LVAL_EXPR_ITEM(v, 1)))
+    {
+        // (\ {formals} {body})
+        if (aot_is_symbol(LVAL_EXPR_FIRST(v), BUILTIN_SYM_LAMBDA))
+        {
+            LVAL_EXPR_ITEM(v, 2) = lval_resolve(LVAL_EXPR_ITEM(v, 2), LVAL_EXPR_ITEM(v, 1));
+        }
+
+        // (defun {name formals...} {body})
+        if (aot_is_symbol(LVAL_EXPR_FIRST(v), AOT_DEFUN) && LVAL_EXPR_CNT(LVAL_EXPR_ITEM(v, 1)))
+        {
+            lval *formals = lval_qexpression();
+            for (size_t i = 1; i < LVAL_EXPR_CNT(LVAL_EXPR_ITEM(v, 1)); i++)
+            {
+                lval_add(formals, lval_ref(LVAL_EXPR_ITEM(LVAL_EXPR_ITEM(v, 1), i)));
+            }
+
+            LVAL_EXPR_ITEM(v, 2) = lval_resolve(LVAL_EXPR_ITEM(v, 2), formals);
+            lval_del(formals);
+        }
+    }
+
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+    {
+        aot_resolve(LVAL_EXPR_ITEM(v, i));
+    }
+}
+
+/**
+ * Writes characters as a C string literal.
+ */
+static void aot_string(aot *a, const char *str, size_t len)
+{
+    fputc('"', a->out);
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\' || c == '?' || c < ' ' || c > '~')
+        {
+            fprintf(a->out, "\\%03o", c);
+        }
+        else
+        {
+            fputc(c, a->out);
+        }
+    }
+
+    fputc('"', a->out);
+}
+
+/**
+ * Returns true if an instruction jumps to the instruction at its operand.
+ */
+static bool aot_is_jump(unsigned op)
+{
+    return op == OP_JUMP || op == OP_IF || op == OP_AND || op == OP_OR || op == OP_TRY || op == OP_DROP;
+}
+
+/**
+ * Writes a function that does what the instructions compiled from a list do.
+ * Jumps become gotos to a label before each instruction jumped to.
+ */
+static void aot_run(aot *a, unsigned id, const lcode *code)
+{
+    bool labels[code->count + 1];
+    bool uses_call = false;
+    bool uses_rv = false;
+    bool uses_v = false;
+    memset(labels, 0, sizeof(labels));
+    for (size_t i = 0; i < code->count; i++)
+    {
+        unsigned op = INSTR_OP(code->instrs[i]);
+        uses_call |= op == OP_CALL;
+        uses_rv |= op == OP_CALL || op == OP_FORM;
+        uses_v |= op == OP_IF || op == OP_AND || op == OP_OR;
+        if (aot_is_jump(op))
+        {
+            labels[INSTR_ARG(code->instrs[i])] = true;
+        }
+
+        // A condition that is not a boolean leaves its error just before the false branch
+        if (op == OP_IF)
+        {
+            labels[INSTR_ARG(code->instrs[i]) - 1] = true;
+        }
+    }
+
+    fprintf(a->out, "static lval *run_%u(lenv *env, const lcode *code, ltail *tail)\n{\n", id);
+    fprintf(a->out, "    lval *stack[%zu];\n    lval **sp = stack;\n", code->max_stack ? code->max_stack : 1);
+    if (uses_call)
+    {
+        fprintf(a->out, "    ltail call;\n");
+    }
+
+    if (uses_rv)
+    {
+        fprintf(a->out, "    lval *rv;\n");
+    }
+
+    if (uses_v)
+    {
+        fprintf(a->out, "    lval *v;\n");
+    }
+
+    // Not every body uses all of its parameters
+    fprintf(a->out, "    (void)env;\n    (void)code;\n    (void)tail;\n");
+
+    for (size_t i = 0; i < code->count; i++)
+    {
+        if (labels[i])
+        {
+            fprintf(a->out, "l%zu:\n", i);
+        }
+
+        unsigned arg = INSTR_ARG(code->instrs[i]);
+        switch (INSTR_OP(code->instrs[i]))
+        {
+        case OP_CONST:
+            fprintf(a->out, "    *sp++ = lval_ref(code->consts[%u]);\n", arg);
+            break;
+        case OP_LOAD:
+            fprintf(a->out, "    *sp++ = lenv_get(env, code->consts[%u]);\n", arg);
+            break;
+        case OP_BUILTIN:
+            fprintf(a->out, "    *sp++ = vm_builtin(env, code->consts[%u]);\n", arg);
+            break;
+        case OP_GLOBAL:
+            fprintf(a->out, "    *sp++ = lenv_get_cached(env, code->sites[%u].sym, &code->sites[%u].cache);\n", arg, arg);
+            break;
+        case OP_EMPTY:
+            fprintf(a->out, "    *sp++ = lval_sexpression();\n");
+            break;
+        case OP_CALL:
+            fprintf(a->out, "    sp -= %u;\n    rv = vm_prepare_call(sp, %u, &call);\n", arg, arg);
+            fprintf(a->out, "    *sp++ = rv ? rv : lval_call(env, call.func, call.args);\n");
+            break;
+        case OP_TAIL:
+            fprintf(a->out, "    sp -= %u;\n    return vm_prepare_call(sp, %u, tail);\n", arg, arg);
+            break;
+        case OP_RETURN:
+            fprintf(a->out, "    return *--sp;\n");
+            break;
+        case OP_FORM:
+            // The instruction skipped when the form is not shadowed is always a jump or a return
+            fprintf(a->out, "    if ((rv = vm_form(env, code->consts[%u])))\n    {\n        *sp++ = rv;\n", arg);
+            if (INSTR_OP(code->instrs[++i]) == OP_JUMP)
+            {
+                fprintf(a->out, "        goto l%u;\n    }\n", INSTR_ARG(code->instrs[i]));
+            }
+            else
+            {
+                fprintf(a->out, "        return *--sp;\n    }\n");
+            }
+            break;
+        case OP_LAMBDA:
+            fprintf(a->out, "    *sp++ = vm_lambda(code->consts[%u]);\n", arg);
+            break;
+        case OP_JUMP:
+            fprintf(a->out, "    goto l%u;\n", arg);
+            break;
+        case OP_IF:
+            fprintf(a->out, "    v = *--sp;\n    if (v == LVAL_FALSE)\n    {\n        goto l%u;\n    }\n", arg);
+            fprintf(a->out, "    else if (v != LVAL_TRUE)\n    {\n");
+            fprintf(a->out, "        *sp++ = vm_test_error(env, SYMBOL_ID_IF, v);\n        goto l%u;\n    }\n", arg - 1);
+            break;
+        case OP_AND:
+        case OP_OR:
+        {
+            bool and = INSTR_OP(code->instrs[i]) == OP_AND;
+            fprintf(a->out, "    v = *--sp;\n    if (v != %s)\n    {\n", and ? "LVAL_TRUE" : "LVAL_FALSE");
+            fprintf(a->out, "        *sp++ = v == %s ? v : vm_test_error(env, %s, v);\n",
+                and ? "LVAL_FALSE" : "LVAL_TRUE", and ? "SYMBOL_ID_AND" : "SYMBOL_ID_OR");
+            fprintf(a->out, "        goto l%u;\n    }\n", arg);
+            break;
+        }
+        case OP_TRY:
+            fprintf(a->out, "    if (lval_type(sp[-1]) != LVAL_ERROR)\n    {\n        goto l%u;\n    }\n\n", arg);
+            fprintf(a->out, "    lval_del(*--sp);\n");
+            break;
+        case OP_DROP:
+            fprintf(a->out, "    if (lval_type(sp[-1]) == LVAL_ERROR)\n    {\n        goto l%u;\n    }\n\n", arg);
+            fprintf(a->out, "    lval_del(*--sp);\n");
+            break;
+        case OP_ARITH:
+            fprintf(a->out, "    sp--;\n    sp[-1] = arith_apply(%u, %s, sp[-1], sp[0]);\n", arg / 2, arg % 2 ? "true" : "false");
+            break;
+        }
+    }
+
+    fprintf(a->out, "}\n\n");
+}
+
+/**
+ * Writes a function that builds a list, and the functions for the lists in it.
+ * The virtual machine compiles s-expressions in line with the list they are in,
+ * so only q-expressions and the forms of the program are given code. Returns
+ * the ID of the function.
+ */
+static unsigned aot_build(aot *a, lval *v, bool outermost, bool run)
+{
+    unsigned children[LVAL_EXPR_CNT(v) ? LVAL_EXPR_CNT(v) : 1];
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+    {
+        lval *item = LVAL_EXPR_ITEM(v, i);
+        if (lval_type(item) == LVAL_SEXPRESSION || lval_type(item) == LVAL_QEXPRESSION)
+        {
+            children[i] = aot_build(a, item, false, outermost || lval_type(item) == LVAL_QEXPRESSION);
+        }
+    }
+
+    unsigned id = a->count++;
+    const lcode *code = 0;
+    if (run && LVAL_EXPR_CNT(v))
+    {
+        code = lval_compile(v, 0);
+        aot_run(a, id, code);
+    }
+
+    fprintf(a->out, "static lval *build_%u(void)\n{\n", id);
+    fprintf(a->out, "    lval *v = %s;\n", lval_type(v) == LVAL_SEXPRESSION ? "lval_sexpression()" : "lval_qexpression()");
+    if (LVAL_EXPR_CNT(v))
+    {
+        fprintf(a->out, "    lval_expr_reserve(v, %zu);\n", LVAL_EXPR_CNT(v));
+    }
+
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+    {
+        lval *item = LVAL_EXPR_ITEM(v, i);
+        fprintf(a->out, "    lval_add(v, ");
+        switch (lval_type(item))
+        {
+        case LVAL_LONG:
+            if (lval_as_long(item) == LONG_MIN)
+            {
+                fprintf(a->out, "lval_long(LONG_MIN)");
+            }
+            else
+            {
+                fprintf(a->out, "lval_long(%ldL)", lval_as_long(item));
+            }
+            break;
+        case LVAL_DOUBLE:
+            fprintf(a->out, "lval_double(%a)", lval_as_double(item));
+            break;
+        case LVAL_BOOL:
+            fprintf(a->out, "lval_bool(%s)", lval_as_bool(item) ? "true" : "false");
+            break;
+        case LVAL_STRING:
+            fprintf(a->out, "lval_string_len(");
+            aot_string(a, item->value.str.ptr, item->value.str.len);
+            fprintf(a->out, ", %zu)", item->value.str.len);
+            break;
+        case LVAL_SYMBOL:
+            fprintf(a->out, item->value.sym.slot == LVAL_SLOT_NONE ? "lval_symbol(" : "lval_formal(");
+            aot_string(a, item->value.sym.name, strlen(item->value.sym.name));
+            if (item->value.sym.slot != LVAL_SLOT_NONE)
+            {
+                fprintf(a->out, ", %u", item->value.sym.slot);
+            }
+            fprintf(a->out, ")");
+            break;
+        default:
+            fprintf(a->out, "build_%u()", children[i]);
+            break;
+        }
+
+        fprintf(a->out, ");\n");
+    }
+
+    if (code)
+    {
+        fprintf(a->out, "    lcode_attach(v, run_%u, %zu);\n", id, code->count);
+    }
+
+    fprintf(a->out, "    return v;\n}\n\n");
+    return id;
+}
+
+/**
+ * Reads and resolves a program, then writes the functions that build it.
+ * Returns the ID of the function that builds the whole program, or prints the
+ * error and returns -1.
+ */
+static int aot_program(aot *a, const char *source)
+{
+    lval *expr = lilith_read_from_string(source);
+    if (lval_type(expr) == LVAL_ERROR)
+    {
+        lilith_println(expr);
+        lval_del(expr);
+        return -1;
+    }
+
+    aot_resolve(expr);
+
+    // The program itself is never evaluated, only the forms in it
+    int rv = aot_build(a, expr, true, false);
+    lval_del(expr);
+    return rv;
+}
+
+int lilith_compile_file(const char *filename, const char *output)
+{
+    char *source = lookup_load_file(filename);
+    if (!source)
+    {
+        printf("File not found %s\n", filename);
+        return 1;
+    }
+
+    aot a = { fopen(output, "w"), 0 };
+    if (!a.out)
+    {
+        printf("Cannot write %s\n", output);
+        free(source);
+        return 1;
+    }
+
+    fprintf(a.out, "/*\n * Generated by lilith --compile from %s. Do not edit.\n */\n\n", filename);
+    fprintf(a.out, "#include <limits.h>\n#include \"bytecode.h\"\n\n");
+
+    int stdlib = aot_program(&a, stdlib_source());
+    int program = aot_program(&a, source);
+    free(source);
+    if (stdlib >= 0 && program >= 0)
+    {
+        // The program is built once the standard library has run, as the collector would free it before
+        fprintf(a.out, "int main()\n{\n    lenv *env = lilith_init_runtime();\n");
+        fprintf(a.out, "    lval *rv = multi_eval(env, build_%d());\n", stdlib);
+        fprintf(a.out, "    if (lval_type(rv) != LVAL_ERROR)\n    {\n");
+        fprintf(a.out, "        lval_del(rv);\n        rv = multi_eval(env, build_%d());\n    }\n\n", program);
+        fprintf(a.out, "    int status = lval_type(rv) == LVAL_ERROR;\n");
+        fprintf(a.out, "    if (status)\n    {\n        lilith_println(rv);\n    }\n\n");
+        fprintf(a.out, "    lval_del(rv);\n    lilith_cleanup(env);\n    return status;\n}\n");
+    }
+
+    fclose(a.out);
+    return stdlib < 0 || program < 0;
+}
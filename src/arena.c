@@ -0,0 +1,129 @@
+/*
+ * Arena allocation for short-lived lvals. While an evaluation scope is open,
+ * new lvals and small list arrays are bump allocated from large blocks. Memory
+ * freed inside the scope is recycled through free lists. All blocks are
+ * released in bulk when the outermost scope closes. Requests too large for a
+ * size class go straight to malloc.
+ */
+
+#include "lilith_int.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN sizeof(void*)
+#define ARENA_SIZE_CLASSES 33
+
+/**
+ * A block of arena memory. Allocations are taken from the end of the used region.
+ */
+typedef struct _arena_block
+{
+    struct _arena_block *next;
+    size_t used;
+    char data[];
+} arena_block;
+
+/**
+ * A freed allocation waiting to be reused.
+ */
+typedef struct _arena_free
+{
+    struct _arena_free *next;
+} arena_free_node;
+
+static struct
+{
+    arena_block *blocks;                        // most recently allocated block first
+    unsigned depth;                             // number of open scopes
+    arena_free_node *free[ARENA_SIZE_CLASSES];  // free lists indexed by aligned size
+} arena;
+
+/**
+ * Rounds an allocation size up to the arena alignment.
+ */
+static size_t arena_class(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) / ARENA_ALIGN;
+}
+
+static arena_block *arena_new_block(arena_block *next)
+{
+    arena_block *rv = malloc(sizeof(arena_block) + ARENA_BLOCK_SIZE);
+    rv->next = next;
+    rv->used = 0;
+    return rv;
+}
+
+bool arena_active(void)
+{
+    return arena.depth > 0;
+}
+
+void *arena_alloc(size_t size)
+{
+    size_t cls = arena_class(size);
+    if (cls >= ARENA_SIZE_CLASSES)
+    {
+        return malloc(size);
+    }
+
+    arena_free_node *rv = arena.free[cls];
+    if (rv)
+    {
+        arena.free[cls] = rv->next;
+        return rv;
+    }
+
+    size = cls * ARENA_ALIGN;
+    if (!arena.blocks || arena.blocks->used + size > ARENA_BLOCK_SIZE)
+    {
+        arena.blocks = arena_new_block(arena.blocks);
+    }
+
+    void *ptr = arena.blocks->data + arena.blocks->used;
+    arena.blocks->used += size;
+    return ptr;
+}
+
+void arena_free(void *ptr, size_t size)
+{
+    size_t cls = arena_class(size);
+    if (cls >= ARENA_SIZE_CLASSES)
+    {
+        free(ptr);
+        return;
+    }
+
+    arena_free_node *node = ptr;
+    node->next = arena.free[cls];
+    arena.free[cls] = node;
+}
+
+void lilith_arena_begin(void)
+{
+    arena.depth++;
+}
+
+void lilith_arena_end(void)
+{
+    if (--arena.depth)
+    {
+        return;
+    }
+
+    // Keep one block for the next scope and release the rest
+    if (arena.blocks)
+    {
+        arena_block *ptr = arena.blocks->next;
+        while (ptr)
+        {
+            arena_block *tmp = ptr;
+            ptr = ptr->next;
+            free(tmp);
+        }
+
+        arena.blocks->next = 0;
+        arena.blocks->used = 0;
+    }
+
+    memset(arena.free, 0, sizeof(arena.free));
+}
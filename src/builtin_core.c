@@ -6,9 +6,31 @@
 #include <math.h>
 #include "lilith_int.h"
 #include "builtin_symbols.h"
+#include "bytecode.h"
 
 char *lookup_load_file(const char *filename);
-static lval *builtin_eval(lenv* env, lval *args);
+static lval *builtin_eval_body(lenv *env, lval *args, lval **body);
+
+/**
+ * Finishes a built-in that ends by evaluating a q-expression. Its body form
+ * returns either a result or the q-expression to evaluate and the environment
+ * to evaluate it in, which is released afterwards if the body form created it.
+ */
+static lval *eval_builtin_body(lval *rv, lenv *env, lenv *frame, lval *body)
+{
+    if (rv)
+    {
+        return rv;
+    }
+
+    rv = lval_eval_body(frame, body);
+    if (frame != env)
+    {
+        lenv_del(frame);
+    }
+
+    return rv;
+}
 
 /**
  * Built-in function for defining new symbols. First argument in val's list
@@ -28,11 +50,11 @@ static lval *builtin_assign(lenv *env, lval *val, size_t expected, bool (*adder)
 
     // First argument is a symbol list
     lval *syms = lval_pop(val);
-    for (pair *ptr = syms->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(syms); i++)
     {
-        LASSERT(val, ptr->data->type == LVAL_SYMBOL,
+        LASSERT(val, lval_type(LVAL_EXPR_ITEM(syms, i)) == LVAL_SYMBOL,
             "function '%s' type mismatch - expected %s, received %s",
-            BUILTIN_SYM_DEF, ltype_name(LVAL_SYMBOL), ltype_name(ptr->data->type));
+            BUILTIN_SYM_DEF, ltype_name(LVAL_SYMBOL), ltype_name(lval_type(LVAL_EXPR_ITEM(syms, i))));
     }
 
     LASSERT(val, LVAL_EXPR_CNT(syms) == expected,
@@ -40,14 +62,12 @@ static lval *builtin_assign(lenv *env, lval *val, size_t expected, bool (*adder)
         BUILTIN_SYM_DEF, LVAL_EXPR_CNT(syms), expected);
 
     // Assign symbols to values
-    size_t i = 0;
-    for (pair *ptr = syms->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(syms); i++)
     {
         lval *to_add = lval_pop(val);
-        LASSERT(val, !adder(env, ptr->data, to_add),
-            "symbol '%s' is a built-in", ptr->data->value.str_val);
+        LASSERT(val, !adder(env, LVAL_EXPR_ITEM(syms, i), to_add),
+            "symbol '%s' is a built-in", LVAL_EXPR_ITEM(syms, i)->value.sym.name);
         lval_del(to_add);
-        i++;
     }
 
     lval_del(syms);
@@ -57,7 +77,7 @@ static lval *builtin_assign(lenv *env, lval *val, size_t expected, bool (*adder)
 static lval *builtin_def(lenv *env, lval *val)
 {
     lval *rv = builtin_assign(env, val, LVAL_EXPR_CNT(val) - 1, lenv_def);
-    if (rv->type != LVAL_ERROR)
+    if (lval_type(rv) != LVAL_ERROR)
     {
         lval_del(val);
     }
@@ -65,20 +85,37 @@ static lval *builtin_def(lenv *env, lval *val)
     return rv;
 }
 
-static lval *builtin_let(lenv *env, lval *val)
+/**
+ * Body form of let. Binds the symbols in a new environment and hands back the final q-expression.
+ */
+static lval *builtin_let_body(lenv *env, lval *val, lenv **frame, lval **body)
 {
     lenv *nenv = lenv_new();
     lenv_set_parent(nenv, env);
 
     lval *rv = builtin_assign(nenv, val, LVAL_EXPR_CNT(val) - 2, lenv_put);
-    if (rv->type != LVAL_ERROR)
+    if (lval_type(rv) != LVAL_ERROR)
     {
         // val now contains the final q-expr
-        rv = builtin_eval(nenv, val);
+        rv = builtin_eval_body(nenv, val, body);
     }
 
-    lenv_del(nenv);
-    return rv;
+    if (rv)
+    {
+        lenv_del(nenv);
+        return rv;
+    }
+
+    *frame = nenv;
+    return 0;
+}
+
+static lval *builtin_let(lenv *env, lval *val)
+{
+    lenv *frame = env;
+    lval *body;
+    lval *rv = builtin_let_body(env, val, &frame, &body);
+    return eval_builtin_body(rv, env, frame, body);
 }
 
 /**
@@ -97,17 +134,45 @@ static lval *head_qexpr(lval *args)
 {
     LASSERT(args, LVAL_EXPR_CNT(LVAL_EXPR_FIRST(args)) != 0, "empty q-expression passed to '%s'", BUILTIN_SYM_HEAD);
 
-    lval *rv = lval_take(args, 0);
-    rv = lval_add(lval_qexpression(), lval_take(rv, 0));
+    lval *list = lval_take(args, 0);
+    lval *rv = lval_add(lval_qexpression(), lval_ref(LVAL_EXPR_FIRST(list)));
+    lval_del(list);
     return rv;
 }
 
 static lval *head_string(lval *args)
 {
-    char head[2];
-    head[0] = LVAL_EXPR_FIRST(args)->value.str_val[0];
-    head[1] = 0;
-    lval *rv = lval_string(head);
+    lval *str = LVAL_EXPR_FIRST(args);
+    lval *rv = lval_substring(str, 0, str->value.str.len ? 1 : 0);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Reads the first cell of a sequence passed to fname, giving an error if it
+ * is the end of the sequence or its item is an error.
+ */
+static lval *seq_first(lenv *env, lval *seq, const char *fname)
+{
+    seq_read(env, seq);
+    if (seq->value.seq.source == LSEQ_END)
+    {
+        return lval_error("empty sequence passed to '%s'", fname);
+    }
+
+    lval *first = seq->value.seq.item.first;
+    return lval_type(first) == LVAL_ERROR ? lval_ref(first) : 0;
+}
+
+static lval *head_seq(lenv *env, lval *args)
+{
+    lval *seq = LVAL_EXPR_FIRST(args);
+    lval *rv = seq_first(env, seq, BUILTIN_SYM_HEAD);
+    if (!rv)
+    {
+        rv = lval_add(lval_qexpression(), lval_ref(seq->value.seq.item.first));
+    }
+
     lval_del(args);
     return rv;
 }
@@ -120,29 +185,30 @@ static lval *builtin_head(lenv *env, lval *args)
     LASSERT_ENV(args, env, BUILTIN_SYM_HEAD);
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_HEAD);
-    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION || LVAL_EXPR_FIRST(args)->type == LVAL_STRING,
-        "function '%s' type mismatch - expected String or Q-Expression, received %s",
-        BUILTIN_SYM_HEAD, ltype_name(LVAL_EXPR_FIRST(args)->type));
+    LASSERT(args, lval_type(LVAL_EXPR_FIRST(args)) == LVAL_QEXPRESSION || lval_type(LVAL_EXPR_FIRST(args)) == LVAL_STRING ||
+            lval_type(LVAL_EXPR_FIRST(args)) == LVAL_SEQ,
+        "function '%s' type mismatch - expected String, Q-Expression or Sequence, received %s",
+        BUILTIN_SYM_HEAD, ltype_name(lval_type(LVAL_EXPR_FIRST(args))));
     
-    if (LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION)
+    if (lval_type(LVAL_EXPR_FIRST(args)) == LVAL_QEXPRESSION)
     {
         return head_qexpr(args);
     }
+
+    if (lval_type(LVAL_EXPR_FIRST(args)) == LVAL_SEQ)
+    {
+        return head_seq(env, args);
+    }
     
     return head_string(args);
 }
 
 static lval *tail_string(lval *args)
 {
-    const char *str = LVAL_EXPR_FIRST(args)->value.str_val;
-    if (strlen(str) > 1)
-    {
-        lval *rv = lval_string(LVAL_EXPR_FIRST(args)->value.str_val + 1);
-        lval_del(args);
-        return rv;
-    }
-
-    return lval_string("");
+    lval *str = LVAL_EXPR_FIRST(args);
+    lval *rv = str->value.str.len ? lval_substring(str, 1, str->value.str.len - 1) : lval_string("");
+    lval_del(args);
+    return rv;
 }
 
 /**
@@ -153,15 +219,29 @@ static lval *builtin_tail(lenv *env, lval *args)
     LASSERT_ENV(args, env, BUILTIN_SYM_TAIL);
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_TAIL);
-    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION || LVAL_EXPR_FIRST(args)->type == LVAL_STRING,
-        "function '%s' type mismatch - expected String or Q-Expression, received %s",
-        BUILTIN_SYM_TAIL, ltype_name(LVAL_EXPR_FIRST(args)->type));
+    LASSERT(args, lval_type(LVAL_EXPR_FIRST(args)) == LVAL_QEXPRESSION || lval_type(LVAL_EXPR_FIRST(args)) == LVAL_STRING ||
+            lval_type(LVAL_EXPR_FIRST(args)) == LVAL_SEQ,
+        "function '%s' type mismatch - expected String, Q-Expression or Sequence, received %s",
+        BUILTIN_SYM_TAIL, ltype_name(lval_type(LVAL_EXPR_FIRST(args))));
 
-    if (LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION)
+    if (lval_type(LVAL_EXPR_FIRST(args)) == LVAL_SEQ)
+    {
+        lval *seq = LVAL_EXPR_FIRST(args);
+        lval *rv = seq_first(env, seq, BUILTIN_SYM_TAIL);
+        if (!rv)
+        {
+            rv = lval_ref(seq->value.seq.item.rest);
+        }
+
+        lval_del(args);
+        return rv;
+    }
+
+    if (lval_type(LVAL_EXPR_FIRST(args)) == LVAL_QEXPRESSION)
     {
         LASSERT(args, LVAL_EXPR_CNT(LVAL_EXPR_FIRST(args)) != 0, "empty q-expression passed to '%s'", BUILTIN_SYM_TAIL);
 
-        lval *rv = lval_take(args, 0);
+        lval *rv = lval_unshare(lval_take(args, 0));
         lval_del(lval_pop(rv));
         return rv;
     }
@@ -170,18 +250,67 @@ static lval *builtin_tail(lenv *env, lval *args)
 }
 
 /**
- * Built-in function to evaluate a q-expression.
+ * Body form of eval. Hands back the q-expression.
  */
-static lval *builtin_eval(lenv* env, lval *args)
+static lval *builtin_eval_body(lenv *env, lval *args, lval **body)
 {
     LASSERT_ENV(args, env, BUILTIN_SYM_EVAL);
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_EVAL);
     LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_QEXPRESSION, BUILTIN_SYM_EVAL);
 
-    lval *x = lval_take(args, 0);
-    x->type = LVAL_SEXPRESSION;
-    return lilith_eval_expr(env, x);
+    *body = lval_take(args, 0);
+    return 0;
+}
+
+/**
+ * Built-in function to evaluate a q-expression.
+ */
+static lval *builtin_eval(lenv *env, lval *args)
+{
+    lval *body;
+    lval *rv = builtin_eval_body(env, args, &body);
+    return eval_builtin_body(rv, env, env, body);
+}
+
+/**
+ * Body form of unpack. Hands back a q-expression of the function followed by
+ * the items of the list.
+ */
+static lval *builtin_unpack_body(lenv *env, lval *args, lval **body)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_UNPACK);
+    LASSERT_NO_ERROR(args);
+    if (LVAL_EXPR_CNT(args) < 2)
+    {
+        return builtin_partial(env, args, BUILTIN_SYM_UNPACK, (const char *const[]){ "f", "l" }, 2);
+    }
+
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_UNPACK);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 1), LVAL_QEXPRESSION, BUILTIN_SYM_UNPACK);
+
+    lval *list = LVAL_EXPR_ITEM(args, 1);
+    lval *rv = lval_qexpression();
+    lval_expr_reserve(rv, LVAL_EXPR_CNT(list) + 1);
+    lval_add(rv, lval_ref(LVAL_EXPR_FIRST(args)));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(list); i++)
+    {
+        lval_add(rv, lval_ref(LVAL_EXPR_ITEM(list, i)));
+    }
+
+    lval_del(args);
+    *body = rv;
+    return 0;
+}
+
+/**
+ * Built-in function to call a function with the items of a list as its arguments.
+ */
+static lval *builtin_unpack(lenv *env, lval *args)
+{
+    lval *body;
+    lval *rv = builtin_unpack_body(env, args, &body);
+    return eval_builtin_body(rv, env, env, body);
 }
 
 /**
@@ -189,61 +318,181 @@ static lval *builtin_eval(lenv* env, lval *args)
  */
 static lval *lval_join_qexpr(lval *x, lval* y)
 {
-    while (LVAL_EXPR_CNT(y))
+    lval_expr_reserve(x, LVAL_EXPR_CNT(x) + LVAL_EXPR_CNT(y));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(y); i++)
     {
-        x = lval_add(x, lval_pop(y));
+        x = lval_add(x, lval_ref(LVAL_EXPR_ITEM(y, i)));
     }
 
     lval_del(y);
     return x;
 }
 
-static lval *lval_join_string(lval *x, lval *y)
+/**
+ * Concatenate the first string with all of the strings in args.
+ */
+static lval *lval_join_string(lval *x, lval *args)
 {
-    size_t l = strlen(x->value.str_val) + strlen(y->value.str_val) + 1;
-    char str[l];
-    sprintf(str, "%s%s", x->value.str_val, y->value.str_val);
+    size_t len = x->value.str.len;
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
+    {
+        len += LVAL_EXPR_ITEM(args, i)->value.str.len;
+    }
+
+    char *buf = malloc(len + 1);
+    memcpy(buf, x->value.str.ptr, x->value.str.len);
+    len = x->value.str.len;
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
+    {
+        lval *y = LVAL_EXPR_ITEM(args, i);
+        memcpy(buf + len, y->value.str.ptr, y->value.str.len);
+        len += y->value.str.len;
+    }
+
+    lval *rv = lval_string_len(buf, len);
+    free(buf);
     lval_del(x);
-    lval_del(y);
-    return lval_string(str);
+    return rv;
 }
 
 /**
- * Built-in function to join q-expressions together.
+ * Returns a sequence of the items of a q-expression or sequence.
+ */
+static lval *seq_of(lval *x)
+{
+    if (lval_type(x) == LVAL_SEQ)
+    {
+        return lval_ref(x);
+    }
+
+    lval *rv = lval_seq(LSEQ_LIST);
+    rv->value.seq.list.list = lval_promote(x);
+    rv->value.seq.list.at = 0;
+    return rv;
+}
+
+/**
+ * Joins q-expressions and sequences in to a sequence that reads the items of
+ * each in turn.
+ */
+static lval *join_seq(lval *args)
+{
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
+    {
+        lval *item = LVAL_EXPR_ITEM(args, i);
+        LASSERT(args, lval_type(item) == LVAL_QEXPRESSION || lval_type(item) == LVAL_SEQ,
+            "function '%s' type mismatch - expected Q-Expression or Sequence, received %s",
+            BUILTIN_SYM_JOIN, ltype_name(lval_type(item)));
+    }
+
+    size_t i = LVAL_EXPR_CNT(args) - 1;
+    lval *rv = seq_of(LVAL_EXPR_ITEM(args, i));
+    while (i--)
+    {
+        lval *join = lval_seq(LSEQ_JOIN);
+        join->value.seq.join.from = seq_of(LVAL_EXPR_ITEM(args, i));
+        join->value.seq.join.next = rv;
+        rv = join;
+    }
+
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to join q-expressions together. Joining a sequence gives
+ * a sequence.
  */
 static lval *builtin_join(lenv *env, lval *args)
 {
     LASSERT_ENV(args, env, BUILTIN_SYM_JOIN);
     LASSERT_NO_ERROR(args);
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
+    {
+        if (lval_type(LVAL_EXPR_ITEM(args, i)) == LVAL_SEQ)
+        {
+            return join_seq(args);
+        }
+    }
 
     lval *x = lval_pop(args);
-    for (pair *ptr = args->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
     {
-        LASSERT(args, ptr->data->type == LVAL_QEXPRESSION || ptr->data->type == LVAL_STRING,
+        lval *item = LVAL_EXPR_ITEM(args, i);
+        LASSERT(args, lval_type(item) == LVAL_QEXPRESSION || lval_type(item) == LVAL_STRING,
             "function '%s' type mismatch - expected String or Q-Expression, received %s",
-            BUILTIN_SYM_JOIN, ltype_name(ptr->data->type));
+            BUILTIN_SYM_JOIN, ltype_name(lval_type(item)));
 
-        LASSERT(args, x->type == ptr->data->type,
+        LASSERT(args, lval_type(x) == lval_type(item),
             "function '%s' type mismatch - inconsistent argument types %s vs %s",
-            BUILTIN_SYM_JOIN, ltype_name(x->type), ltype_name(ptr->data->type));
+            BUILTIN_SYM_JOIN, ltype_name(lval_type(x)), ltype_name(lval_type(item)));
     }
 
+    if (lval_type(x) == LVAL_STRING)
+    {
+        x = lval_join_string(x, args);
+        lval_del(args);
+        return x;
+    }
+
+    x = lval_unshare(x);
     while (LVAL_EXPR_CNT(args))
     {
-        if (LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION)
-        {
-            x = lval_join_qexpr(x, lval_pop(args));
-        }
-        else
-        {
-            x = lval_join_string(x, lval_pop(args));
-        }
+        x = lval_join_qexpr(x, lval_pop(args));
     }
 
     lval_del(args);
     return x;
 }
 
+/**
+ * Built-in function to return part of a string. Takes the string, the index
+ * of the first character and the index one past the last character.
+ */
+static lval *builtin_substring(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SUBSTRING);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 3, BUILTIN_SYM_SUBSTRING);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 0), LVAL_STRING, BUILTIN_SYM_SUBSTRING);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 1), LVAL_LONG, BUILTIN_SYM_SUBSTRING);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 2), LVAL_LONG, BUILTIN_SYM_SUBSTRING);
+
+    lval *str = LVAL_EXPR_ITEM(args, 0);
+    long start = lval_as_long(LVAL_EXPR_ITEM(args, 1));
+    long end = lval_as_long(LVAL_EXPR_ITEM(args, 2));
+    LASSERT(args, start >= 0 && start <= end && (size_t)end <= str->value.str.len,
+        "function '%s' range %ld to %ld out of bounds for string of length %zu",
+        BUILTIN_SYM_SUBSTRING, start, end, str->value.str.len);
+
+    lval *rv = lval_substring(str, start, end - start);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Counts the items of a sequence, reading it to the end. Consumes seq.
+ */
+static lval *len_seq(lenv *env, lval *seq)
+{
+    long count = 0;
+    lval *x;
+    while ((x = seq_next(env, &seq)))
+    {
+        if (lval_type(x) == LVAL_ERROR)
+        {
+            lval_del(seq);
+            return x;
+        }
+
+        lval_del(x);
+        count++;
+    }
+
+    lval_del(seq);
+    return lval_long(count);
+}
+
 /**
  * Built-in function to return the number of items in a q-expression.
  */
@@ -252,12 +501,18 @@ static lval *builtin_len(lenv *env, lval *args)
     LASSERT_ENV(args, env, BUILTIN_SYM_LEN);
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_LEN);
-    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION || LVAL_EXPR_FIRST(args)->type == LVAL_STRING,
-        "function '%s' type mismatch - expected String or Q-Expression, received %s",
-        BUILTIN_SYM_LEN, ltype_name(LVAL_EXPR_FIRST(args)->type));
+    LASSERT(args, lval_type(LVAL_EXPR_FIRST(args)) == LVAL_QEXPRESSION || lval_type(LVAL_EXPR_FIRST(args)) == LVAL_STRING ||
+            lval_type(LVAL_EXPR_FIRST(args)) == LVAL_SEQ,
+        "function '%s' type mismatch - expected String, Q-Expression or Sequence, received %s",
+        BUILTIN_SYM_LEN, ltype_name(lval_type(LVAL_EXPR_FIRST(args))));
 
     lval *x = lval_take(args, 0);
-    lval *rv = x->type == LVAL_QEXPRESSION ? lval_long(LVAL_EXPR_CNT(x)) : lval_long(strlen(x->value.str_val));
+    if (lval_type(x) == LVAL_SEQ)
+    {
+        return len_seq(env, x);
+    }
+
+    lval *rv = lval_type(x) == LVAL_QEXPRESSION ? lval_long(LVAL_EXPR_CNT(x)) : lval_long(x->value.str.len);
     lval_del(x);
     return rv;
 }
@@ -271,19 +526,21 @@ static lval *builtin_cons(lenv *env, lval *args)
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_CONS);
     LASSERT(args,
-        LVAL_EXPR_FIRST(args)->type == LVAL_LONG || LVAL_EXPR_FIRST(args)->type == LVAL_DOUBLE ||
-            LVAL_EXPR_FIRST(args)->type == LVAL_BUILTIN_FUN || LVAL_EXPR_FIRST(args)->type == LVAL_USER_FUN,
+        lval_type(LVAL_EXPR_FIRST(args)) == LVAL_LONG || lval_type(LVAL_EXPR_FIRST(args)) == LVAL_DOUBLE ||
+            lval_type(LVAL_EXPR_FIRST(args)) == LVAL_BUILTIN_FUN || lval_type(LVAL_EXPR_FIRST(args)) == LVAL_USER_FUN,
         "first '%s' parameter should be a value or a function", BUILTIN_SYM_CONS);
-    LASSERT(args, lval_expr_item(args, 1)->type == LVAL_QEXPRESSION,
+    LASSERT(args, lval_type(lval_expr_item(args, 1)) == LVAL_QEXPRESSION,
         "second '%s' parameter should be a q-expression", BUILTIN_SYM_CONS);
 
+    lval *list = LVAL_EXPR_ITEM(args, 1);
     lval *rv = lval_qexpression();
-    rv = lval_add(rv, lval_pop(args));
-    while (LVAL_EXPR_CNT(LVAL_EXPR_FIRST(args)))
+    lval_expr_reserve(rv, LVAL_EXPR_CNT(list) + 1);
+    rv = lval_add(rv, lval_ref(LVAL_EXPR_FIRST(args)));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(list); i++)
     {
-        rv = lval_add(rv, lval_pop(LVAL_EXPR_FIRST(args)));
+        rv = lval_add(rv, lval_ref(LVAL_EXPR_ITEM(list, i)));
     }
-    
+
     lval_del(args);
     return rv;
 }
@@ -299,14 +556,9 @@ static lval *builtin_init(lenv *env, lval *args)
     LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_QEXPRESSION, BUILTIN_SYM_INIT);
     LASSERT(args, LVAL_EXPR_CNT(LVAL_EXPR_FIRST(args)) != 0, "empty q-expression passed to '%s'", BUILTIN_SYM_INIT);
 
-    lval *list = lval_take(args, 0);
-    lval *rv = lval_qexpression();
-    while (LVAL_EXPR_CNT(list) > 1)
-    {
-        lval_add(rv, lval_pop(list));
-    }
-
-    lval_del(args);
+    // Dropping the last item of an unshared list is a simple truncation
+    lval *rv = lval_unshare(lval_take(args, 0));
+    lval_del(LVAL_EXPR_ITEM(rv, --LVAL_EXPR_CNT(rv)));
     return rv;
 }
 
@@ -320,15 +572,15 @@ static lval *builtin_lambda(lenv *env, lval *args)
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_LAMBDA);
     LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_QEXPRESSION, BUILTIN_SYM_LAMBDA);
-    LASSERT_TYPE_ARG(args, args->value.list.head->next->data, LVAL_QEXPRESSION, BUILTIN_SYM_LAMBDA);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 1), LVAL_QEXPRESSION, BUILTIN_SYM_LAMBDA);
 
     // Check first q-expression contains only symbols
     lval *syms = LVAL_EXPR_FIRST(args);
-    for (pair *ptr = syms->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(syms); i++)
     {
-        LASSERT(args, ptr->data->type == LVAL_SYMBOL,
+        LASSERT(args, lval_type(LVAL_EXPR_ITEM(syms, i)) == LVAL_SYMBOL,
             "function '%s' type mismatch - expected %s, received %s",
-            BUILTIN_SYM_LAMBDA, ltype_name(LVAL_SYMBOL), ltype_name(ptr->data->type));
+            BUILTIN_SYM_LAMBDA, ltype_name(LVAL_SYMBOL), ltype_name(lval_type(LVAL_EXPR_ITEM(syms, i))));
     }
 
     // Pop first two arguments and pass them to lval_lambda
@@ -340,9 +592,9 @@ static lval *builtin_lambda(lenv *env, lval *args)
 }
 
 /**
- * Built-in function to evaluate an if expression.
+ * Body form of if. Hands back the branch chosen by the condition.
  */
-static lval *builtin_if(lenv *env, lval *args)
+static lval *builtin_if_body(lenv *env, lval *args, lval **body)
 {
     LASSERT_ENV(args, env, BUILTIN_SYM_IF);
     LASSERT_NO_ERROR(args);
@@ -355,23 +607,30 @@ static lval *builtin_if(lenv *env, lval *args)
     lval *br_true = lval_pop(args);
     lval *br_false = lval_pop(args);
 
-    lval *rv;
-    if (stmt->value.bval)
+    if (lval_as_bool(stmt))
     {
-        br_true->type = LVAL_SEXPRESSION;
-        rv = lilith_eval_expr(env, br_true);
+        *body = br_true;
         lval_del(br_false);
     }
     else
     {
-        br_false->type = LVAL_SEXPRESSION;
-        rv = lilith_eval_expr(env, br_false);
+        *body = br_false;
         lval_del(br_true);
     }
 
     lval_del(args);
     lval_del(stmt);
-    return rv;
+    return 0;
+}
+
+/**
+ * Built-in function to evaluate an if expression.
+ */
+static lval *builtin_if(lenv *env, lval *args)
+{
+    lval *body;
+    lval *rv = builtin_if_body(env, args, &body);
+    return eval_builtin_body(rv, env, env, body);
 }
 
 /**
@@ -379,12 +638,12 @@ static lval *builtin_if(lenv *env, lval *args)
  */
 static bool type_check(lval *x, lval *y)
 {
-    if (x->type == LVAL_LONG || x->type == LVAL_DOUBLE)
+    if (lval_type(x) == LVAL_LONG || lval_type(x) == LVAL_DOUBLE)
     {
-        return y->type == LVAL_LONG || y->type == LVAL_DOUBLE;
+        return lval_type(y) == LVAL_LONG || lval_type(y) == LVAL_DOUBLE;
     }
 
-    return x->type == y->type;
+    return lval_type(x) == lval_type(y);
 }
 
 /**
@@ -399,11 +658,11 @@ static lval *builtin_eq(lenv *env, lval *args)
     lval *x = lval_pop(args);
 
     // Confirm that all arguments are the same type
-    for (pair *ptr = args->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
     {
-        LASSERT(args, type_check(x, ptr->data),
+        LASSERT(args, type_check(x, LVAL_EXPR_ITEM(args, i)),
             "function '%s' type mismatch - inconsistent argument types %s vs %s",
-            BUILTIN_SYM_EQ, ltype_name(x->type), ltype_name(ptr->data->type));
+            BUILTIN_SYM_EQ, ltype_name(lval_type(x)), ltype_name(lval_type(LVAL_EXPR_ITEM(args, i))));
     }
 
     bool rv = true;
@@ -435,18 +694,18 @@ static lval *builtin_and(lenv *env, lval *args)
     LASSERT_NO_ERROR(args);
 
     // Confirm that all arguments are boolean
-    for (pair *ptr = args->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
     {
-        LASSERT(args, ptr->data->type == LVAL_BOOL,
+        LASSERT(args, lval_type(LVAL_EXPR_ITEM(args, i)) == LVAL_BOOL,
             "function '%s' type mismatch - expected %s, received %s",
-            BUILTIN_SYM_AND, LVAL_BOOL, ltype_name(ptr->data->type));
+            BUILTIN_SYM_AND, ltype_name(LVAL_BOOL), ltype_name(lval_type(LVAL_EXPR_ITEM(args, i))));
     }
 
     bool rv = true;
     while (LVAL_EXPR_CNT(args) > 0)
     {
         lval *x = lval_pop(args);
-        if (!x->value.bval)
+        if (!lval_as_bool(x))
         {
             rv = false;
             lval_del(x);
@@ -469,18 +728,18 @@ static lval *builtin_or(lenv *env, lval *args)
     LASSERT_NO_ERROR(args);
 
     // Confirm that all arguments are boolean
-    for (pair *ptr = args->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
     {
-        LASSERT(args, ptr->data->type == LVAL_BOOL,
+        LASSERT(args, lval_type(LVAL_EXPR_ITEM(args, i)) == LVAL_BOOL,
             "function '%s' type mismatch - expected %s, received %s",
-            BUILTIN_SYM_OR, LVAL_BOOL, ltype_name(ptr->data->type));
+            BUILTIN_SYM_OR, ltype_name(LVAL_BOOL), ltype_name(lval_type(LVAL_EXPR_ITEM(args, i))));
     }
 
     bool rv = false;
     while (LVAL_EXPR_CNT(args) > 0)
     {
         lval *x = lval_pop(args);
-        if (x->value.bval)
+        if (lval_as_bool(x))
         {
             rv = true;
             lval_del(x);
@@ -494,6 +753,24 @@ static lval *builtin_or(lenv *env, lval *args)
     return lval_bool(rv);
 }
 
+/**
+ * Built-in function to evaluate a sequence of expressions, returning the
+ * result of the final one.
+ */
+static lval *builtin_do(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_DO);
+    LASSERT_NO_ERROR(args);
+
+    if (LVAL_EXPR_CNT(args) == 0)
+    {
+        lval_del(args);
+        return lval_qexpression();
+    }
+
+    return lval_take(args, LVAL_EXPR_CNT(args) - 1);
+}
+
 /**
  * Built-in function to flip a boolean expression.
  */
@@ -505,7 +782,7 @@ static lval *builtin_not(lenv *env, lval *args)
     LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_BOOL, BUILTIN_SYM_NOT);
 
     lval *x = lval_take(args, 0);
-    lval *rv = lval_bool(!x->value.bval);
+    lval *rv = lval_bool(!lval_as_bool(x));
     lval_del(x);
     return rv;
 }
@@ -518,12 +795,17 @@ static lval *builtin_load(lenv *env, lval *args)
     LASSERT_ENV(args, env, BUILTIN_SYM_LOAD);
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_LOAD);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_STRING, BUILTIN_SYM_LOAD);
+
+    // Release the arguments before evaluating so the collector sees no values outside the environment
+    char *name = lval_string_dup(LVAL_EXPR_FIRST(args));
+    lval_del(args);
 
     lval *rv = 0;
-    char *fn = lookup_load_file(LVAL_EXPR_FIRST(args)->value.str_val);
+    char *fn = lookup_load_file(name);
     if (!fn)
     {
-        rv = lval_error("File not found %s", LVAL_EXPR_FIRST(args)->value.str_val);
+        rv = lval_error("File not found %s", name);
     }
     else
     {
@@ -532,7 +814,7 @@ static lval *builtin_load(lenv *env, lval *args)
         free(fn);
     }
 
-    lval_del(args);
+    free(name);
     return rv;
 }
 
@@ -544,9 +826,9 @@ static lval *builtin_print(lenv *env, lval *args)
     LASSERT_ENV(args, env, BUILTIN_SYM_PRINT);
     LASSERT_NO_ERROR(args);
 
-    for (pair *ptr = args->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
     {
-        lval_print(ptr->data, 1);
+        lval_print(LVAL_EXPR_ITEM(args, i), 1);
         putchar(' ');
     }
 
@@ -563,7 +845,11 @@ static lval *builtin_error(lenv *env, lval *args)
 {
     LASSERT_ENV(args, env, BUILTIN_SYM_ERROR);
     LASSERT_NO_ERROR(args);
-    lval *err = lval_error(LVAL_EXPR_FIRST(args)->value.str_val);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_ERROR);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_STRING, BUILTIN_SYM_ERROR);
+
+    lval *msg = LVAL_EXPR_FIRST(args);
+    lval *err = lval_error("%.*s", (int)msg->value.str.len, msg->value.str.ptr);
     lval_del(args);
     return err;
 }
@@ -576,9 +862,12 @@ static lval *builtin_read(lenv *env, lval *args)
     LASSERT_ENV(args, env, BUILTIN_SYM_READ);
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_READ);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_STRING, BUILTIN_SYM_READ);
 
-    lval *expr = lilith_read_from_string(LVAL_EXPR_FIRST(args)->value.str_val);
-    if (expr->type == LVAL_ERROR)
+    char *input = lval_string_dup(LVAL_EXPR_FIRST(args));
+    lval *expr = lilith_read_from_string(input);
+    free(input);
+    if (lval_type(expr) == LVAL_ERROR)
     {
         return expr;
     }
@@ -600,6 +889,141 @@ static lval *builtin_env(lenv *env, lval *args)
     return lenv_to_lval(env);
 }
 
+/**
+ * Appends a pool's name and counters to a q-expression.
+ */
+static lval *pool_stats(lval *rv, const pool *p)
+{
+    lval *stats = lval_qexpression();
+    lval_add(stats, lval_string(p->name));
+    lval_add(stats, lval_long(p->in_use));
+    lval_add(stats, lval_long(p->high_water));
+    lval_add(stats, lval_long(p->capacity));
+    return lval_add(rv, stats);
+}
+
+/**
+ * Built-in function to return the slab pool counters. Each pool is reported
+ * as a q-expression of name, objects in use, high-water mark and capacity.
+ */
+static lval *builtin_pool_stats(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_POOL_STATS);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 0, BUILTIN_SYM_POOL_STATS);
+
+    lval_del(args);
+    lval *rv = lval_qexpression();
+    return pool_stats(rv, &lval_pool);
+}
+
+/**
+ * Built-in function to ask for a garbage collection once the current top-level
+ * expression has been evaluated. Collections only happen between top-level
+ * expressions, so cycles made inside a long-running one are not reclaimed
+ * until it finishes.
+ */
+static lval *builtin_gc(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_GC);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 0, BUILTIN_SYM_GC);
+
+    gc_request();
+    lval_del(args);
+    return lval_sexpression();
+}
+
+/**
+ * Appends a named counter to a q-expression.
+ */
+static lval *gc_stat(lval *rv, const char *name, size_t value)
+{
+    lval *stat = lval_qexpression();
+    lval_add(stat, lval_string(name));
+    lval_add(stat, lval_long(value));
+    return lval_add(rv, stat);
+}
+
+/**
+ * Built-in function to return the garbage collector counters as a q-expression
+ * of name and value pairs.
+ */
+static lval *builtin_gc_stats(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_GC_STATS);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 0, BUILTIN_SYM_GC_STATS);
+
+    lval_del(args);
+    lval *rv = lval_qexpression();
+    gc_stat(rv, "collections", gc_stats.collections);
+    gc_stat(rv, "pause-us", gc_stats.pause_us);
+    gc_stat(rv, "max-pause-us", gc_stats.max_pause_us);
+    gc_stat(rv, "objects-reclaimed", gc_stats.objects_reclaimed);
+    return gc_stat(rv, "bytes-reclaimed", gc_stats.bytes_reclaimed);
+}
+
+/**
+ * Built-in function to print the bytecode compiled for a user function's body.
+ */
+static lval *builtin_disassemble(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_DISASSEMBLE);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_DISASSEMBLE);
+    LASSERT(args, lval_type(LVAL_EXPR_FIRST(args)) == LVAL_USER_FUN,
+        "function '%s' type mismatch - expected a user-defined function", BUILTIN_SYM_DISASSEMBLE);
+
+    lval *func = LVAL_EXPR_FIRST(args);
+    lcode *code = lval_compile(func->value.user_fun.body, env);
+    printf("formals ");
+    lval_print(func->value.user_fun.formals, 0);
+    printf(", %zu constants, stack depth %zu\n", code->const_count, code->max_stack);
+    if (code->opt)
+    {
+        printf("optimised to ");
+        lval_print(LVAL_EXPR_FIRST(code->opt), 0);
+        printf(", %zu guards\n", code->guard_count);
+    }
+
+    lcode_disassemble(code);
+    if (code->jit)
+    {
+        printf("compiled to %zu bytes of native code\n", jit_size(code->jit));
+    }
+
+    lval_del(args);
+    return lval_sexpression();
+}
+
+/**
+ * Built-in function returning a user function's body as the optimiser rewrote
+ * it, or as written if there was nothing to optimise.
+ */
+static lval *builtin_optimised(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_OPTIMISED);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_OPTIMISED);
+    LASSERT(args, lval_type(LVAL_EXPR_FIRST(args)) == LVAL_USER_FUN,
+        "function '%s' type mismatch - expected a user-defined function", BUILTIN_SYM_OPTIMISED);
+
+    // Bodies in the arena and those compiled ahead of time are not optimised when compiled, so are optimised here
+    lval *body = LVAL_EXPR_FIRST(args)->value.user_fun.body;
+    lcode *code = lval_compile(body, env);
+    lval *opt = code->opt ? lval_ref(code->opt) : lval_optimise(env, body);
+    lval *rv = lval_copy(opt ? LVAL_EXPR_FIRST(opt) : body);
+    rv->type = LVAL_QEXPRESSION;
+    if (opt)
+    {
+        lval_del(opt);
+    }
+
+    lval_del(args);
+    return rv;
+}
+
 /**
  * Built-in function to handle errors. If the first argument
  * is an error then eval the second expression.
@@ -608,15 +1032,13 @@ static lval *builtin_try(lenv *env, lval *args)
 {
     LASSERT_ENV(args, env, BUILTIN_SYM_TRY);
     LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_TRY);
-    LASSERT_TYPE_ARG(args, args->value.list.head->next->data, LVAL_QEXPRESSION, BUILTIN_SYM_TRY);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 1), LVAL_QEXPRESSION, BUILTIN_SYM_TRY);
 
     lval *res = lval_pop(args);
-    if (res->type == LVAL_ERROR)
+    if (lval_type(res) == LVAL_ERROR)
     {
         lval_del(res);
-        lval *handler = lval_pop(args);
-        handler->type = LVAL_SEXPRESSION;
-        res = lilith_eval_expr(env, handler);
+        res = lval_eval_body(env, lval_pop(args));
     }
 
     lval_del(args);
@@ -632,7 +1054,7 @@ static lval *check_type(lenv *env, lval *args, unsigned type, const char *fname)
     LASSERT_NO_ERROR(args);
     LASSERT_NUM_ARGS(args, 1, fname);
 
-    lval *rv = lval_bool(LVAL_EXPR_FIRST(args)->type == type);
+    lval *rv = lval_bool(lval_type(LVAL_EXPR_FIRST(args)) == type);
     lval_del(args);
     return rv;
 }
@@ -667,24 +1089,63 @@ static lval *builtin_is_sexpr(lenv *env, lval *args)
     return check_type(env, args, LVAL_SEXPRESSION, BUILTIN_SYM_IS_SEXPR);
 }
 
+static lval *builtin_is_seq(lenv *env, lval *args)
+{
+    return check_type(env, args, LVAL_SEQ, BUILTIN_SYM_IS_SEQ);
+}
+
+lval *call_builtin_body(lenv *env, lval *func, lval *args, lenv **frame, lval **body)
+{
+    lbuiltin builtin = func->value.builtin;
+    lval_del(func);
+
+    if (builtin == builtin_if)
+    {
+        return builtin_if_body(env, args, body);
+    }
+
+    if (builtin == builtin_eval)
+    {
+        return builtin_eval_body(env, args, body);
+    }
+
+    if (builtin == builtin_unpack)
+    {
+        return builtin_unpack_body(env, args, body);
+    }
+
+    if (builtin == builtin_let)
+    {
+        return builtin_let_body(env, args, frame, body);
+    }
+
+    return builtin(env, args);
+}
+
 void lenv_add_builtin(lenv *env, char *name, lbuiltin func)
 {
+    // Built-ins can never be rebound so references to them are resolved through the symbol table
     lval *k = lval_symbol(name);
-    lval *v = lval_fun(func);
-
-    lenv_put(env, k, v);
+    lenv_put(env, k, symbol_bind_builtin(k->value.sym.id, func));
     lval_del(k);
-    lval_del(v);
 }
 
-lval *call_builtin(lenv *env, char *symbol, lval *args)
+lval *call_builtin(lenv *env, unsigned id, lval *args)
 {
-    lval *k = lval_symbol(symbol);
-    lval *f = lenv_get(env, k);
-    lval_del(k);
-    lval *rv = f->value.builtin(env, args);
-    lval_del(f);
-    return rv;
+    return symbol_builtin(id)->value.builtin(env, args);
+}
+
+lval *builtin_partial(lenv *env, lval *args, const char *name, const char *const *params, size_t count)
+{
+    lval *formals = lval_qexpression();
+    lval *body = lval_add(lval_qexpression(), lval_symbol(name));
+    for (size_t i = 0; i < count; i++)
+    {
+        lval_add(formals, lval_symbol(params[i]));
+        lval_add(body, lval_symbol(params[i]));
+    }
+
+    return lval_call(env, lval_lambda(formals, body), args);
 }
 
 void lenv_add_builtin_core(lenv *e)
@@ -695,8 +1156,10 @@ void lenv_add_builtin_core(lenv *e)
     lenv_add_builtin(e, BUILTIN_SYM_HEAD, builtin_head);
     lenv_add_builtin(e, BUILTIN_SYM_TAIL, builtin_tail);
     lenv_add_builtin(e, BUILTIN_SYM_EVAL, builtin_eval);
+    lenv_add_builtin(e, BUILTIN_SYM_UNPACK, builtin_unpack);
     lenv_add_builtin(e, BUILTIN_SYM_JOIN, builtin_join);
     lenv_add_builtin(e, BUILTIN_SYM_LEN, builtin_len);
+    lenv_add_builtin(e, BUILTIN_SYM_SUBSTRING, builtin_substring);
     lenv_add_builtin(e, BUILTIN_SYM_CONS, builtin_cons);
     lenv_add_builtin(e, BUILTIN_SYM_INIT, builtin_init);
     lenv_add_builtin(e, BUILTIN_SYM_LAMBDA, builtin_lambda);
@@ -705,25 +1168,32 @@ void lenv_add_builtin_core(lenv *e)
     lenv_add_builtin(e, BUILTIN_SYM_AND, builtin_and);
     lenv_add_builtin(e, BUILTIN_SYM_OR, builtin_or);
     lenv_add_builtin(e, BUILTIN_SYM_NOT, builtin_not);
+    lenv_add_builtin(e, BUILTIN_SYM_DO, builtin_do);
     lenv_add_builtin(e, BUILTIN_SYM_LOAD, builtin_load);
     lenv_add_builtin(e, BUILTIN_SYM_PRINT, builtin_print);
     lenv_add_builtin(e, BUILTIN_SYM_ERROR, builtin_error);
     lenv_add_builtin(e, BUILTIN_SYM_READ, builtin_read);
     lenv_add_builtin(e, BUILTIN_SYM_ENV, builtin_env);
     lenv_add_builtin(e, BUILTIN_SYM_TRY, builtin_try);
+    lenv_add_builtin(e, BUILTIN_SYM_POOL_STATS, builtin_pool_stats);
+    lenv_add_builtin(e, BUILTIN_SYM_GC, builtin_gc);
+    lenv_add_builtin(e, BUILTIN_SYM_GC_STATS, builtin_gc_stats);
+    lenv_add_builtin(e, BUILTIN_SYM_DISASSEMBLE, builtin_disassemble);
+    lenv_add_builtin(e, BUILTIN_SYM_OPTIMISED, builtin_optimised);
     lenv_add_builtin(e, BUILTIN_SYM_IS_STRING, builtin_is_string);
     lenv_add_builtin(e, BUILTIN_SYM_IS_LONG, builtin_is_long);
     lenv_add_builtin(e, BUILTIN_SYM_IS_DOUBLE, builtin_is_double);
     lenv_add_builtin(e, BUILTIN_SYM_IS_BOOL, builtin_is_bool);
     lenv_add_builtin(e, BUILTIN_SYM_IS_QEXPR, builtin_is_qexpr);
     lenv_add_builtin(e, BUILTIN_SYM_IS_SEXPR, builtin_is_sexpr);
+    lenv_add_builtin(e, BUILTIN_SYM_IS_SEQ, builtin_is_seq);
 }
 
 void lilith_eval_file(lenv *env, const char *filename)
 {
     lval *args = lval_add(lval_sexpression(), lval_string(filename));
     lval *x = builtin_load(env, args);
-    if (x->type == LVAL_ERROR)
+    if (lval_type(x) == LVAL_ERROR)
     {
         lilith_println(x);
     }
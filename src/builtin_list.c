@@ -0,0 +1,1162 @@
+/*
+ * Built-in functions for processing lists. Each works through the list in a
+ * single pass where the standard library's versions in Lilith, kept there
+ * under a lilith- prefix, take the list apart with tail and put it back
+ * together with join.
+ */
+
+#include <math.h>
+#include <limits.h>
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+/**
+ * IDs of the built-ins the list functions call.
+ */
+static unsigned eq_id;
+static unsigned eval_id;
+
+/**
+ * IDs of the list functions a -> pipeline can run in a single pass.
+ */
+static unsigned map_id;
+static unsigned filter_id;
+static unsigned foldl_id;
+static unsigned length_id;
+
+/**
+ * Returns an item of a list as fst gives it -- evaluated as an s-expression on
+ * its own. Most items are values that evaluate to themselves.
+ */
+static lval *list_item(lenv *env, lval *item)
+{
+    unsigned type = lval_type(item);
+    if (type != LVAL_SYMBOL && type != LVAL_SEXPRESSION && type != LVAL_BUILTIN_FUN)
+    {
+        return lval_ref(item);
+    }
+
+    return lilith_eval_expr(env, lval_add(lval_sexpression(), lval_ref(item)));
+}
+
+/**
+ * Calls f as the evaluator would if it started an s-expression. Consumes args.
+ */
+static lval *list_call(lenv *env, lval *f, lval *args)
+{
+    if (lval_type(f) != LVAL_BUILTIN_FUN && lval_type(f) != LVAL_USER_FUN)
+    {
+        lval_del(args);
+        return lval_type(f) == LVAL_ERROR ? lval_ref(f) :
+            lval_error("s-expression does not start with function, '%s'", ltype_name(lval_type(f)));
+    }
+
+    return lval_call(env, lval_ref(f), args);
+}
+
+/**
+ * Calls f with a single argument.
+ */
+static lval *list_call_1(lenv *env, lval *f, lval *x)
+{
+    return list_call(env, f, lval_add(lval_sexpression(), x));
+}
+
+/**
+ * Keeps the first error seen, releasing later ones.
+ */
+static void list_error(lval **err, lval *x)
+{
+    if (*err)
+    {
+        lval_del(x);
+    }
+    else
+    {
+        *err = x;
+    }
+}
+
+/**
+ * The error the Lilith version of filter gives for a predicate that returns
+ * something other than a boolean, as it tests the result with if.
+ */
+static lval *list_test_error(lval *x)
+{
+    return lval_error("function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_IF, ltype_name(LVAL_BOOL), ltype_name(lval_type(x)));
+}
+
+/**
+ * Fills in a cell as read, holding item -- promoted out of the arena -- and
+ * then the sequence rest. Consumes item and rest.
+ */
+static void seq_item(lval *seq, lval *item, lval *rest)
+{
+    seq->value.seq.source = LSEQ_ITEM;
+    seq->value.seq.item.first = lval_promote(item);
+    seq->value.seq.item.rest = rest;
+    lval_del(item);
+}
+
+/**
+ * Fills in a cell as read with an item that ends the sequence, as an error does.
+ */
+static void seq_last(lval *seq, lval *item)
+{
+    seq_item(seq, item, lval_seq(LSEQ_END));
+}
+
+/**
+ * Returns a new cell reading from a function, or a sequence that goes on to
+ * read from it. Consumes fn and from.
+ */
+static lval *seq_call(unsigned source, lval *fn, lval *from)
+{
+    lval *rv = lval_seq(source);
+    rv->value.seq.call.fn = fn;
+    rv->value.seq.call.from = from;
+    return rv;
+}
+
+/**
+ * Reads a cell that maps the items of another sequence with a function.
+ * Errors pass through, as do the end of the other sequence.
+ */
+static void seq_read_map(lenv *env, lval *seq, lval *fn, lval *from)
+{
+    seq_read(env, from);
+    if (from->value.seq.source == LSEQ_END)
+    {
+        seq->value.seq.source = LSEQ_END;
+        lval_del(fn);
+        lval_del(from);
+        return;
+    }
+
+    lval *item = from->value.seq.item.first;
+    lval *x = lval_type(item) == LVAL_ERROR ? lval_ref(item) : list_call_1(env, fn, list_item(env, item));
+    if (lval_type(x) == LVAL_ERROR)
+    {
+        seq_last(seq, x);
+        lval_del(fn);
+    }
+    else
+    {
+        seq_item(seq, x, seq_call(LSEQ_MAP, fn, lval_ref(from->value.seq.item.rest)));
+    }
+
+    lval_del(from);
+}
+
+/**
+ * Reads a cell that keeps the items of another sequence a predicate is true
+ * for, reading as far through the other sequence as it needs to.
+ */
+static void seq_read_filter(lenv *env, lval *seq, lval *fn, lval *from)
+{
+    for (;;)
+    {
+        seq_read(env, from);
+        if (from->value.seq.source == LSEQ_END)
+        {
+            seq->value.seq.source = LSEQ_END;
+            lval_del(fn);
+            lval_del(from);
+            return;
+        }
+
+        lval *item = from->value.seq.item.first;
+        lval *x = lval_type(item) == LVAL_ERROR ? lval_ref(item) : list_call_1(env, fn, list_item(env, item));
+        if (x == LVAL_TRUE)
+        {
+            seq_item(seq, lval_ref(item), seq_call(LSEQ_FILTER, fn, lval_ref(from->value.seq.item.rest)));
+            lval_del(from);
+            return;
+        }
+
+        if (x != LVAL_FALSE)
+        {
+            if (lval_type(x) != LVAL_ERROR)
+            {
+                lval *test = x;
+                x = list_test_error(test);
+                lval_del(test);
+            }
+
+            seq_last(seq, x);
+            lval_del(fn);
+            lval_del(from);
+            return;
+        }
+
+        lval *rest = lval_ref(from->value.seq.item.rest);
+        lval_del(from);
+        from = rest;
+    }
+}
+
+void seq_read(lenv *env, lval *seq)
+{
+    switch (seq->value.seq.source)
+    {
+    case LSEQ_ITEM:
+    case LSEQ_END:
+        return;
+    case LSEQ_CALL:
+    {
+        lval *fn = seq->value.seq.call.fn;
+        lval *x = list_call(env, fn, lval_sexpression());
+        if (lval_type(x) == LVAL_QEXPRESSION && !LVAL_EXPR_CNT(x))
+        {
+            seq->value.seq.source = LSEQ_END;
+            lval_del(x);
+        }
+        else if (lval_type(x) == LVAL_ERROR)
+        {
+            seq_last(seq, x);
+        }
+        else
+        {
+            seq_item(seq, x, seq_call(LSEQ_CALL, lval_ref(fn), 0));
+        }
+
+        lval_del(fn);
+        return;
+    }
+    case LSEQ_LIST:
+    {
+        lval *list = seq->value.seq.list.list;
+        size_t at = seq->value.seq.list.at;
+        if (at == LVAL_EXPR_CNT(list))
+        {
+            seq->value.seq.source = LSEQ_END;
+            lval_del(list);
+            return;
+        }
+
+        lval *rest = lval_seq(LSEQ_LIST);
+        rest->value.seq.list.list = list;
+        rest->value.seq.list.at = at + 1;
+        seq_item(seq, lval_ref(LVAL_EXPR_ITEM(list, at)), rest);
+        return;
+    }
+    case LSEQ_RANGE:
+    {
+        long at = seq->value.seq.range.at;
+        long to = seq->value.seq.range.to;
+        if (at >= to)
+        {
+            seq->value.seq.source = LSEQ_END;
+            return;
+        }
+
+        lval *rest = lval_seq(LSEQ_RANGE);
+        rest->value.seq.range.at = at + 1;
+        rest->value.seq.range.to = to;
+        seq_item(seq, lval_long(at), rest);
+        return;
+    }
+    case LSEQ_LINES:
+    {
+        FILE *file = seq->value.seq.file;
+        char *line = 0;
+        size_t capacity = 0;
+        ssize_t len = getline(&line, &capacity, file);
+        if (len < 0)
+        {
+            seq->value.seq.source = LSEQ_END;
+            fclose(file);
+        }
+        else
+        {
+            if (len && line[len - 1] == '\n')
+            {
+                len--;
+            }
+
+            lval *rest = lval_seq(LSEQ_LINES);
+            rest->value.seq.file = file;
+            seq_item(seq, lval_string_len(line, len), rest);
+        }
+
+        free(line);
+        return;
+    }
+    case LSEQ_MAP:
+        seq_read_map(env, seq, seq->value.seq.call.fn, seq->value.seq.call.from);
+        return;
+    case LSEQ_FILTER:
+        seq_read_filter(env, seq, seq->value.seq.call.fn, seq->value.seq.call.from);
+        return;
+    case LSEQ_TAKE:
+    {
+        long n = seq->value.seq.take.n;
+        lval *from = seq->value.seq.take.from;
+        if (n)
+        {
+            seq_read(env, from);
+        }
+
+        if (!n || from->value.seq.source == LSEQ_END)
+        {
+            seq->value.seq.source = LSEQ_END;
+        }
+        else
+        {
+            lval *rest = lval_seq(LSEQ_TAKE);
+            rest->value.seq.take.n = n - 1;
+            rest->value.seq.take.from = lval_ref(from->value.seq.item.rest);
+            seq_item(seq, lval_ref(from->value.seq.item.first), rest);
+        }
+
+        lval_del(from);
+        return;
+    }
+    case LSEQ_JOIN:
+    {
+        lval *from = seq->value.seq.join.from;
+        lval *next = seq->value.seq.join.next;
+        seq_read(env, from);
+        if (from->value.seq.source == LSEQ_END)
+        {
+            // The cell becomes the first cell of the next sequence
+            seq_read(env, next);
+            if (next->value.seq.source == LSEQ_END)
+            {
+                seq->value.seq.source = LSEQ_END;
+            }
+            else
+            {
+                seq_item(seq, lval_ref(next->value.seq.item.first), lval_ref(next->value.seq.item.rest));
+            }
+
+            lval_del(next);
+        }
+        else
+        {
+            lval *rest = lval_seq(LSEQ_JOIN);
+            rest->value.seq.join.from = lval_ref(from->value.seq.item.rest);
+            rest->value.seq.join.next = next;
+            seq_item(seq, lval_ref(from->value.seq.item.first), rest);
+        }
+
+        lval_del(from);
+        return;
+    }
+    }
+}
+
+lval *seq_next(lenv *env, lval **seq)
+{
+    lval *cell = *seq;
+    seq_read(env, cell);
+    if (cell->value.seq.source == LSEQ_END)
+    {
+        return 0;
+    }
+
+    lval *rv = lval_ref(cell->value.seq.item.first);
+    *seq = lval_ref(cell->value.seq.item.rest);
+    lval_del(cell);
+    return rv;
+}
+
+/**
+ * Removes the sequence at the end of a built-in's arguments, so the cells a
+ * built-in reads past can be freed as it goes rather than kept by the
+ * arguments until it returns.
+ */
+static lval *seq_arg(lval *args)
+{
+    lval *seq = LVAL_EXPR_ITEM(args, LVAL_EXPR_CNT(args) - 1);
+    if (args->refs > 1)
+    {
+        return lval_ref(seq);
+    }
+
+    LVAL_EXPR_CNT(args)--;
+    return seq;
+}
+
+/**
+ * Checks a built-in's list argument is a q-expression or a sequence.
+ */
+#define LASSERT_LIST_ARG(args, val, arg_symbol)                                                      \
+    LASSERT(args, lval_type(val) == LVAL_QEXPRESSION || lval_type(val) == LVAL_SEQ,                   \
+        "function '%s' type mismatch - expected Q-Expression or Sequence, received %s", arg_symbol, \
+        ltype_name(lval_type(val)))
+
+/**
+ * Returns a count passed to a built-in as a long. Like the Lilith versions,
+ * which counted down to zero, the built-ins take a decimal with no fractional
+ * part as a count.
+ */
+static long list_count(const lval *v)
+{
+    return lval_type(v) == LVAL_LONG ? lval_as_long(v) : (long)lval_as_double(v);
+}
+
+/**
+ * Returns false for a decimal with a fractional part or too large for a long.
+ */
+static bool list_is_whole(const lval *v)
+{
+    if (lval_type(v) != LVAL_DOUBLE)
+    {
+        return true;
+    }
+
+    double d = lval_as_double(v);
+    return d == floor(d) && d >= (double)LONG_MIN && d < -(double)LONG_MIN;
+}
+
+/**
+ * Checks a built-in's count argument is a whole number.
+ */
+#define LASSERT_COUNT_ARG(args, val, arg_symbol)                                                             \
+    do                                                                                                       \
+    {                                                                                                        \
+        LASSERT(args, lval_type(val) == LVAL_LONG || lval_type(val) == LVAL_DOUBLE,                          \
+            "function '%s' type mismatch - expected %s, received %s", arg_symbol, ltype_name(LVAL_LONG),     \
+            ltype_name(lval_type(val)));                                                                     \
+        LASSERT(args, list_is_whole(val),                                                                    \
+            "function '%s' passed a count that is not a whole number", arg_symbol);                          \
+    } while (0)
+
+/**
+ * Built-in function to call a function on each item of a list, giving a list
+ * of the results. Every item is visited, as in the Lilith version, but the
+ * first error is returned in place of the list. A sequence gives a sequence
+ * that calls the function as each item is read, ending at the first error.
+ */
+static lval *builtin_map(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_MAP);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_MAP, "f", "l");
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_MAP);
+    LASSERT_LIST_ARG(args, LVAL_EXPR_ITEM(args, 1), BUILTIN_SYM_MAP);
+
+    lval *f = LVAL_EXPR_ITEM(args, 0);
+    lval *list = LVAL_EXPR_ITEM(args, 1);
+    if (lval_type(list) == LVAL_SEQ)
+    {
+        lval *rv = seq_call(LSEQ_MAP, lval_promote(f), lval_ref(list));
+        lval_del(args);
+        return rv;
+    }
+
+    lval *rv = lval_qexpression();
+    lval *err = 0;
+    lval_expr_reserve(rv, LVAL_EXPR_CNT(list));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(list); i++)
+    {
+        lval *x = list_call_1(env, f, list_item(env, LVAL_EXPR_ITEM(list, i)));
+        if (lval_type(x) == LVAL_ERROR)
+        {
+            list_error(&err, x);
+        }
+        else
+        {
+            lval_add(rv, x);
+        }
+    }
+
+    lval_del(args);
+    if (err)
+    {
+        lval_del(rv);
+        return err;
+    }
+
+    return rv;
+}
+
+/**
+ * Built-in function to keep the items of a list for which a predicate is true.
+ * A sequence gives a sequence that tests each item as it is read.
+ */
+static lval *builtin_filter(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_FILTER);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_FILTER, "f", "l");
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_FILTER);
+    LASSERT_LIST_ARG(args, LVAL_EXPR_ITEM(args, 1), BUILTIN_SYM_FILTER);
+
+    lval *f = LVAL_EXPR_ITEM(args, 0);
+    lval *list = LVAL_EXPR_ITEM(args, 1);
+    if (lval_type(list) == LVAL_SEQ)
+    {
+        lval *rv = seq_call(LSEQ_FILTER, lval_promote(f), lval_ref(list));
+        lval_del(args);
+        return rv;
+    }
+
+    lval *rv = lval_qexpression();
+    lval *err = 0;
+    for (size_t i = 0; i < LVAL_EXPR_CNT(list); i++)
+    {
+        lval *item = LVAL_EXPR_ITEM(list, i);
+        lval *x = list_call_1(env, f, list_item(env, item));
+        if (x == LVAL_TRUE)
+        {
+            lval_add(rv, lval_ref(item));
+        }
+        else if (lval_type(x) == LVAL_ERROR)
+        {
+            list_error(&err, x);
+        }
+        else if (x != LVAL_FALSE)
+        {
+            list_error(&err, list_test_error(x));
+            lval_del(x);
+        }
+    }
+
+    lval_del(args);
+    if (err)
+    {
+        lval_del(rv);
+        return err;
+    }
+
+    return rv;
+}
+
+/**
+ * Reads past up to n items of a sequence, giving the number there were. Stops
+ * at an error, which is returned through err.
+ */
+static size_t seq_skip(lenv *env, lval **seq, size_t n, lval **err)
+{
+    size_t rv = 0;
+    lval *x;
+    while (rv < n && (x = seq_next(env, seq)))
+    {
+        if (lval_type(x) == LVAL_ERROR)
+        {
+            *err = x;
+            break;
+        }
+
+        lval_del(x);
+        rv++;
+    }
+
+    return rv;
+}
+
+/**
+ * foldl over a sequence. Each item is released once it has been added in, and
+ * the sequence is read no further once the value is an error.
+ */
+static lval *foldl_seq(lenv *env, lval *args)
+{
+    lval *seq = seq_arg(args);
+    lval *f = LVAL_EXPR_ITEM(args, 0);
+    lval *rv = lval_ref(LVAL_EXPR_ITEM(args, 1));
+    lval *x;
+    while (lval_type(rv) != LVAL_ERROR && (x = seq_next(env, &seq)))
+    {
+        if (lval_type(x) == LVAL_ERROR)
+        {
+            lval_del(rv);
+            rv = x;
+            break;
+        }
+
+        lval *pair = lval_add(lval_sexpression(), rv);
+        rv = list_call(env, f, lval_add(pair, list_item(env, x)));
+        lval_del(x);
+    }
+
+    lval_del(seq);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to accumulate a value by calling a function with the value
+ * so far and each item of a list in turn.
+ */
+static lval *builtin_foldl(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_FOLDL);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_FOLDL, "f", "z", "l");
+    LASSERT_NUM_ARGS(args, 3, BUILTIN_SYM_FOLDL);
+    LASSERT_LIST_ARG(args, LVAL_EXPR_ITEM(args, 2), BUILTIN_SYM_FOLDL);
+    if (lval_type(LVAL_EXPR_ITEM(args, 2)) == LVAL_SEQ)
+    {
+        return foldl_seq(env, args);
+    }
+
+    lval *f = LVAL_EXPR_ITEM(args, 0);
+    lval *list = LVAL_EXPR_ITEM(args, 2);
+    lval *rv = lval_ref(LVAL_EXPR_ITEM(args, 1));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(list); i++)
+    {
+        lval *pair = lval_add(lval_sexpression(), rv);
+        rv = list_call(env, f, lval_add(pair, list_item(env, LVAL_EXPR_ITEM(list, i))));
+    }
+
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to return the n-th item of a list, counting from zero.
+ */
+static lval *builtin_nth(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_NTH);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_NTH, "n", "l");
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_NTH);
+    LASSERT_COUNT_ARG(args, LVAL_EXPR_ITEM(args, 0), BUILTIN_SYM_NTH);
+    LASSERT_LIST_ARG(args, LVAL_EXPR_ITEM(args, 1), BUILTIN_SYM_NTH);
+
+    long n = list_count(LVAL_EXPR_ITEM(args, 0));
+    lval *list = LVAL_EXPR_ITEM(args, 1);
+    if (lval_type(list) == LVAL_SEQ)
+    {
+        LASSERT(args, n >= 0, "function '%s' index %ld out of bounds", BUILTIN_SYM_NTH, n);
+
+        lval *seq = seq_arg(args);
+        lval *rv = 0;
+        size_t count = seq_skip(env, &seq, n, &rv);
+        lval *x = rv ? 0 : seq_next(env, &seq);
+        if (x)
+        {
+            rv = list_item(env, x);
+            lval_del(x);
+        }
+        else if (!rv)
+        {
+            rv = lval_error("function '%s' index %ld out of bounds for sequence of length %zu", BUILTIN_SYM_NTH, n, count);
+        }
+
+        lval_del(seq);
+        lval_del(args);
+        return rv;
+    }
+
+    LASSERT(args, n >= 0 && (size_t)n < LVAL_EXPR_CNT(list),
+        "function '%s' index %ld out of bounds for list of length %zu", BUILTIN_SYM_NTH, n, LVAL_EXPR_CNT(list));
+
+    lval *rv = list_item(env, LVAL_EXPR_ITEM(list, n));
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to return the last item of a list.
+ */
+static lval *builtin_last(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_LAST);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_LAST, "l");
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_LAST);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_QEXPRESSION, BUILTIN_SYM_LAST);
+
+    lval *list = LVAL_EXPR_FIRST(args);
+    LASSERT(args, LVAL_EXPR_CNT(list) != 0, "empty q-expression passed to '%s'", BUILTIN_SYM_LAST);
+
+    lval *rv = list_item(env, LVAL_EXPR_ITEM(list, LVAL_EXPR_CNT(list) - 1));
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to return the number of items in a list.
+ */
+static lval *builtin_length(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_LENGTH);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_LENGTH, "l");
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_LENGTH);
+    LASSERT_LIST_ARG(args, LVAL_EXPR_FIRST(args), BUILTIN_SYM_LENGTH);
+
+    lval *rv;
+    if (lval_type(LVAL_EXPR_FIRST(args)) == LVAL_SEQ)
+    {
+        lval *seq = seq_arg(args);
+        lval *err = 0;
+        size_t count = seq_skip(env, &seq, SIZE_MAX, &err);
+        rv = err ? err : lval_long(count);
+        lval_del(seq);
+    }
+    else
+    {
+        rv = lval_long(LVAL_EXPR_CNT(LVAL_EXPR_FIRST(args)));
+    }
+
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to return the first n items of a list. A sequence gives a
+ * sequence of its first n items, or of all of them if it has fewer.
+ */
+static lval *builtin_take(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_TAKE);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_TAKE, "n", "l");
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_TAKE);
+    LASSERT_COUNT_ARG(args, LVAL_EXPR_ITEM(args, 0), BUILTIN_SYM_TAKE);
+    LASSERT_LIST_ARG(args, LVAL_EXPR_ITEM(args, 1), BUILTIN_SYM_TAKE);
+
+    long n = list_count(LVAL_EXPR_ITEM(args, 0));
+    lval *list = LVAL_EXPR_ITEM(args, 1);
+    if (lval_type(list) == LVAL_SEQ)
+    {
+        LASSERT(args, n >= 0, "function '%s' cannot take %ld items", BUILTIN_SYM_TAKE, n);
+
+        lval *rv = lval_seq(LSEQ_TAKE);
+        rv->value.seq.take.n = n;
+        rv->value.seq.take.from = lval_ref(list);
+        lval_del(args);
+        return rv;
+    }
+
+    LASSERT(args, n >= 0 && (size_t)n <= LVAL_EXPR_CNT(list),
+        "function '%s' cannot take %ld items from list of length %zu", BUILTIN_SYM_TAKE, n, LVAL_EXPR_CNT(list));
+
+    lval *rv = lval_qexpression();
+    lval_expr_reserve(rv, n);
+    for (long i = 0; i < n; i++)
+    {
+        lval_add(rv, lval_ref(LVAL_EXPR_ITEM(list, i)));
+    }
+
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to return a list without its first n items. As with the
+ * Lilith version, dropping more characters than a string has gives an empty
+ * string. A sequence is read past the items dropped.
+ */
+static lval *builtin_drop(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_DROP);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_DROP, "n", "l");
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_DROP);
+    LASSERT_COUNT_ARG(args, LVAL_EXPR_ITEM(args, 0), BUILTIN_SYM_DROP);
+    LASSERT(args, lval_type(LVAL_EXPR_ITEM(args, 1)) == LVAL_QEXPRESSION || lval_type(LVAL_EXPR_ITEM(args, 1)) == LVAL_STRING ||
+            lval_type(LVAL_EXPR_ITEM(args, 1)) == LVAL_SEQ,
+        "function '%s' type mismatch - expected String, Q-Expression or Sequence, received %s",
+        BUILTIN_SYM_DROP, ltype_name(lval_type(LVAL_EXPR_ITEM(args, 1))));
+
+    long n = list_count(LVAL_EXPR_ITEM(args, 0));
+    lval *list = LVAL_EXPR_ITEM(args, 1);
+    LASSERT(args, n >= 0, "function '%s' cannot drop %ld items", BUILTIN_SYM_DROP, n);
+
+    lval *rv;
+    if (lval_type(list) == LVAL_SEQ)
+    {
+        lval *err = 0;
+        rv = seq_arg(args);
+        size_t count = seq_skip(env, &rv, n, &err);
+        if (err || count < (size_t)n)
+        {
+            lval_del(rv);
+            rv = err ? err :
+                lval_error("function '%s' cannot drop %ld items from sequence of length %zu", BUILTIN_SYM_DROP, n, count);
+        }
+    }
+    else if (lval_type(list) == LVAL_STRING)
+    {
+        size_t start = (size_t)n < list->value.str.len ? (size_t)n : list->value.str.len;
+        rv = lval_substring(list, start, list->value.str.len - start);
+    }
+    else
+    {
+        LASSERT(args, (size_t)n <= LVAL_EXPR_CNT(list),
+            "function '%s' cannot drop %ld items from list of length %zu", BUILTIN_SYM_DROP, n, LVAL_EXPR_CNT(list));
+
+        rv = lval_qexpression();
+        lval_expr_reserve(rv, LVAL_EXPR_CNT(list) - n);
+        for (size_t i = n; i < LVAL_EXPR_CNT(list); i++)
+        {
+            lval_add(rv, lval_ref(LVAL_EXPR_ITEM(list, i)));
+        }
+    }
+
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to create a list of the numbers from one number
+ * (inclusive) to another (exclusive). The list is empty if the second is not
+ * greater than the first.
+ */
+static lval *builtin_range(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_RANGE);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_RANGE, "from", "to");
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_RANGE);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 0), LVAL_LONG, BUILTIN_SYM_RANGE);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 1), LVAL_LONG, BUILTIN_SYM_RANGE);
+
+    long from = lval_as_long(LVAL_EXPR_ITEM(args, 0));
+    long to = lval_as_long(LVAL_EXPR_ITEM(args, 1));
+    lval *rv = lval_qexpression();
+    if (to > from)
+    {
+        lval_expr_reserve(rv, to - from);
+        for (long i = from; i < to; i++)
+        {
+            lval_add(rv, lval_long(i));
+        }
+    }
+
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to create a sequence of the numbers from one number
+ * (inclusive) to another (exclusive), as range does but read one at a time.
+ */
+static lval *builtin_seq_range(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SEQ_RANGE);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_SEQ_RANGE, "from", "to");
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_SEQ_RANGE);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 0), LVAL_LONG, BUILTIN_SYM_SEQ_RANGE);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 1), LVAL_LONG, BUILTIN_SYM_SEQ_RANGE);
+
+    lval *rv = lval_seq(LSEQ_RANGE);
+    rv->value.seq.range.at = lval_as_long(LVAL_EXPR_ITEM(args, 0));
+    rv->value.seq.range.to = lval_as_long(LVAL_EXPR_ITEM(args, 1));
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to create a sequence that calls a function with no
+ * arguments for each item, as in (seq (\ {} {read-next})). The sequence ends
+ * when the function gives nil.
+ */
+static lval *builtin_seq(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SEQ);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_SEQ);
+    LASSERT(args, lval_type(LVAL_EXPR_FIRST(args)) == LVAL_BUILTIN_FUN || lval_type(LVAL_EXPR_FIRST(args)) == LVAL_USER_FUN,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_SEQ, ltype_name(LVAL_USER_FUN), ltype_name(lval_type(LVAL_EXPR_FIRST(args))));
+
+    lval *rv = seq_call(LSEQ_CALL, lval_promote(LVAL_EXPR_FIRST(args)), 0);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to test whether a value is equal to an item of a list.
+ * Items are compared with = so a value of another type is an error.
+ */
+static lval *builtin_member(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_MEMBER);
+    LASSERT_NO_ERROR(args);
+    BUILTIN_PARTIAL(env, args, BUILTIN_SYM_MEMBER, "x", "y");
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_MEMBER);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_ITEM(args, 1), LVAL_QEXPRESSION, BUILTIN_SYM_MEMBER);
+
+    lval *x = LVAL_EXPR_ITEM(args, 0);
+    lval *list = LVAL_EXPR_ITEM(args, 1);
+    lval *rv = LVAL_FALSE;
+    for (size_t i = 0; i < LVAL_EXPR_CNT(list) && rv == LVAL_FALSE; i++)
+    {
+        lval *pair = lval_add(lval_sexpression(), lval_ref(x));
+        rv = call_builtin(env, eq_id, lval_add(pair, list_item(env, LVAL_EXPR_ITEM(list, i))));
+    }
+
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * A stage of a -> pipeline that calls map, filter, foldl or length on the
+ * list passed through it.
+ */
+typedef struct
+{
+    unsigned id;  // the symbol naming the list function
+    lval *f;      // the function it is given
+    lval *z;      // the initial value given to foldl
+} list_stage;
+
+/**
+ * Recognises a function whose body calls map, filter, foldl or length on its
+ * only parameter -- as partially applying one of them gives, or as sum does.
+ * The other arguments must be symbols or values, which are looked up as the
+ * call would look them up. Returns true and fills in stage if g is one.
+ */
+static bool list_stage_of(lenv *env, lval *g, list_stage *stage)
+{
+    if (lval_type(g) != LVAL_USER_FUN || g->value.user_fun.params.arity != 1 ||
+        g->value.user_fun.params.variadic || g->value.user_fun.params.malformed)
+    {
+        return false;
+    }
+
+    lval *body = g->value.user_fun.body;
+    size_t count = LVAL_EXPR_CNT(body);
+    if (count < 2 || lval_type(LVAL_EXPR_FIRST(body)) != LVAL_SYMBOL || lval_type(LVAL_EXPR_ITEM(body, count - 1)) != LVAL_SYMBOL)
+    {
+        return false;
+    }
+
+    unsigned id = LVAL_EXPR_FIRST(body)->value.sym.id;
+    unsigned param = LVAL_EXPR_FIRST(g->value.user_fun.formals)->value.sym.id;
+    size_t expected = id == map_id || id == filter_id ? 3 : id == foldl_id ? 4 : id == length_id ? 2 : 0;
+    if (count != expected || symbol_is_local(id) || LVAL_EXPR_ITEM(body, count - 1)->value.sym.id != param)
+    {
+        return false;
+    }
+
+    for (size_t i = 1; i < count - 1; i++)
+    {
+        lval *x = LVAL_EXPR_ITEM(body, i);
+        if (lval_type(x) == LVAL_SEXPRESSION || (lval_type(x) == LVAL_SYMBOL && x->value.sym.id == param))
+        {
+            return false;
+        }
+    }
+
+    lenv *frame = lenv_copy(g->value.user_fun.env);
+    lenv_set_parent(frame, env);
+    lval *args[2] = { 0, 0 };
+    for (size_t i = 1; i < count - 1; i++)
+    {
+        lval *x = LVAL_EXPR_ITEM(body, i);
+        args[i - 1] = lval_type(x) == LVAL_SYMBOL ? lenv_get(frame, x) : lval_ref(x);
+    }
+
+    lenv_del(frame);
+    stage->id = id;
+    stage->f = args[0];
+    stage->z = args[1];
+    return true;
+}
+
+/**
+ * Releases the values a stage holds.
+ */
+static void list_stage_del(list_stage *stage)
+{
+    if (stage->f)
+    {
+        lval_del(stage->f);
+    }
+
+    if (stage->z)
+    {
+        lval_del(stage->z);
+    }
+}
+
+/**
+ * Calls a stage's list function on list. A sequence is given straight to the
+ * list function rather than bound to the stage function's parameter, which
+ * would keep every cell read from it until the stage returned. Consumes list.
+ */
+static lval *list_stage_apply(lenv *env, list_stage *stage, lval *list)
+{
+    lval *args = lval_sexpression();
+    if (stage->f)
+    {
+        lval_add(args, lval_ref(stage->f));
+    }
+
+    if (stage->z)
+    {
+        lval_add(args, lval_ref(stage->z));
+    }
+
+    return call_builtin(env, stage->id, lval_add(args, list));
+}
+
+/**
+ * Passes each item of list through a run of stages in turn, so no list is made
+ * between them. Only the last stage may be foldl or length. The result is the
+ * one the stages would give one after another, though the functions are called
+ * in a different order. The pass stops at the first error, so a stage function
+ * is not called again once one has failed. If more than one stage would fail
+ * the error may be from a later stage than unfused. Consumes list.
+ */
+static lval *list_fuse(lenv *env, lval *list, list_stage *stages, size_t count)
+{
+    list_stage *last = &stages[count - 1];
+    lval *rv = last->id == foldl_id ? lval_ref(last->z) : last->id == length_id ? lval_long(0) : lval_qexpression();
+    for (size_t i = 0; i < LVAL_EXPR_CNT(list) && lval_type(rv) != LVAL_ERROR; i++)
+    {
+        lval *v = lval_ref(LVAL_EXPR_ITEM(list, i));
+        for (size_t k = 0; v && lval_type(v) != LVAL_ERROR && k < count; k++)
+        {
+            list_stage *stage = &stages[k];
+            if (stage->id == map_id)
+            {
+                lval *x = list_call_1(env, stage->f, list_item(env, v));
+                lval_del(v);
+                v = x;
+            }
+            else if (stage->id == filter_id)
+            {
+                lval *x = list_call_1(env, stage->f, list_item(env, v));
+                if (x == LVAL_TRUE)
+                {
+                    continue;
+                }
+
+                lval_del(v);
+                v = 0;
+                if (lval_type(x) == LVAL_ERROR)
+                {
+                    v = x;
+                }
+                else if (x != LVAL_FALSE)
+                {
+                    v = list_test_error(x);
+                    lval_del(x);
+                }
+            }
+            else if (stage->id == foldl_id)
+            {
+                lval *pair = lval_add(lval_sexpression(), rv);
+                rv = list_call(env, stage->f, lval_add(pair, list_item(env, v)));
+                lval_del(v);
+                v = 0;
+            }
+            else
+            {
+                lval *n = rv;
+                rv = lval_long(lval_as_long(n) + 1);
+                lval_del(n);
+                lval_del(v);
+                v = 0;
+            }
+        }
+
+        if (v && lval_type(v) == LVAL_ERROR)
+        {
+            lval_del(rv);
+            rv = v;
+        }
+        else if (v)
+        {
+            lval_add(rv, v);
+        }
+    }
+
+    lval_del(list);
+    return rv;
+}
+
+/**
+ * Built-in function to pass a value through a sequence of functions. Each is
+ * given as a q-expression evaluated to find the function, as in
+ * (-> {1 2 3} {map inc} {sum}). A run of two or more map and filter stages,
+ * perhaps ending in foldl or length, passes a list through in a single pass.
+ * Those stages read a sequence in constant memory.
+ */
+static lval *builtin_thread(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_THREAD);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) != 0, "function '%s' passed nothing", BUILTIN_SYM_THREAD);
+
+    // Find the functions first so runs of stages can be seen
+    size_t count = LVAL_EXPR_CNT(args) - 1;
+    lval **fns = malloc(count * sizeof(lval*));
+    list_stage *stages = malloc(count * sizeof(list_stage));
+    for (size_t i = 0; i < count; i++)
+    {
+        lval *body = list_item(env, LVAL_EXPR_ITEM(args, i + 1));
+        fns[i] = call_builtin(env, eval_id, lval_add(lval_sexpression(), body));
+    }
+
+    // The value is taken from the arguments so a sequence read along the way is not kept by them
+    lval *rv = args->refs > 1 ? lval_ref(LVAL_EXPR_FIRST(args)) : lval_pop(args);
+    for (size_t i = 0; i < count && lval_type(rv) != LVAL_ERROR;)
+    {
+        size_t run = 0;
+        while (lval_type(rv) == LVAL_QEXPRESSION && i + run < count && list_stage_of(env, fns[i + run], &stages[run]))
+        {
+            unsigned id = stages[run++].id;
+            if (id == foldl_id || id == length_id)
+            {
+                break;
+            }
+        }
+
+        if (run > 1)
+        {
+            rv = list_fuse(env, rv, stages, run);
+            i += run;
+        }
+        else if (lval_type(rv) == LVAL_SEQ && list_stage_of(env, fns[i], &stages[0]))
+        {
+            rv = list_stage_apply(env, &stages[0], rv);
+            run = 1;
+            i++;
+        }
+        else
+        {
+            rv = list_call_1(env, fns[i++], rv);
+        }
+
+        for (size_t k = 0; k < run; k++)
+        {
+            list_stage_del(&stages[k]);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        lval_del(fns[i]);
+    }
+
+    free(fns);
+    free(stages);
+    lval_del(args);
+    return rv;
+}
+
+void lenv_add_builtin_list(lenv *e)
+{
+    eq_id = symbol_intern(BUILTIN_SYM_EQ);
+    eval_id = symbol_intern(BUILTIN_SYM_EVAL);
+    map_id = symbol_intern(BUILTIN_SYM_MAP);
+    filter_id = symbol_intern(BUILTIN_SYM_FILTER);
+    foldl_id = symbol_intern(BUILTIN_SYM_FOLDL);
+    length_id = symbol_intern(BUILTIN_SYM_LENGTH);
+
+    lenv_add_builtin(e, BUILTIN_SYM_MAP, builtin_map);
+    lenv_add_builtin(e, BUILTIN_SYM_FILTER, builtin_filter);
+    lenv_add_builtin(e, BUILTIN_SYM_FOLDL, builtin_foldl);
+    lenv_add_builtin(e, BUILTIN_SYM_NTH, builtin_nth);
+    lenv_add_builtin(e, BUILTIN_SYM_LAST, builtin_last);
+    lenv_add_builtin(e, BUILTIN_SYM_LENGTH, builtin_length);
+    lenv_add_builtin(e, BUILTIN_SYM_TAKE, builtin_take);
+    lenv_add_builtin(e, BUILTIN_SYM_DROP, builtin_drop);
+    lenv_add_builtin(e, BUILTIN_SYM_RANGE, builtin_range);
+    lenv_add_builtin(e, BUILTIN_SYM_MEMBER, builtin_member);
+    lenv_add_builtin(e, BUILTIN_SYM_THREAD, builtin_thread);
+    lenv_add_builtin(e, BUILTIN_SYM_SEQ, builtin_seq);
+    lenv_add_builtin(e, BUILTIN_SYM_SEQ_RANGE, builtin_seq_range);
+}
@@ -0,0 +1,506 @@
+/*
+ * Memoisation. A memoised function caches its results in a hash table keyed
+ * on its arguments, compared with lval_is_same, so each distinct call is only
+ * made once. Arguments that are equal but of another type, such as 1.0 for 1,
+ * are a different call. The cache can be bounded, in which case the entry least
+ * recently used makes way for a new one.
+ */
+
+#include <limits.h>
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+#define BUILTIN_SYM_MEMO "memo"
+#define BUILTIN_SYM_MEMO_LRU "memo-lru"
+#define BUILTIN_SYM_MEMO_CLEAR "memo-clear"
+#define BUILTIN_SYM_MEMO_STATS "memo-stats"
+
+#define MEMO_MIN_CAPACITY 16
+#define MEMO_INDEX_MIN_CAPACITY 32
+
+/**
+ * A call and its result. Entries are also linked in the order they were last
+ * used, by entry + 1 with zero at either end.
+ */
+typedef struct
+{
+    lval *key;       // the arguments, as an s-expression
+    lval *value;
+    size_t hash;
+    unsigned newer;
+    unsigned older;
+} memo_entry;
+
+struct lmemo
+{
+    lval *fn;
+    memo_entry *entries;
+    unsigned *index;   // open addressed index of entry + 1, zero when empty
+    unsigned count;
+    unsigned capacity;
+    unsigned index_capacity;
+    unsigned limit;    // the most entries kept, zero for no limit
+    unsigned newest;
+    unsigned oldest;
+    unsigned found;    // entry + 1 of the call builtin_memo_has last looked up, zero if not cached
+    size_t hits;
+    size_t misses;
+};
+
+/**
+ * Finds the index entry for a call, either the entry pointing at it or the empty entry it belongs in.
+ */
+static unsigned *memo_index_find(const lmemo *m, lval *key, size_t hash)
+{
+    unsigned mask = m->index_capacity - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask)
+    {
+        unsigned *entry = &m->index[i];
+        if (!*entry || (m->entries[*entry - 1].hash == hash && lval_is_same(m->entries[*entry - 1].key, key)))
+        {
+            return entry;
+        }
+    }
+}
+
+/**
+ * Rebuilds the hash index with room for the current entries.
+ */
+static void memo_index_build(lmemo *m)
+{
+    m->index_capacity *= 2;
+    while (m->count * 2 > m->index_capacity)
+    {
+        m->index_capacity *= 2;
+    }
+
+    free(m->index);
+    m->index = calloc(m->index_capacity, sizeof(unsigned));
+    for (unsigned i = 0; i < m->count; i++)
+    {
+        *memo_index_find(m, m->entries[i].key, m->entries[i].hash) = i + 1;
+    }
+}
+
+/**
+ * Empties an index entry, moving back any entries after it that could not be
+ * placed where they belong so that they are still found.
+ */
+static void memo_index_remove(lmemo *m, unsigned *entry)
+{
+    unsigned mask = m->index_capacity - 1;
+    unsigned hole = entry - m->index;
+    for (unsigned i = (hole + 1) & mask; m->index[i]; i = (i + 1) & mask)
+    {
+        unsigned home = m->entries[m->index[i] - 1].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            m->index[hole] = m->index[i];
+            hole = i;
+        }
+    }
+
+    m->index[hole] = 0;
+}
+
+/**
+ * Makes an entry the most recently used.
+ */
+static void memo_link(lmemo *m, unsigned i)
+{
+    m->entries[i].newer = 0;
+    m->entries[i].older = m->newest;
+    if (m->newest)
+    {
+        m->entries[m->newest - 1].newer = i + 1;
+    }
+    else
+    {
+        m->oldest = i + 1;
+    }
+
+    m->newest = i + 1;
+}
+
+static void memo_unlink(lmemo *m, unsigned i)
+{
+    memo_entry *e = &m->entries[i];
+    if (e->newer)
+    {
+        m->entries[e->newer - 1].older = e->older;
+    }
+    else
+    {
+        m->newest = e->older;
+    }
+
+    if (e->older)
+    {
+        m->entries[e->older - 1].newer = e->newer;
+    }
+    else
+    {
+        m->oldest = e->newer;
+    }
+}
+
+/**
+ * Caches the result of a call. Consumes key and value.
+ */
+static void memo_insert(lmemo *m, lval *key, size_t hash, lval *value)
+{
+    // A call with the same arguments may have been cached while the function ran
+    if (*memo_index_find(m, key, hash))
+    {
+        lval_del(key);
+        lval_del(value);
+        return;
+    }
+
+    unsigned i;
+    if (m->limit && m->count == m->limit)
+    {
+        // The least recently used entry makes way
+        i = m->oldest - 1;
+        memo_unlink(m, i);
+        memo_index_remove(m, memo_index_find(m, m->entries[i].key, m->entries[i].hash));
+        lval_del(m->entries[i].key);
+        lval_del(m->entries[i].value);
+    }
+    else
+    {
+        if (m->count == m->capacity)
+        {
+            m->capacity = m->capacity ? m->capacity * 2 : MEMO_MIN_CAPACITY;
+            m->entries = realloc(m->entries, m->capacity * sizeof(memo_entry));
+        }
+
+        i = m->count++;
+    }
+
+    m->entries[i] = (memo_entry){ key, value, hash, 0, 0 };
+
+    // Keep the index at most half full
+    if (m->count * 2 > m->index_capacity)
+    {
+        memo_index_build(m);
+    }
+    else
+    {
+        *memo_index_find(m, key, hash) = i + 1;
+    }
+
+    memo_link(m, i);
+}
+
+/**
+ * Releases the cached results and resets the counters.
+ */
+static void memo_clear(lmemo *m)
+{
+    for (unsigned i = 0; i < m->count; i++)
+    {
+        lval_del(m->entries[i].key);
+        lval_del(m->entries[i].value);
+    }
+
+    memset(m->index, 0, m->index_capacity * sizeof(unsigned));
+    m->count = 0;
+    m->newest = m->oldest = 0;
+    m->hits = m->misses = 0;
+}
+
+size_t memo_free(lmemo *m, bool release)
+{
+    if (release)
+    {
+        lval_del(m->fn);
+        memo_clear(m);
+    }
+
+    size_t rv = sizeof(lmemo) + m->capacity * sizeof(memo_entry) + m->index_capacity * sizeof(unsigned);
+    free(m->entries);
+    free(m->index);
+    free(m);
+    return rv;
+}
+
+void memo_for_each(lmemo *m, void (*fn)(lval *v))
+{
+    fn(m->fn);
+    for (unsigned i = 0; i < m->count; i++)
+    {
+        fn(m->entries[i].key);
+        fn(m->entries[i].value);
+    }
+}
+
+/**
+ * The body of a memoised function starts by calling this with the memo table
+ * and the function's arguments, to test whether the call has been cached.
+ * The entry found is kept for builtin_memo_get, which is called straight
+ * after if it was.
+ */
+static lval *builtin_memo_has(lenv *env, lval *args)
+{
+    (void)env;
+    LASSERT_NO_ERROR(args);
+
+    lval *table = lval_pop(args);
+    lmemo *m = table->value.memo;
+    m->found = *memo_index_find(m, args, lval_hash_same(args));
+    m->misses += !m->found;
+    lval_del(args);
+    lval_del(table);
+    return lval_bool(m->found);
+}
+
+/**
+ * Returns the cached result builtin_memo_has found.
+ */
+static lval *builtin_memo_get(lenv *env, lval *args)
+{
+    (void)env;
+    lmemo *m = LVAL_EXPR_FIRST(args)->value.memo;
+    m->hits++;
+    memo_unlink(m, m->found - 1);
+    memo_link(m, m->found - 1);
+
+    lval *rv = lval_ref(m->entries[m->found - 1].value);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Called with the memo table, the result of calling the function and the
+ * arguments it was called with. Caches the result unless it is an error, and
+ * returns it.
+ */
+static lval *builtin_memo_put(lenv *env, lval *args)
+{
+    (void)env;
+    LASSERT_NO_ERROR(args);
+
+    lval *table = lval_pop(args);
+    lval *rv = lval_pop(args);
+    lmemo *m = table->value.memo;
+    memo_insert(m, lval_promote(args), lval_hash_same(args), lval_promote(rv));
+    lval_del(args);
+    lval_del(table);
+    return rv;
+}
+
+/**
+ * Calls a variadic function with the memo table and the arguments of a call
+ * to it, its last argument the list of the rest. The rest are passed on
+ * unpacked. Unlike the calls a memoised function that is not variadic makes,
+ * this one is made from C.
+ */
+static lval *builtin_memo_apply(lenv *env, lval *args)
+{
+    lval *table = lval_pop(args);
+    lval *rest = LVAL_EXPR_ITEM(args, --LVAL_EXPR_CNT(args));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(rest); i++)
+    {
+        lval_add(args, lval_ref(LVAL_EXPR_ITEM(rest, i)));
+    }
+
+    lval *rv = lval_call(env, lval_ref(table->value.memo->fn), args);
+    lval_del(rest);
+    lval_del(table);
+    return rv;
+}
+
+/**
+ * Returns the memo table of a function made by memo, or null for any other value.
+ */
+static lmemo *memo_of(lval *f)
+{
+    if (lval_type(f) != LVAL_USER_FUN || LVAL_EXPR_CNT(f->value.user_fun.body) != 4)
+    {
+        return 0;
+    }
+
+    lval *test = LVAL_EXPR_ITEM(f->value.user_fun.body, 1);
+    if (lval_type(test) != LVAL_SEXPRESSION || LVAL_EXPR_CNT(test) < 2 ||
+        lval_type(LVAL_EXPR_FIRST(test)) != LVAL_BUILTIN_FUN || LVAL_EXPR_FIRST(test)->value.builtin != builtin_memo_has)
+    {
+        return 0;
+    }
+
+    return LVAL_EXPR_ITEM(test, 1)->value.memo;
+}
+
+/**
+ * Returns a list of a memo built-in and the memo table.
+ */
+static lval *memo_expr(lval *type, lbuiltin builtin, lval *table)
+{
+    return lval_add(lval_add(type, lval_fun(builtin)), lval_ref(table));
+}
+
+/**
+ * Adds the formals other than '&' to a list.
+ */
+static lval *memo_add_formals(lval *v, const lval *formals)
+{
+    for (size_t i = 0; i < LVAL_EXPR_CNT(formals); i++)
+    {
+        lval *sym = LVAL_EXPR_ITEM(formals, i);
+        if (sym->value.sym.id != SYMBOL_ID_AMPERSAND)
+        {
+            lval_add(v, lval_ref(sym));
+        }
+    }
+
+    return v;
+}
+
+/**
+ * Returns a function taking the same formals as f whose body is
+ *
+ *   if (has table formals...) {get table} {put table (f formals...) formals...}
+ *
+ * with the memo built-ins and a new memo table in place of the names. The
+ * call to f is evaluated like any other in a function body, so memoised
+ * recursion is made through the trampoline. A variadic function is called
+ * through builtin_memo_apply instead, and a built-in is treated as one with
+ * the formals {& args}.
+ */
+static lval *memo_wrap(lval *f, unsigned limit)
+{
+    lmemo *m = calloc(1, sizeof(lmemo));
+    m->fn = lval_promote(f);
+    m->limit = limit;
+    m->index_capacity = MEMO_INDEX_MIN_CAPACITY;
+    m->index = calloc(m->index_capacity, sizeof(unsigned));
+    lval *table = lval_memo(m);
+
+    lval *formals = lval_qexpression();
+    bool variadic = true;
+    if (lval_type(f) == LVAL_USER_FUN)
+    {
+        lval *from = f->value.user_fun.formals;
+        for (size_t i = 0; i < LVAL_EXPR_CNT(from); i++)
+        {
+            lval_add(formals, lval_ref(LVAL_EXPR_ITEM(from, i)));
+        }
+
+        variadic = f->value.user_fun.params.variadic;
+    }
+    else
+    {
+        lval_add(formals, lval_symbol("&"));
+        lval_add(formals, lval_symbol("args"));
+    }
+
+    lval *call = variadic ? memo_expr(lval_sexpression(), builtin_memo_apply, table) :
+        lval_add(lval_sexpression(), lval_ref(m->fn));
+
+    lval *body = lval_add(lval_qexpression(), lval_symbol(BUILTIN_SYM_IF));
+    lval_add(body, memo_add_formals(memo_expr(lval_sexpression(), builtin_memo_has, table), formals));
+    lval_add(body, memo_expr(lval_qexpression(), builtin_memo_get, table));
+    lval_add(body, memo_add_formals(lval_add(memo_expr(lval_qexpression(), builtin_memo_put, table),
+        memo_add_formals(call, formals)), formals));
+    lval_del(table);
+    return lval_lambda(formals, body);
+}
+
+/**
+ * Built-in function to memoise a function, as in (memo (\ {n} {...})). The
+ * function should depend only on its arguments as the results it gives are
+ * cached for good.
+ */
+static lval *builtin_memo(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_MEMO);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_MEMO);
+    LASSERT(args, lval_type(LVAL_EXPR_FIRST(args)) == LVAL_BUILTIN_FUN || lval_type(LVAL_EXPR_FIRST(args)) == LVAL_USER_FUN,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_MEMO, ltype_name(LVAL_USER_FUN), ltype_name(lval_type(LVAL_EXPR_FIRST(args))));
+
+    lval *rv = memo_wrap(LVAL_EXPR_FIRST(args), 0);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to memoise a function keeping at most n results, as in
+ * (memo-lru 100 f). The result least recently used is dropped to make room.
+ */
+static lval *builtin_memo_lru(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_MEMO_LRU);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 2, BUILTIN_SYM_MEMO_LRU);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_LONG, BUILTIN_SYM_MEMO_LRU);
+    LASSERT(args, lval_type(LVAL_EXPR_ITEM(args, 1)) == LVAL_BUILTIN_FUN || lval_type(LVAL_EXPR_ITEM(args, 1)) == LVAL_USER_FUN,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_MEMO_LRU, ltype_name(LVAL_USER_FUN), ltype_name(lval_type(LVAL_EXPR_ITEM(args, 1))));
+
+    long limit = lval_as_long(LVAL_EXPR_FIRST(args));
+    LASSERT(args, limit > 0 && limit <= UINT_MAX / 2, "function '%s' passed an invalid size %ld", BUILTIN_SYM_MEMO_LRU, limit);
+
+    lval *rv = memo_wrap(LVAL_EXPR_ITEM(args, 1), limit);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to empty the cache of a memoised function and reset its counters.
+ */
+static lval *builtin_memo_clear(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_MEMO_CLEAR);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_MEMO_CLEAR);
+
+    lmemo *m = memo_of(LVAL_EXPR_FIRST(args));
+    LASSERT(args, m, "function '%s' passed a function that is not memoised", BUILTIN_SYM_MEMO_CLEAR);
+
+    memo_clear(m);
+    lval_del(args);
+    return lval_sexpression();
+}
+
+/**
+ * Appends a named counter to a q-expression.
+ */
+static lval *memo_stat(lval *rv, const char *name, size_t value)
+{
+    lval *stat = lval_qexpression();
+    lval_add(stat, lval_string(name));
+    lval_add(stat, lval_long(value));
+    return lval_add(rv, stat);
+}
+
+/**
+ * Built-in function to return the counters of a memoised function as a
+ * q-expression of name and value pairs. A limit of 0 means there is none.
+ */
+static lval *builtin_memo_stats(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_MEMO_STATS);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_MEMO_STATS);
+
+    lmemo *m = memo_of(LVAL_EXPR_FIRST(args));
+    LASSERT(args, m, "function '%s' passed a function that is not memoised", BUILTIN_SYM_MEMO_STATS);
+
+    lval *rv = lval_qexpression();
+    memo_stat(rv, "hits", m->hits);
+    memo_stat(rv, "misses", m->misses);
+    memo_stat(rv, "size", m->count);
+    memo_stat(rv, "limit", m->limit);
+    lval_del(args);
+    return rv;
+}
+
+void lenv_add_builtin_memo(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_MEMO, builtin_memo);
+    lenv_add_builtin(e, BUILTIN_SYM_MEMO_LRU, builtin_memo_lru);
+    lenv_add_builtin(e, BUILTIN_SYM_MEMO_CLEAR, builtin_memo_clear);
+    lenv_add_builtin(e, BUILTIN_SYM_MEMO_STATS, builtin_memo_stats);
+}
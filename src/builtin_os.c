@@ -4,6 +4,7 @@
 char *lookup_load_file(const char *filename);
 
 #define BUILTIN_SYM_FTS "file->string"
+#define BUILTIN_SYM_FSEQ "file->seq"
 
 /**
  * Built-in function to load a file into a string.
@@ -15,7 +16,40 @@ static lval *builtin_file_to_string(lenv *env, lval *args)
     LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_FTS);
     LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_STRING, BUILTIN_SYM_FTS);
 
-    lval *rv = lval_string(lookup_load_file(LVAL_EXPR_FIRST(args)->value.str_val));
+    char *name = lval_string_dup(LVAL_EXPR_FIRST(args));
+    char *contents = lookup_load_file(name);
+    lval *rv = contents ? lval_string(contents) : lval_error("File not found %s", name);
+    free(contents);
+    free(name);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to read a file as a sequence of its lines, without their
+ * line endings. Lines are read as the sequence is.
+ */
+static lval *builtin_file_to_seq(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_FSEQ);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_FSEQ);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_STRING, BUILTIN_SYM_FSEQ);
+
+    char *name = lval_string_dup(LVAL_EXPR_FIRST(args));
+    FILE *file = fopen(name, "r");
+    lval *rv;
+    if (file)
+    {
+        rv = lval_seq(LSEQ_LINES);
+        rv->value.seq.file = file;
+    }
+    else
+    {
+        rv = lval_error("File not found %s", name);
+    }
+
+    free(name);
     lval_del(args);
     return rv;
 }
@@ -23,4 +57,5 @@ static lval *builtin_file_to_string(lenv *env, lval *args)
 void lenv_add_builtin_os(lenv *e)
 {
     lenv_add_builtin(e, BUILTIN_SYM_FTS, builtin_file_to_string);
+    lenv_add_builtin(e, BUILTIN_SYM_FSEQ, builtin_file_to_seq);
 }
@@ -48,6 +48,16 @@ enum iops_enum
 #undef $
 };
 
+/**
+ * The symbols naming the operations. Generated by the X macro.
+ */
+static const char *iops_names[] =
+{
+#define $(X, LOP, DOP, SYM) SYM,
+    IOPS
+#undef $
+};
+
 /**
  * Performs a calculation for two lvals.
  * 
@@ -68,25 +78,25 @@ static lval *do_calc(enum iops_enum iop, lval *xval, lval *yval)
 
     goto *(jump_table[iop]);
 
-#define $(X, LOP, DOP, SYM) JT_##X:                         \
-    if (xval->type == LVAL_LONG && yval->type == LVAL_LONG) \
-    {                                                       \
-        rv = LOP(xval->value.num_l, yval->value.num_l);     \
-    }                                                       \
-    else if (xval->type == LVAL_LONG)                       \
-    {                                                       \
-        rv = DOP(xval->value.num_l, yval->value.num_d);     \
-    }                                                       \
-    else if (yval->type == LVAL_LONG)                       \
-    {                                                       \
-        rv = DOP(xval->value.num_d, yval->value.num_l);     \
-    }                                                       \
-    else                                                    \
-    {                                                       \
-        rv = DOP(xval->value.num_d, yval->value.num_d);     \
-    }                                                       \
-    lval_del(xval);                                         \
-    lval_del(yval);                                         \
+#define $(X, LOP, DOP, SYM) JT_##X:                                     \
+    if (lval_type(xval) == LVAL_LONG && lval_type(yval) == LVAL_LONG)   \
+    {                                                                   \
+        rv = LOP(lval_as_long(xval), lval_as_long(yval));               \
+    }                                                                   \
+    else if (lval_type(xval) == LVAL_LONG)                              \
+    {                                                                   \
+        rv = DOP(lval_as_long(xval), lval_as_double(yval));             \
+    }                                                                   \
+    else if (lval_type(yval) == LVAL_LONG)                              \
+    {                                                                   \
+        rv = DOP(lval_as_double(xval), lval_as_long(yval));             \
+    }                                                                   \
+    else                                                                \
+    {                                                                   \
+        rv = DOP(lval_as_double(xval), lval_as_double(yval));           \
+    }                                                                   \
+    lval_del(xval);                                                     \
+    lval_del(yval);                                                     \
     return rv;
     IOPS
 #undef $
@@ -99,11 +109,11 @@ static lval *builtin_op(lenv *env, lval *a, const char* symbol, enum iops_enum i
     LASSERT(a, LVAL_EXPR_CNT(a) > 0, "function '%s' expects at least one argument", symbol);
 
     // Confirm that all arguments are numeric values
-    for (pair *ptr = a->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(a); i++)
     {
-        LASSERT(a, ptr->data->type == LVAL_LONG || ptr->data->type == LVAL_DOUBLE,
+        LASSERT(a, lval_type(LVAL_EXPR_ITEM(a, i)) == LVAL_LONG || lval_type(LVAL_EXPR_ITEM(a, i)) == LVAL_DOUBLE,
             "function '%s' type mismatch - expected numeric, received %s",
-            symbol, ltype_name(ptr->data->type));
+            symbol, ltype_name(lval_type(LVAL_EXPR_ITEM(a, i))));
     }
 
     // Get the first value
@@ -112,14 +122,9 @@ static lval *builtin_op(lenv *env, lval *a, const char* symbol, enum iops_enum i
     // If single arument subtraction, negate value
     if (LVAL_EXPR_CNT(a) == 0 && (iop == IOPSENUM_SUB))
     {
-        if (x->type == LVAL_LONG)
-        {
-            x->value.num_l = -x->value.num_l;
-        }
-        else
-        {
-            x->value.num_d = -x->value.num_d;
-        }
+        lval *neg = lval_type(x) == LVAL_LONG ? lval_long(-lval_as_long(x)) : lval_double(-lval_as_double(x));
+        lval_del(x);
+        x = neg;
     }
 
     // While elements remain
@@ -138,6 +143,61 @@ static lval *builtin_op(lenv *env, lval *a, const char* symbol, enum iops_enum i
     IOPS
 #undef $
 
+int arith_op(unsigned id)
+{
+    for (size_t i = 0; i < sizeof(iops_names) / sizeof(char*); i++)
+    {
+        if (strcmp(symbol_name(id), iops_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const char *arith_name(unsigned op)
+{
+    return iops_names[op];
+}
+
+unsigned arith_type(unsigned op, unsigned type)
+{
+    switch (op)
+    {
+    case IOPSENUM_DIV:
+        return 0;
+    case IOPSENUM_GT:
+    case IOPSENUM_LT:
+    case IOPSENUM_GTE:
+    case IOPSENUM_LTE:
+        return LVAL_BOOL;
+    default:
+        return type;
+    }
+}
+
+lval *arith_apply(unsigned op, bool decimal, lval *x, lval *y)
+{
+    lval *rv;
+    static void *jump_table[] =
+    {
+#define $(X, LOP, DOP, SYM) &&JT_##X,
+        IOPS
+#undef $
+    };
+
+    goto *(jump_table[op]);
+
+#define $(X, LOP, DOP, SYM) JT_##X:                                                                        \
+    rv = decimal ? DOP(lval_as_double(x), lval_as_double(y)) : LOP(lval_as_long(x), lval_as_long(y));   \
+    lval_del(x);                                                                                        \
+    lval_del(y);                                                                                        \
+    return rv;
+    IOPS
+#undef $
+}
+
 void lenv_add_builtin_sums(lenv *e)
 {
 #define $(X, LOP, DOP, SYM) lenv_add_builtin(e, SYM, builtin_##X);
@@ -14,10 +14,27 @@
 #define BUILTIN_SYM_EVAL "eval"
 #define BUILTIN_SYM_JOIN "join"
 #define BUILTIN_SYM_LEN "len"
+#define BUILTIN_SYM_SUBSTRING "substring"
 #define BUILTIN_SYM_CONS "cons"
 #define BUILTIN_SYM_INIT "init"
 #define BUILTIN_SYM_LET "let"
 #define BUILTIN_SYM_LAMBDA "\\"
+#define BUILTIN_SYM_UNPACK "unpack"
+
+// List functions
+#define BUILTIN_SYM_MAP "map"
+#define BUILTIN_SYM_FILTER "filter"
+#define BUILTIN_SYM_FOLDL "foldl"
+#define BUILTIN_SYM_NTH "nth"
+#define BUILTIN_SYM_LAST "last"
+#define BUILTIN_SYM_LENGTH "length"
+#define BUILTIN_SYM_TAKE "take"
+#define BUILTIN_SYM_DROP "drop"
+#define BUILTIN_SYM_RANGE "range"
+#define BUILTIN_SYM_MEMBER "member?"
+#define BUILTIN_SYM_THREAD "->"
+#define BUILTIN_SYM_SEQ "seq"
+#define BUILTIN_SYM_SEQ_RANGE "seq-range"
 
 // Comparison / sequencing
 #define BUILTIN_SYM_IF "if"
@@ -25,6 +42,7 @@
 #define BUILTIN_SYM_AND "and"
 #define BUILTIN_SYM_OR "or"
 #define BUILTIN_SYM_NOT "not"
+#define BUILTIN_SYM_DO "do"
 
 // Utilities
 #define BUILTIN_SYM_LOAD "load"
@@ -33,6 +51,11 @@
 #define BUILTIN_SYM_PRINT "print"
 #define BUILTIN_SYM_ERROR "error"
 #define BUILTIN_SYM_TRY "try"
+#define BUILTIN_SYM_POOL_STATS "pool-stats"
+#define BUILTIN_SYM_GC "gc"
+#define BUILTIN_SYM_GC_STATS "gc-stats"
+#define BUILTIN_SYM_DISASSEMBLE "disassemble"
+#define BUILTIN_SYM_OPTIMISED "optimised"
 
 // Type checking
 #define BUILTIN_SYM_IS_STRING "string?"
@@ -41,6 +64,7 @@
 #define BUILTIN_SYM_IS_BOOL "boolean?"
 #define BUILTIN_SYM_IS_QEXPR "q-expression?"
 #define BUILTIN_SYM_IS_SEXPR "s-expression?"
+#define BUILTIN_SYM_IS_SEQ "sequence?"
 
 /*
  * Error checking macros.
@@ -64,9 +88,9 @@
         "function '%s' expects %d argument, received %d", \
         arg_symbol, expected, LVAL_EXPR_CNT(arg))
 
-#define LASSERT_TYPE_ARG(arg, val, expected, arg_symbol)                                          \
-    LASSERT(arg, val->type == expected, "function '%s' type mismatch - expected %s, received %s", \
-        arg_symbol, ltype_name(expected), ltype_name(val->type))
+#define LASSERT_TYPE_ARG(arg, val, expected, arg_symbol)                                                  \
+    LASSERT(arg, lval_type(val) == expected, "function '%s' type mismatch - expected %s, received %s", \
+        arg_symbol, ltype_name(expected), ltype_name(lval_type(val)))
 
 /*
  * If any of the list elements are an error, return the
@@ -75,21 +99,55 @@
 #define LASSERT_NO_ERROR(val)                                        \
     do                                                               \
     {                                                                \
-        size_t i = 0;                                                \
-        for (pair *ptr = val->value.list.head; ptr; ptr = ptr->next) \
+        for (size_t i = 0; i < LVAL_EXPR_CNT(val); i++)              \
         {                                                            \
-            if (ptr->data->type == LVAL_ERROR)                       \
+            if (lval_type(LVAL_EXPR_ITEM(val, i)) == LVAL_ERROR)     \
             {                                                        \
                 return lval_take(val, i);                            \
             }                                                        \
-            i++;                                                     \
         }                                                            \
     } while (0)
 
 /**
  * Utility function to call built-in functions from elsewhere in the code base.
+ * The built-in is found by the ID of the symbol naming it, see SYMBOL_ID_LIST.
+ */
+lval *call_builtin(lenv *env, unsigned id, lval *val);
+
+/**
+ * Calls a built-in function in tail position. Built-ins that end by evaluating
+ * a q-expression -- if, eval, unpack and let -- return null and hand back the
+ * q-expression in body and the environment to evaluate it in through frame,
+ * leaving the caller to evaluate it. If frame is changed the caller releases
+ * it once the evaluation is done. Other built-ins are called as normal.
  */
-lval *call_builtin(lenv *env, char *symbol, lval *val);
+lval *call_builtin_body(lenv *env, lval *func, lval *args, lenv **frame, lval **body);
+
+/**
+ * Partially applies a built-in passed fewer arguments than it takes, as a user
+ * function would be. Returns a function of the remaining parameters that calls
+ * the built-in with all of them. Consumes args.
+ *
+ * @param name   the symbol naming the built-in
+ * @param params the names of the built-in's parameters
+ * @param count  the number of parameters
+ */
+lval *builtin_partial(lenv *env, lval *args, const char *name, const char *const *params, size_t count);
+
+/**
+ * Partially applies the built-in named by sym if it has been passed fewer than
+ * the parameters listed. Used at the start of a built-in.
+ */
+#define BUILTIN_PARTIAL(env, args, sym, ...)                                  \
+    do                                                                        \
+    {                                                                         \
+        static const char *const params[] = { __VA_ARGS__ };                  \
+        size_t count = sizeof(params) / sizeof(params[0]);                    \
+        if (LVAL_EXPR_CNT(args) < count)                                      \
+        {                                                                     \
+            return builtin_partial(env, args, sym, params, count);            \
+        }                                                                     \
+    } while (0)
 
 /**
  * Adds a built-in function to the environment with the given name.
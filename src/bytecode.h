@@ -0,0 +1,246 @@
+#pragma once
+
+/*
+ * The bytecode compiler and virtual machine. An expression is compiled once in
+ * to a flat sequence of instructions for a stack machine plus a pool of the
+ * constants and symbols they refer to. The compiled code is kept with the list
+ * it was compiled from and reused each time the list is evaluated.
+ */
+
+#include "lilith_int.h"
+
+/*
+ * A macro defining the instruction set. The first argument is the opcode; the
+ * second the name shown by the disassembler.
+ *
+ *   CONST k   -- push constant k
+ *   LOAD k    -- push the value bound to the symbol in constant k
+ *   BUILTIN k -- push the built-in named by the symbol in constant k, unless a local binds it
+ *   GLOBAL s  -- push the value bound to the symbol of call site s, using its inline cache
+ *   EMPTY     -- push an empty s-expression
+ *   CALL n    -- pop n values and evaluate them as an s-expression, pushing the result
+ *   TAIL n    -- as CALL, but a function call is handed back to the caller of the code
+ *   RETURN    -- return the value on the top of the stack
+ *   FORM k    -- if a local binds the symbol of the special form in constant k, push the value
+ *                of the form as a call and go on, otherwise skip the next instruction
+ *   LAMBDA k  -- push a function made from the formals and body of the form in constant k
+ *   JUMP t    -- continue at instruction t
+ *   IF t      -- pop a condition and continue if it is true or at t if false, otherwise
+ *                push the error if would give and continue at t - 1
+ *   AND t     -- pop a value and continue if it is true, otherwise push false, or the error
+ *                and would give, and continue at t
+ *   OR t      -- pop a value and continue if it is false, otherwise push true, or the error
+ *                or would give, and continue at t
+ *   TRY t     -- pop the value on the top of the stack if it is an error, otherwise continue at t
+ *   DROP t    -- continue at t if the value on the top of the stack is an error, otherwise pop it
+ *   ARITH a   -- pop two longs, or two doubles if a is odd, and push the result of arithmetic
+ *                operation a / 2 on them
+ */
+#define OPCODES $(CONST, "const") $(LOAD, "load") $(BUILTIN, "builtin") $(GLOBAL, "global") $(EMPTY, "empty")  \
+    $(CALL, "call") $(TAIL, "tail") $(RETURN, "return") $(FORM, "form") $(LAMBDA, "lambda") $(JUMP, "jump")  \
+    $(IF, "if") $(AND, "and") $(OR, "or") $(TRY, "try") $(DROP, "drop")  \
+    $(ARITH, "arith")
+
+/**
+ * The opcodes. Generated by the X macro.
+ */
+enum opcode_enum
+{
+#define $(X, NAME) OP_##X,
+    OPCODES
+#undef $
+};
+
+/*
+ * Each instruction is one word -- the opcode in the low eight bits and its
+ * operand in the rest.
+ */
+#define INSTR(op, arg) ((unsigned)(op) | ((unsigned)(arg) << 8))
+#define INSTR_OP(instr) ((instr) & 0xFF)
+#define INSTR_ARG(instr) ((instr) >> 8)
+
+/**
+ * Native code compiled from a function by the JIT.
+ */
+typedef struct ljit ljit;
+
+/**
+ * C code compiled ahead of time from a list. It does what the instructions
+ * compiled from the list do, and is called by vm_run in their place.
+ */
+typedef lval *(*lnative)(lenv *env, const lcode *code, ltail *tail);
+
+/**
+ * A reference to a symbol that is not a formal of the enclosing function and
+ * so is most likely global, with the inline cache for its lookups.
+ */
+typedef struct
+{
+    lval *sym;
+    lenv_cache cache;
+} lsite;
+
+/**
+ * A symbol the compiled code relies on being bound to a value, with the inline
+ * cache for checking it. For a formal the value need only be of a given type.
+ */
+typedef struct
+{
+    lval *sym;
+    lval *expected;      // null for a formal
+    unsigned type;       // the type of the formal's value
+    lenv_cache cache;
+} lguard;
+
+/**
+ * Compiled code for a list. The constants are borrowed from the list, which
+ * cannot change while it has code. If the list was optimised they are borrowed
+ * from the optimised form instead. Optimised code, and code specialised for the
+ * types of the formals, only runs while its guards hold -- otherwise the code
+ * compiled from the list as written runs in its place.
+ */
+struct lcode
+{
+    size_t size;         // bytes allocated for this structure
+    lval **consts;       // the constant pool
+    size_t const_count;
+    lsite *sites;        // symbols looked up by GLOBAL instructions
+    size_t site_count;
+    size_t max_stack;    // deepest the value stack gets while running the code
+    unsigned calls;      // times the JIT has seen the code called as a function body
+    ljit *jit;           // native code for the function, null if not compiled
+    lnative native;      // code compiled ahead of time, null if none
+    lval *opt;           // the optimised form followed by the symbol and value pairs it assumes, null if none
+    lguard *guards;      // the assumptions, checked each time the code runs
+    size_t guard_count;
+    lcode *generic;      // code for the list as written, null if there are no guards
+    size_t count;        // number of instructions
+    unsigned instrs[];
+};
+
+/**
+ * Returns the code for evaluating a list as an s-expression, compiling it if
+ * the list has not been compiled before. If env is set and the list outlives
+ * the arena, it is optimised with the values bound in env and its arithmetic
+ * specialised for the types of the formals bound there.
+ */
+lcode *lval_compile(lval *v, lenv *env);
+
+/**
+ * Compiles a list, then has vm_run call native in place of the instructions.
+ * count is the number of instructions native was compiled from, which must
+ * match. Returns true if native is attached.
+ */
+bool lcode_attach(lval *v, lnative native, size_t count);
+
+/**
+ * Frees the code attached to a list. Returns the number of bytes freed. The
+ * optimised form is released too, unless the garbage collector frees it itself.
+ */
+size_t lcode_free(lval *v, bool release);
+
+/**
+ * Optimises a list evaluated as an s-expression -- inlines calls to small
+ * functions, folds calls to pure built-ins with constant arguments and drops
+ * the branch an if with a constant condition never takes. Returns null if
+ * nothing changes, otherwise an s-expression of the optimised form followed by
+ * pairs of each symbol it relies on and the value it must be bound to.
+ */
+lval *lval_optimise(lenv *env, lval *v);
+
+/**
+ * Prints a listing of compiled code to the screen.
+ */
+void lcode_disassemble(const lcode *code);
+
+/**
+ * Prepares the values popped off the stack for a CALL instruction, following
+ * the same rules as the tree-walking evaluator. Consumes the values.
+ *
+ * @param vals  the evaluated items of the s-expression
+ * @param count the number of items, at least one
+ * @param call  set to the function and arguments if a call is to be made
+ * @returns     the value of the s-expression, or null if a call is to be made
+ */
+lval *vm_prepare_call(lval **vals, size_t count, ltail *call);
+
+/**
+ * The value for a BUILTIN instruction -- the built-in sym names, unless a
+ * local environment binds sym.
+ */
+static inline lval *vm_builtin(lenv *env, lval *sym)
+{
+    return symbol_is_local(sym->value.sym.id) ? lenv_get(env, sym) : lval_ref(symbol_builtin(sym->value.sym.id));
+}
+
+/**
+ * The value for a FORM instruction. Returns null if no local environment binds
+ * the symbol naming the special form, otherwise evaluates the form as a call.
+ */
+lval *vm_form(lenv *env, lval *form);
+
+/**
+ * The error the built-in id -- if, and or or -- gives for a condition that is
+ * not a boolean. Consumes v.
+ */
+lval *vm_test_error(lenv *env, unsigned id, lval *v);
+
+/**
+ * The value for a LAMBDA instruction.
+ */
+static inline lval *vm_lambda(lval *form)
+{
+    return lval_lambda(lval_ref(LVAL_EXPR_ITEM(form, 1)), lval_ref(LVAL_EXPR_ITEM(form, 2)));
+}
+
+/**
+ * Where code running on the virtual machine has got to. Code that stops to
+ * call a user function keeps its place here until it is given the result.
+ */
+typedef struct
+{
+    const lcode *code;
+    const unsigned *ip;  // the next instruction, null once the code has finished
+    lval **base;         // the code's region of the value stack
+    lval **sp;
+} lvm;
+
+/**
+ * Prepares to run compiled code in an environment, taking a region of the value
+ * stack for it. The code for the list as written is run if a guard fails.
+ */
+void vm_enter(lenv *env, const lcode *code, lvm *vm);
+
+/**
+ * Runs code until it finishes or calls a user function. The call is not made
+ * but handed back through call, and null is returned. If the call is the last
+ * thing the code does the code has finished, otherwise it resumes from vm_run
+ * once the result has been given to it with vm_push.
+ */
+lval *vm_run(lenv *env, lvm *vm, ltail *call);
+
+/**
+ * Gives code waiting on a call the result.
+ */
+static inline void vm_push(lvm *vm, lval *v)
+{
+    *vm->sp++ = v;
+}
+
+/**
+ * Calls a user function through native code, compiling it once it is hot.
+ * Returns null, leaving args untouched, if the function is not compiled or the
+ * call is one the native code cannot make. Otherwise consumes args and returns
+ * the result.
+ */
+lval *jit_call(lenv *env, lval *func, lval *args);
+
+/**
+ * Frees native code.
+ */
+void jit_free(ljit *jit);
+
+/**
+ * Returns the number of bytes of machine code in native code.
+ */
+size_t jit_size(const ljit *jit);
@@ -0,0 +1,659 @@
+/*
+ * The bytecode compiler. Walks an expression once, emitting instructions for
+ * the virtual machine in the order the tree-walking evaluator would visit the
+ * nodes. Nested s-expressions are compiled in line; q-expressions are data
+ * until something evaluates them, so they become constants and are compiled
+ * separately when that happens.
+ *
+ * The special forms -- if, and, or, try, do and lambda -- are recognised here
+ * once rather than called as built-ins each time. Their q-expressions are
+ * compiled in line as branches, and and and or stop at the first argument that
+ * decides their result. The built-ins can still be shadowed by a local binding
+ * so each form is guarded, falling back to a call if its symbol is bound.
+ */
+
+#include "bytecode.h"
+
+#define COMPILER_MIN_CAPACITY 16
+
+/**
+ * Code being compiled.
+ */
+typedef struct
+{
+    unsigned *instrs;
+    size_t count;
+    size_t capacity;
+    lval **consts;
+    size_t const_count;
+    size_t const_capacity;
+    lval **sites;
+    size_t site_count;
+    size_t site_capacity;
+    lguard *guards;
+    size_t guard_count;
+    size_t guard_capacity;
+    size_t depth;      // values on the stack at this point in the code
+    size_t max_stack;
+    lenv *env;         // where the formals are bound when specialising, otherwise null
+} compiler;
+
+/**
+ * Names of the opcodes for the disassembler. Generated by the X macro.
+ */
+static const char *opcode_names[] =
+{
+#define $(X, NAME) NAME,
+    OPCODES
+#undef $
+};
+
+/**
+ * Appends an instruction that leaves the stack pushed values deeper (negative for pops).
+ */
+static void emit(compiler *c, unsigned op, unsigned arg, long pushed)
+{
+    if (c->count == c->capacity)
+    {
+        c->capacity = c->capacity ? c->capacity * 2 : COMPILER_MIN_CAPACITY;
+        c->instrs = realloc(c->instrs, c->capacity * sizeof(unsigned));
+    }
+
+    c->instrs[c->count++] = INSTR(op, arg);
+    c->depth += pushed;
+    if (c->depth > c->max_stack)
+    {
+        c->max_stack = c->depth;
+    }
+}
+
+/**
+ * Returns the index of a value in the constant pool, adding it if not already present.
+ */
+static unsigned add_const(compiler *c, lval *v)
+{
+    for (size_t i = 0; i < c->const_count; i++)
+    {
+        if (c->consts[i] == v)
+        {
+            return i;
+        }
+    }
+
+    if (c->const_count == c->const_capacity)
+    {
+        c->const_capacity = c->const_capacity ? c->const_capacity * 2 : COMPILER_MIN_CAPACITY;
+        c->consts = realloc(c->consts, c->const_capacity * sizeof(lval*));
+    }
+
+    c->consts[c->const_count] = v;
+    return c->const_count++;
+}
+
+/**
+ * Returns the index of a new call site looking up a symbol.
+ */
+static unsigned add_site(compiler *c, lval *sym)
+{
+    if (c->site_count == c->site_capacity)
+    {
+        c->site_capacity = c->site_capacity ? c->site_capacity * 2 : COMPILER_MIN_CAPACITY;
+        c->sites = realloc(c->sites, c->site_capacity * sizeof(lval*));
+    }
+
+    c->sites[c->site_count] = sym;
+    return c->site_count++;
+}
+
+/**
+ * Adds a guard unless the same one is already present.
+ */
+static void add_guard(compiler *c, lval *sym, lval *expected, unsigned type)
+{
+    for (size_t i = 0; i < c->guard_count; i++)
+    {
+        if (c->guards[i].sym->value.sym.id == sym->value.sym.id && c->guards[i].expected == expected &&
+            c->guards[i].type == type)
+        {
+            return;
+        }
+    }
+
+    if (c->guard_count == c->guard_capacity)
+    {
+        c->guard_capacity = c->guard_capacity ? c->guard_capacity * 2 : COMPILER_MIN_CAPACITY;
+        c->guards = realloc(c->guards, c->guard_capacity * sizeof(lguard));
+    }
+
+    c->guards[c->guard_count++] = (lguard){ sym, expected, type, { 0 } };
+}
+
+/**
+ * Points the jump at instruction i to the next instruction to be emitted.
+ */
+static void patch(compiler *c, size_t i)
+{
+    c->instrs[i] = INSTR(INSTR_OP(c->instrs[i]), c->count);
+}
+
+static void compile_expr(compiler *c, lval *v, bool tail);
+static void compile_sexpr(compiler *c, lval *v, bool tail);
+
+/**
+ * Compiles a symbol reference. Formals are found through their frame slot;
+ * anything else is looked up in the global environment unless a local binds
+ * it, with built-ins bound now as they can never be rebound there.
+ */
+static void compile_symbol(compiler *c, lval *v)
+{
+    if (v->value.sym.slot != LVAL_SLOT_NONE)
+    {
+        emit(c, OP_LOAD, add_const(c, v), 1);
+    }
+    else if (symbol_builtin(v->value.sym.id))
+    {
+        emit(c, OP_BUILTIN, add_const(c, v), 1);
+    }
+    else
+    {
+        emit(c, OP_GLOBAL, add_site(c, v), 1);
+    }
+}
+
+/**
+ * Returns true if every item in a list is a symbol.
+ */
+static bool all_symbols(const lval *v)
+{
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+    {
+        if (lval_type(LVAL_EXPR_ITEM(v, i)) != LVAL_SYMBOL)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Returns true if a non-empty s-expression is a special form written in a way
+ * the compiler handles. Any other use of the built-ins is compiled as a call.
+ */
+static bool special_form(const lval *v)
+{
+    lval *first = LVAL_EXPR_FIRST(v);
+    if (lval_type(first) != LVAL_SYMBOL || first->value.sym.slot != LVAL_SLOT_NONE || !symbol_builtin(first->value.sym.id))
+    {
+        return false;
+    }
+
+    size_t count = LVAL_EXPR_CNT(v);
+    switch (first->value.sym.id)
+    {
+    case SYMBOL_ID_LAMBDA:
+        return count == 3 && lval_type(LVAL_EXPR_ITEM(v, 1)) == LVAL_QEXPRESSION &&
+            lval_type(LVAL_EXPR_ITEM(v, 2)) == LVAL_QEXPRESSION && all_symbols(LVAL_EXPR_ITEM(v, 1));
+    case SYMBOL_ID_IF:
+        return count == 4 && lval_type(LVAL_EXPR_ITEM(v, 2)) == LVAL_QEXPRESSION &&
+            lval_type(LVAL_EXPR_ITEM(v, 3)) == LVAL_QEXPRESSION;
+    case SYMBOL_ID_TRY:
+        return count == 3 && lval_type(LVAL_EXPR_ITEM(v, 2)) == LVAL_QEXPRESSION;
+    case SYMBOL_ID_AND:
+    case SYMBOL_ID_OR:
+    case SYMBOL_ID_DO:
+        return count > 1;
+    default:
+        return false;
+    }
+}
+
+static unsigned infer(compiler *c, lval *v, bool guard);
+
+/**
+ * Returns the type of the arguments of a call to an arithmetic built-in if
+ * they are all longs or all doubles, setting op to its operation. Otherwise
+ * returns 0. If guard is set the types of the formals relied on are guarded.
+ */
+static unsigned infer_args(compiler *c, lval *v, int *op, bool guard)
+{
+    size_t count = LVAL_EXPR_CNT(v);
+    lval *first = count ? LVAL_EXPR_FIRST(v) : 0;
+    if (!c->env || count < 3 || lval_type(first) != LVAL_SYMBOL || first->value.sym.slot != LVAL_SLOT_NONE ||
+        !symbol_builtin(first->value.sym.id) || (*op = arith_op(first->value.sym.id)) < 0)
+    {
+        return 0;
+    }
+
+    unsigned type = infer(c, LVAL_EXPR_ITEM(v, 1), guard);
+    if (type != LVAL_LONG && type != LVAL_DOUBLE)
+    {
+        return 0;
+    }
+
+    for (size_t i = 2; i < count; i++)
+    {
+        if (infer(c, LVAL_EXPR_ITEM(v, i), guard) != type)
+        {
+            return 0;
+        }
+    }
+
+    // The built-in applies the operation from left to right, which only keeps the type if it gives the same type
+    return count == 3 || arith_type(*op, type) == type ? type : 0;
+}
+
+/**
+ * Returns the type an expression is known to evaluate to, or 0 if unknown.
+ * Formals are taken to have the types of the values bound to them now.
+ */
+static unsigned infer(compiler *c, lval *v, bool guard)
+{
+    int op;
+    unsigned type;
+    lval *value;
+    switch (lval_type(v))
+    {
+    case LVAL_LONG:
+    case LVAL_DOUBLE:
+    case LVAL_BOOL:
+        return lval_type(v);
+    case LVAL_SYMBOL:
+        if (v->value.sym.slot == LVAL_SLOT_NONE || !c->env)
+        {
+            return 0;
+        }
+
+        value = lenv_get(c->env, v);
+        type = lval_type(value);
+        lval_del(value);
+        if (type != LVAL_LONG && type != LVAL_DOUBLE)
+        {
+            return 0;
+        }
+
+        if (guard)
+        {
+            add_guard(c, v, 0, type);
+        }
+
+        return type;
+    case LVAL_SEXPRESSION:
+        type = infer_args(c, v, &op, guard);
+        return type ? arith_type(op, type) : 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Compiles a call to an arithmetic built-in whose arguments are known to be
+ * all longs or all doubles. The operation is applied directly, without the
+ * call or the checks the built-in makes. Returns false if the types are not known.
+ */
+static bool compile_arith(compiler *c, lval *v)
+{
+    int op;
+    unsigned type = infer_args(c, v, &op, false);
+    if (!type)
+    {
+        return false;
+    }
+
+    infer_args(c, v, &op, true);
+    add_guard(c, LVAL_EXPR_FIRST(v), symbol_builtin(LVAL_EXPR_FIRST(v)->value.sym.id), 0);
+    compile_expr(c, LVAL_EXPR_ITEM(v, 1), false);
+    for (size_t i = 2; i < LVAL_EXPR_CNT(v); i++)
+    {
+        compile_expr(c, LVAL_EXPR_ITEM(v, i), false);
+        emit(c, OP_ARITH, op * 2 + (type == LVAL_DOUBLE), -1);
+    }
+
+    return true;
+}
+
+/**
+ * Compiles if. The condition chooses which branch runs; a condition that is
+ * not a boolean leaves its error where the first branch leaves its value.
+ */
+static void compile_if(compiler *c, lval *v, bool tail, size_t *exits, size_t *exit_count)
+{
+    size_t depth = c->depth;
+    compile_expr(c, LVAL_EXPR_ITEM(v, 1), false);
+    size_t test = c->count;
+    emit(c, OP_IF, 0, -1);
+
+    compile_sexpr(c, LVAL_EXPR_ITEM(v, 2), tail);
+    c->depth = depth + 1;
+    if (!tail)
+    {
+        exits[(*exit_count)++] = c->count;
+    }
+
+    emit(c, tail ? OP_RETURN : OP_JUMP, 0, -1);
+
+    patch(c, test);
+    c->depth = depth;
+    compile_sexpr(c, LVAL_EXPR_ITEM(v, 3), tail);
+}
+
+/**
+ * Compiles a special form. Each exit jumps to the end of the form, where in
+ * tail position the value is returned.
+ */
+static void compile_form(compiler *c, lval *v, bool tail)
+{
+    size_t depth = c->depth;
+    size_t count = LVAL_EXPR_CNT(v);
+    size_t exits[count + 1];
+    size_t exit_count = 0;
+
+    emit(c, OP_FORM, add_const(c, v), 1);
+    if (!tail)
+    {
+        exits[exit_count++] = c->count;
+    }
+
+    emit(c, tail ? OP_RETURN : OP_JUMP, 0, -1);
+
+    unsigned id = LVAL_EXPR_FIRST(v)->value.sym.id;
+    switch (id)
+    {
+    case SYMBOL_ID_LAMBDA:
+        // Resolved once here so every function made from the form shares its body and the body's code
+        if (v->refs == 1 && !(v->flags & LVAL_FLAG_COMPILED) && (v->flags & LVAL_FLAG_ARENA || !arena_active()))
+        {
+            LVAL_EXPR_ITEM(v, 2) = lval_resolve(LVAL_EXPR_ITEM(v, 2), LVAL_EXPR_ITEM(v, 1));
+        }
+
+        emit(c, OP_LAMBDA, add_const(c, v), 1);
+        break;
+    case SYMBOL_ID_IF:
+        compile_if(c, v, tail, exits, &exit_count);
+        break;
+    case SYMBOL_ID_AND:
+    case SYMBOL_ID_OR:
+        for (size_t i = 1; i < count; i++)
+        {
+            compile_expr(c, LVAL_EXPR_ITEM(v, i), false);
+            exits[exit_count++] = c->count;
+            emit(c, id == SYMBOL_ID_AND ? OP_AND : OP_OR, 0, -1);
+        }
+
+        emit(c, OP_CONST, add_const(c, lval_bool(id == SYMBOL_ID_AND)), 1);
+        break;
+    case SYMBOL_ID_TRY:
+        compile_expr(c, LVAL_EXPR_ITEM(v, 1), false);
+        exits[exit_count++] = c->count;
+        emit(c, OP_TRY, 0, -1);
+        compile_sexpr(c, LVAL_EXPR_ITEM(v, 2), tail);
+        break;
+    case SYMBOL_ID_DO:
+        for (size_t i = 1; i < count - 1; i++)
+        {
+            compile_expr(c, LVAL_EXPR_ITEM(v, i), false);
+            exits[exit_count++] = c->count;
+            emit(c, OP_DROP, 0, -1);
+        }
+
+        compile_expr(c, LVAL_EXPR_ITEM(v, count - 1), tail);
+        break;
+    }
+
+    c->depth = depth + 1;
+    for (size_t i = 0; i < exit_count; i++)
+    {
+        patch(c, exits[i]);
+    }
+
+    if (tail && (exit_count || id == SYMBOL_ID_LAMBDA))
+    {
+        emit(c, OP_RETURN, 0, -1);
+    }
+
+    c->depth = depth + !tail;
+}
+
+/**
+ * Compiles a list to evaluate as an s-expression. Its items are evaluated in
+ * order then called. In tail position the code returns the value, or hands
+ * back the call.
+ */
+static void compile_sexpr(compiler *c, lval *v, bool tail)
+{
+    if (LVAL_EXPR_CNT(v) == 0)
+    {
+        emit(c, OP_EMPTY, 0, 1);
+    }
+    else if (special_form(v))
+    {
+        compile_form(c, v, tail);
+        return;
+    }
+    else if (!compile_arith(c, v))
+    {
+        for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+        {
+            compile_expr(c, LVAL_EXPR_ITEM(v, i), false);
+        }
+
+        long count = LVAL_EXPR_CNT(v);
+        emit(c, tail ? OP_TAIL : OP_CALL, count, tail ? -count : 1 - count);
+        return;
+    }
+
+    if (tail)
+    {
+        emit(c, OP_RETURN, 0, -1);
+    }
+}
+
+static void compile_expr(compiler *c, lval *v, bool tail)
+{
+    switch (lval_type(v))
+    {
+    case LVAL_SYMBOL:
+        compile_symbol(c, v);
+        break;
+    case LVAL_SEXPRESSION:
+        compile_sexpr(c, v, tail);
+        return;
+    default:
+        emit(c, OP_CONST, add_const(c, v), 1);
+        break;
+    }
+
+    if (tail)
+    {
+        emit(c, OP_RETURN, 0, -1);
+    }
+}
+
+/**
+ * Compiles a list to code allocated wherever owner lives. If opt is set the
+ * optimised form it holds is compiled in place of the list, guarded by the
+ * assumptions it makes. If env is set arithmetic is specialised for the types
+ * of the formals bound there.
+ */
+static lcode *compile_code(lval *owner, lval *opt, lenv *env)
+{
+    compiler c = { .env = env };
+    for (size_t i = 1; opt && i < LVAL_EXPR_CNT(opt); i += 2)
+    {
+        add_guard(&c, LVAL_EXPR_ITEM(opt, i), LVAL_EXPR_ITEM(opt, i + 1), 0);
+    }
+
+    // The list is the whole of the code so is in tail position
+    compile_sexpr(&c, opt ? LVAL_EXPR_FIRST(opt) : owner, true);
+
+    // Instructions, constants, call sites and guards share one allocation, which lives wherever the list does
+    size_t instr_bytes = (c.count * sizeof(unsigned) + sizeof(lval*) - 1) / sizeof(lval*) * sizeof(lval*);
+    size_t size = sizeof(lcode) + instr_bytes + c.const_count * sizeof(lval*) + c.site_count * sizeof(lsite) +
+        c.guard_count * sizeof(lguard);
+    lcode *rv = owner->flags & LVAL_FLAG_ARENA ? arena_alloc(size) : malloc(size);
+    rv->size = size;
+    rv->consts = (lval**)((char*)rv->instrs + instr_bytes);
+    rv->const_count = c.const_count;
+    rv->sites = (lsite*)(rv->consts + c.const_count);
+    rv->site_count = c.site_count;
+    for (size_t i = 0; i < c.site_count; i++)
+    {
+        rv->sites[i].sym = c.sites[i];
+        rv->sites[i].cache = (lenv_cache){ 0 };
+    }
+
+    rv->guards = (lguard*)(rv->sites + c.site_count);
+    rv->guard_count = c.guard_count;
+    if (c.guard_count)
+    {
+        memcpy(rv->guards, c.guards, c.guard_count * sizeof(lguard));
+    }
+
+    rv->max_stack = c.max_stack;
+    rv->calls = 0;
+    rv->jit = 0;
+    rv->native = 0;
+    rv->opt = opt;
+    rv->generic = 0;
+    rv->count = c.count;
+    memcpy(rv->instrs, c.instrs, c.count * sizeof(unsigned));
+    if (c.const_count)
+    {
+        memcpy(rv->consts, c.consts, c.const_count * sizeof(lval*));
+    }
+
+    free(c.instrs);
+    free(c.consts);
+    free(c.sites);
+    free(c.guards);
+    return rv;
+}
+
+lcode *lval_compile(lval *v, lenv *env)
+{
+    if (v->flags & LVAL_FLAG_COMPILED)
+    {
+        return v->value.list.code;
+    }
+
+    // A list in the arena is evaluated once, or for the length of one top-level form, so is not worth optimising
+    if (v->flags & LVAL_FLAG_ARENA)
+    {
+        env = 0;
+    }
+
+    lval *opt = env ? lval_optimise(env, v) : 0;
+    if (opt)
+    {
+        // Heap values never reference arena values
+        lval *promoted = lval_promote(opt);
+        lval_del(opt);
+        opt = promoted;
+    }
+
+    lcode *code = compile_code(v, opt, env);
+    if (code->guard_count)
+    {
+        code->generic = compile_code(v, 0, 0);
+    }
+
+    // The constants belong to the list so it must not change while it has code
+    v->value.list.code = code;
+    v->flags |= LVAL_FLAG_COMPILED;
+    return code;
+}
+
+bool lcode_attach(lval *v, lnative native, size_t count)
+{
+    lcode *code = lval_compile(v, 0);
+    if (code->count != count)
+    {
+        return false;
+    }
+
+    code->native = native;
+    return true;
+}
+
+/**
+ * Frees code allocated wherever owner lives. Returns the number of bytes freed.
+ */
+static size_t code_free(const lval *owner, lcode *code)
+{
+    size_t rv = code->size;
+    if (code->jit)
+    {
+        jit_free(code->jit);
+    }
+
+    if (owner->flags & LVAL_FLAG_ARENA)
+    {
+        arena_free(code, code->size);
+    }
+    else
+    {
+        free(code);
+    }
+
+    return rv;
+}
+
+size_t lcode_free(lval *v, bool release)
+{
+    lcode *code = v->value.list.code;
+    size_t rv = 0;
+    if (code->generic)
+    {
+        rv += code_free(v, code->generic);
+    }
+
+    if (code->opt && release)
+    {
+        lval_del(code->opt);
+    }
+
+    rv += code_free(v, code);
+    v->value.list.code = 0;
+    v->flags &= ~LVAL_FLAG_COMPILED;
+    return rv;
+}
+
+void lcode_disassemble(const lcode *code)
+{
+    for (size_t i = 0; i < code->count; i++)
+    {
+        unsigned op = INSTR_OP(code->instrs[i]);
+        unsigned arg = INSTR_ARG(code->instrs[i]);
+        printf("%4zu  %-8s", i, opcode_names[op]);
+        switch (op)
+        {
+        case OP_CONST:
+        case OP_LOAD:
+        case OP_BUILTIN:
+        case OP_FORM:
+        case OP_LAMBDA:
+            printf("%-4u ; ", arg);
+            lval_print(code->consts[arg], 0);
+            break;
+        case OP_GLOBAL:
+            printf("%-4u ; ", arg);
+            lval_print(code->sites[arg].sym, 0);
+            break;
+        case OP_CALL:
+        case OP_TAIL:
+        case OP_JUMP:
+        case OP_IF:
+        case OP_AND:
+        case OP_OR:
+        case OP_TRY:
+        case OP_DROP:
+            printf("%u", arg);
+            break;
+        case OP_ARITH:
+            printf("%-4u ; %s %s", arg, arith_name(arg / 2), ltype_name(arg % 2 ? LVAL_DOUBLE : LVAL_LONG));
+            break;
+        }
+
+        putchar('\n');
+    }
+}
@@ -3,141 +3,217 @@
  */
 
 #include <math.h>
+#include <sys/resource.h>
 
 #include "lilith_int.h"
 #include "builtin_symbols.h"
+#include "bytecode.h"
 
-lval *lilith_eval_expr(lenv *env, lval *val);
+#define EVAL_LOCAL_FRAMES 8
+#define EVAL_SHADOW_WINDOW 4
+#define EVAL_MAX_DEPTH 1000000
+#define EVAL_STACK_SIZE (8 * 1024 * 1024)
 
 /**
- * Calls a function. Binds each parameter to its environment and evaluates
- * the function with that environment. If too few arguments are passed it
- * returns a new, partially evaluated function.
- * 
- * @param env  the top-level environment
- * @param func the function to call
- * @param args the arguments to pass to the function
- * @returns    a result, or a partially evaluated function
+ * The engine that evaluates s-expressions.
  */
-static lval *lval_call(lenv *env, lval *func, lval *args)
+static lilith_engine engine = LILITH_ENGINE_VM;
+
+/**
+ * Binds arguments to a user function's formals in a new call frame. Binding
+ * works from the function's parameter descriptor so the function itself is
+ * never changed or copied. If too few arguments are passed a partially applied
+ * function is returned instead.
+ *
+ * @param env   the environment the function is called from
+ * @param func  the function to bind
+ * @param args  the arguments to pass to the function -- freed in this function
+ * @param frame set to the call frame when every formal is bound
+ * @returns     null if every formal is bound, otherwise a partially applied function or an error
+ */
+static lval *lval_bind(lenv *env, const lval *func, lval *args, lenv **frame)
 {
-    if (func->type == LVAL_BUILTIN_FUN)
+    const lparams *params = &func->value.user_fun.params;
+    lval *formals = func->value.user_fun.formals;
+    size_t given = LVAL_EXPR_CNT(args);
+
+    if (given > params->arity && !params->variadic)
     {
-        return func->value.builtin(env, args);
+        lval_del(args);
+        return lval_error("Too many aruments passed to function - expected %u, received %zu",
+            params->arity, given);
     }
 
-    // Argument counts
-    size_t given = LVAL_EXPR_CNT(args);
-    size_t expected = LVAL_EXPR_CNT(func->value.user_fun.formals);
+    if (given >= params->arity && params->malformed)
+    {
+        lval_del(args);
+        return lval_error("function format invalid - symbol '&' not followed by single symbol");
+    }
 
-    // Bind the parameters to the formal symbols
-    while (LVAL_EXPR_CNT(args))
+    // Arguments from a partial application are already in the function's environment
+    lenv *e = lenv_copy(func->value.user_fun.env);
+    size_t bound = given < params->arity ? given : params->arity;
+    for (size_t i = 0; i < bound; i++)
     {
-        if (LVAL_EXPR_CNT(func->value.user_fun.formals) == 0)
+        lval *param = lval_pop(args);
+        lenv_put(e, LVAL_EXPR_ITEM(formals, i), param);
+        lval_del(param);
+    }
+
+    if (bound < params->arity)
+    {
+        lval_del(args);
+        return lval_partial(func, e, bound);
+    }
+
+    // The symbol after '&' is bound to the remaining arguments, which may be none
+    if (params->variadic)
+    {
+        lval *lst = call_builtin(env, SYMBOL_ID_LIST, args);
+        if (lval_type(lst) == LVAL_ERROR)
         {
-            lval_del(args);
-            return lval_error("Too many aruments passed to function - expected %d, received %d",
-                expected, given);
+            lenv_del(e);
+            return lst;
         }
 
-        // Consume arguments -- bind argument to formal
-        lval *sym = lval_pop(func->value.user_fun.formals);
+        lenv_put(e, LVAL_EXPR_ITEM(formals, params->arity + 1), lst);
+        lval_del(lst);
+    }
+    else
+    {
+        lval_del(args);
+    }
 
-        // Handle special case & - bind varargs as a q-expression
-        if (strcmp(sym->value.str_val, "&") == 0)
-        {
-            if (LVAL_EXPR_CNT(func->value.user_fun.formals) != 1)
-            {
-                lval_del(args);
-                return lval_error("function format invalid - symbol '&' not followed by single symbol");
-            }
+    *frame = e;
+    return 0;
+}
 
-            // Next formal should be bound to remaining arguments
-            lval *nsym = lval_pop(func->value.user_fun.formals);
-            lval *lst = call_builtin(env, BUILTIN_SYM_LIST, args);
-            if (lst->type == LVAL_ERROR)
-            {
-                lval_del(nsym);
-                lval_del(sym);
-                return lst;
-            }
+/**
+ * Calls a function. Binds each parameter in a new call frame and evaluates
+ * the function's body in that frame. If too few arguments are passed it
+ * returns a new, partially evaluated function.
+ * 
+ * @param env  the top-level environment
+ * @param func the function to call -- freed in this function
+ * @param args the arguments to pass to the function
+ * @returns    a result, or a partially evaluated function
+ */
+lval *lval_call(lenv *env, lval *func, lval *args)
+{
+    if (lval_type(func) == LVAL_BUILTIN_FUN)
+    {
+        lval *rv = func->value.builtin(env, args);
+        lval_del(func);
+        return rv;
+    }
 
-            lenv_put(func->value.user_fun.env, nsym, lst);
-            lval_del(nsym);
-            lval_del(sym);
-            break;
-        }
+    // Hot functions may run as native code
+    lval *rv = engine == LILITH_ENGINE_VM ? jit_call(env, func, args) : 0;
+    if (rv)
+    {
+        lval_del(func);
+        return rv;
+    }
 
-        lval *param = lval_pop(args);
-        lenv_put(func->value.user_fun.env, sym, param);
+    // Return the partially applied function or an error
+    lenv *frame;
+    rv = lval_bind(env, func, args, &frame);
+    if (rv)
+    {
+        lval_del(func);
+        return rv;
+    }
 
-        lval_del(sym);
-        lval_del(param);
+    // All arguments are bound so call function
+    lval *body = lval_ref(func->value.user_fun.body);
+    lval_del(func);
+    lenv_set_parent(frame, env);
+    rv = lval_eval_body(frame, body);
+    lenv_del(frame);
+    return rv;
+}
+
+/**
+ * Returns the ID of the special form an s-expression is if it is one the
+ * tree-walking evaluator treats specially -- and, or and do -- and no local
+ * binding shadows it. Otherwise returns zero.
+ */
+static unsigned tree_form(const lval *expr)
+{
+    lval *first = LVAL_EXPR_CNT(expr) > 1 ? LVAL_EXPR_FIRST(expr) : 0;
+    if (!first || lval_type(first) != LVAL_SYMBOL || symbol_is_local(first->value.sym.id))
+    {
+        return 0;
     }
 
-    // Argument list is bound so can be cleaned up
-    lval_del(args);
+    unsigned id = first->value.sym.id;
+    return id == SYMBOL_ID_AND || id == SYMBOL_ID_OR || id == SYMBOL_ID_DO ? id : 0;
+}
 
-    // If '&' remains in formal list bind to empty list
-    if (LVAL_EXPR_CNT(func->value.user_fun.formals) > 0 &&
-        strcmp(lval_expr_item(func->value.user_fun.formals, 0)->value.str_val, "&") == 0)
+/**
+ * Evaluates do, stopping at the first error. The final expression is in tail position.
+ */
+static lval *eval_do(lenv *env, lval *expr, ltail *tail)
+{
+    size_t count = LVAL_EXPR_CNT(expr);
+    for (size_t i = 1; i < count - 1; i++)
     {
-        // Check to ensure that & is not passed invalidly
-        if (LVAL_EXPR_CNT(func->value.user_fun.formals) != 2)
+        lval *x = lilith_eval_expr(env, lval_ref(LVAL_EXPR_ITEM(expr, i)));
+        if (lval_type(x) == LVAL_ERROR)
         {
-            return lval_error("function format invalid - symbol '&' not followed by single symbol");
+            lval_del(expr);
+            return x;
         }
 
-        // Pop and delete '&' symbol
-        lval_del(lval_pop(func->value.user_fun.formals));
-
-        // Pop next symbol and create empty list
-        lval *sym = lval_pop(func->value.user_fun.formals);
-        lval *val = lval_qexpression();
-
-        // Bind to environment and delete
-        lenv_put(func->value.user_fun.env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+        lval_del(x);
     }
 
-    if (LVAL_EXPR_CNT(func->value.user_fun.formals) == 0)
+    lval *last = lval_ref(LVAL_EXPR_ITEM(expr, count - 1));
+    lval_del(expr);
+    return lval_type(last) == LVAL_SEXPRESSION ? lval_eval_sexpr(env, last, tail) : lilith_eval_expr(env, last);
+}
+
+lval *lval_eval_sexpr(lenv *env, lval *expr, ltail *tail)
+{
+    unsigned form = tree_form(expr);
+    if (form == SYMBOL_ID_DO)
     {
-        // All arguments are bound so call function
-        lenv_set_parent(func->value.user_fun.env, env);
-        return call_builtin(func->value.user_fun.env, BUILTIN_SYM_EVAL,
-                            lval_add(lval_sexpression(), lval_copy(func->value.user_fun.body)));
+        return eval_do(env, expr, tail);
     }
 
-    /*
-     * Return the partially evaluated function. At this stage all of the passed-in params
-     * have been bound to the function's local environment and the corresponding formals
-     * have been removed.
-     */
-    return lval_copy(func);
-}
+    // and and or stop at the first argument that is not this value
+    lval *go = form == SYMBOL_ID_AND ? LVAL_TRUE : form == SYMBOL_ID_OR ? LVAL_FALSE : 0;
 
-static lval *lval_eval_sexpr(lenv *env, lval *val)
-{
-    // Evaluate children
-    for (pair *ptr = val->value.list.head; ptr; ptr = ptr->next)
+    // Evaluate children in to a new list so a function body is never copied or changed
+    lval *val = lval_sexpression();
+    lval_expr_reserve(val, LVAL_EXPR_CNT(expr));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(expr); i++)
     {
-        ptr->data = lilith_eval_expr(env, ptr->data);
+        lval *x = lilith_eval_expr(env, lval_ref(LVAL_EXPR_ITEM(expr, i)));
+        lval_add(val, x);
+
+        // The built-in gives the same result from the arguments up to the one that decides it
+        if (go && i && x != go)
+        {
+            break;
+        }
     }
 
+    lval_del(expr);
+
     // Empty expressions
     if (LVAL_EXPR_CNT(val) == 0)
     {
         return val;
     }
 
-    if (LVAL_EXPR_FIRST(val)->type == LVAL_ERROR)
+    if (lval_type(LVAL_EXPR_FIRST(val)) == LVAL_ERROR)
     {
         return lval_take(val, 0);
     }
 
     // Single expression
-    if (LVAL_EXPR_CNT(val) == 1 && (LVAL_EXPR_FIRST(val)->type != LVAL_BUILTIN_FUN))
+    if (LVAL_EXPR_CNT(val) == 1 && (lval_type(LVAL_EXPR_FIRST(val)) != LVAL_BUILTIN_FUN))
     {
         lval *rv = lval_pop(val);
         lval_del(val);
@@ -146,24 +222,29 @@ static lval *lval_eval_sexpr(lenv *env, lval *val)
 
     // First element must be a function
     lval *first = lval_pop(val);
-    if (first->type != LVAL_BUILTIN_FUN && first->type != LVAL_USER_FUN)
+    if (lval_type(first) != LVAL_BUILTIN_FUN && lval_type(first) != LVAL_USER_FUN)
     {
-        lval *rv = lval_error("s-expression does not start with function, '%s'", ltype_name(first->type));
+        lval *rv = lval_error("s-expression does not start with function, '%s'", ltype_name(lval_type(first)));
         lval_del(first);
         lval_del(val);
         return rv;
     }
 
+    if (tail)
+    {
+        tail->func = first;
+        tail->args = val;
+        return 0;
+    }
+
     // Call function
-    lval *result = lval_call(env, first, val);
-    lval_del(first);
-    return result;
+    return lval_call(env, first, val);
 }
 
 lval *lilith_eval_expr(lenv *env, lval *val)
 {
     // Lookup the function and return
-    if (val->type == LVAL_SYMBOL)
+    if (lval_type(val) == LVAL_SYMBOL)
     {
         lval *x = lenv_get(env, val);
         lval_del(val);
@@ -171,31 +252,320 @@ lval *lilith_eval_expr(lenv *env, lval *val)
     }
 
     // Evaluate Sexpressions
-    if (val->type == LVAL_SEXPRESSION)
+    if (lval_type(val) == LVAL_SEXPRESSION)
     {
-        return lval_eval_sexpr(env, val);
+        return engine == LILITH_ENGINE_VM ? lval_eval_body(env, val) : lval_eval_sexpr(env, val, 0);
     }
 
     // All other lval types remain the same
     return val;
 }
 
+/**
+ * Starts evaluating a list as an s-expression, handing a call back through
+ * call. The virtual machine runs code compiled from body, which must be kept
+ * until the code finishes.
+ */
+static lval *eval_start(lenv *env, lval *body, lvm *vm, ltail *call)
+{
+    // Compiled code is kept with the q-expression so it is evaluated without converting it
+    if (engine == LILITH_ENGINE_VM)
+    {
+        vm_enter(env, lval_compile(body, env), vm);
+        return vm_run(env, vm, call);
+    }
+
+    vm->ip = 0;
+    return lval_eval_sexpr(env, lval_ref(body), call);
+}
+
+/**
+ * Call frames entered by trampolines. Those a trampoline enters are above the
+ * ones entered when it started and released when it finishes.
+ */
+static struct
+{
+    lenv **items;
+    size_t count;
+    size_t capacity;
+} frames;
+
+/**
+ * A function body the virtual machine is running that waits on the result of
+ * a call it has made to a user function.
+ */
+typedef struct
+{
+    lenv *env;
+    lval *body;
+    lvm vm;
+    size_t floor;   // frames at or above this the body entered
+    size_t frames;  // frames at or above this belong to the call
+} eval_call;
+
+/**
+ * The calls being made, whose bodies wait on the result. This is the stack of
+ * continuations for calls that are not in tail position, kept on the heap so
+ * their depth is bounded by memory and the maximum depth rather than the C stack.
+ */
+static struct
+{
+    eval_call *items;
+    size_t count;
+    size_t capacity;
+} calls;
+
+static size_t max_depth = EVAL_MAX_DEPTH;
+
+/**
+ * Adds a frame to the top of the frames entered.
+ */
+static void frames_push(lenv *frame)
+{
+    if (frames.count == frames.capacity)
+    {
+        frames.capacity = frames.capacity ? frames.capacity * 2 : EVAL_LOCAL_FRAMES;
+        frames.items = realloc(frames.items, frames.capacity * sizeof(lenv*));
+    }
+
+    frames.items[frames.count++] = frame;
+}
+
+/**
+ * Releases the frames entered above count, the most recent first.
+ */
+static void frames_leave(size_t count)
+{
+    while (frames.count > count)
+    {
+        lenv_del(frames.items[--frames.count]);
+    }
+}
+
+/**
+ * Makes frame, whose parent is the current frame, the environment evaluation
+ * continues in after a tail call. Each frame entered is the parent of the next.
+ * Frames below floor are not the current body's to release.
+ */
+static lenv *frames_enter(size_t floor, lenv *frame)
+{
+    frames_push(frame);
+
+    /*
+     * The frames that tail calls have left are now only reachable through the new
+     * frame's parents. Any that binds nothing a lookup could reach past the frames
+     * above it can never be seen again so it is released. This keeps loops written
+     * as tail recursion in constant space.
+     */
+    size_t checked = 0;
+    for (size_t i = frames.count - 1; i > floor && checked < EVAL_SHADOW_WINDOW; checked++)
+    {
+        lenv *left = frames.items[--i];
+        if (lenv_is_shadowed(left, frame))
+        {
+            lenv_set_parent(frames.items[i + 1], lenv_parent(left));
+            lenv_del(left);
+            memmove(&frames.items[i], &frames.items[i + 1], (frames.count - i - 1) * sizeof(lenv*));
+            frames.count--;
+        }
+    }
+
+    return frame;
+}
+
+/**
+ * Returns true if the C stack has grown too deep to evaluate another body. The
+ * evaluator only recurses where a built-in evaluates an expression itself or the
+ * tree-walking evaluator makes a call that is not in tail position, and stops
+ * with an error well before the limit is reached.
+ */
+static bool stack_exhausted(void)
+{
+    static char *base;
+    static size_t limit;
+    char *here = __builtin_frame_address(0);
+    if (!base)
+    {
+        struct rlimit rl;
+        size_t size = getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ?
+            rl.rlim_cur : EVAL_STACK_SIZE;
+        base = here;
+        limit = size - size / 4;
+    }
+
+    return (size_t)(base > here ? base - here : here - base) > limit;
+}
+
+/*
+ * The trampoline. Calls in tail position -- the last call in a function body
+ * or in the expression evaluated by if, eval, unpack or let -- are handed back
+ * here and made in a loop rather than by recursing, so tail recursion runs in
+ * constant C stack space. The virtual machine hands back its other calls to user
+ * functions too. The body making one is kept on the stack of calls and resumed
+ * with the result, so recursion that is not in tail position does not grow the
+ * C stack either.
+ */
+lval *lval_eval_body(lenv *env, lval *body)
+{
+    if (stack_exhausted())
+    {
+        lval_del(body);
+        return lval_error("Expression nested too deeply to evaluate");
+    }
+
+    size_t level = calls.count;
+    size_t floor = frames.count;
+    size_t base = floor;
+    lvm vm;
+    ltail call;
+    lval *rv = eval_start(env, body, &vm, &call);
+    for (;;)
+    {
+        if (rv)
+        {
+            if (calls.count == level)
+            {
+                break;
+            }
+
+            // The body has finished so the one that called it carries on
+            lval_del(body);
+            eval_call *c = &calls.items[--calls.count];
+            frames_leave(c->frames);
+            env = c->env;
+            body = c->body;
+            vm = c->vm;
+            floor = c->floor;
+            vm_push(&vm, rv);
+            rv = vm_run(env, &vm, &call);
+            continue;
+        }
+
+        if (lval_type(call.func) == LVAL_BUILTIN_FUN)
+        {
+            // Built-ins that end by evaluating a q-expression hand it back to continue with
+            lenv *frame = env;
+            lval *next;
+            rv = call_builtin_body(env, call.func, call.args, &frame, &next);
+            if (rv)
+            {
+                continue;
+            }
+
+            if (frame != env)
+            {
+                env = frames_enter(floor, frame);
+            }
+
+            lval_del(body);
+            body = next;
+            rv = eval_start(env, body, &vm, &call);
+            continue;
+        }
+
+        // The body waits on the call unless it was the last thing the body did
+        bool waiting = vm.ip;
+        lenv *frame;
+        if (waiting && calls.count >= max_depth)
+        {
+            lval_del(call.args);
+            rv = lval_error("Maximum call depth of %zu exceeded", max_depth);
+        }
+        else
+        {
+            rv = engine == LILITH_ENGINE_VM ? jit_call(env, call.func, call.args) : 0;
+            if (!rv)
+            {
+                rv = lval_bind(env, call.func, call.args, &frame);
+            }
+        }
+
+        if (rv)
+        {
+            lval_del(call.func);
+            if (waiting)
+            {
+                vm_push(&vm, rv);
+                rv = vm_run(env, &vm, &call);
+            }
+
+            continue;
+        }
+
+        // The frame is kept until the function's body finishes, the function itself is no longer needed
+        lval *next = lval_ref(call.func->value.user_fun.body);
+        lval_del(call.func);
+        lenv_set_parent(frame, env);
+        if (waiting)
+        {
+            if (calls.count == calls.capacity)
+            {
+                calls.capacity = calls.capacity ? calls.capacity * 2 : EVAL_LOCAL_FRAMES;
+                calls.items = realloc(calls.items, calls.capacity * sizeof(eval_call));
+            }
+
+            calls.items[calls.count++] = (eval_call){ env, body, vm, floor, frames.count };
+            frames_push(frame);
+            floor = frames.count;
+            env = frame;
+        }
+        else
+        {
+            env = frames_enter(floor, frame);
+            lval_del(body);
+        }
+
+        body = next;
+        rv = eval_start(env, body, &vm, &call);
+    }
+
+    lval_del(body);
+    frames_leave(base);
+    return rv;
+}
+
+void lilith_set_engine(lilith_engine e)
+{
+    engine = e;
+}
+
+void lilith_set_max_depth(size_t depth)
+{
+    max_depth = depth;
+}
+
 lval *multi_eval(lenv *env, lval *expr)
 {
-    // Evaluate each expression
+    // Expressions waiting to be evaluated are live
+    gc_push_root(expr);
+
+    // Evaluate each expression, releasing its temporaries when done
     while (LVAL_EXPR_CNT(expr))
     {
+        lilith_arena_begin();
         lval *x = lilith_eval_expr(env, lval_pop(expr));
-        if (x->type == LVAL_ERROR)
+        if (lval_type(x) == LVAL_ERROR)
         {
+            lval *err = lval_promote(x);
+            lval_del(x);
+            lilith_arena_end();
+            gc_pop_root();
             lval_del(expr);
-            return x;
+            return err;
         }
 
         lval_del(x);
+        lilith_arena_end();
+
+        // Between top-level expressions nothing but the environment and the roots is live
+        if (!arena_active())
+        {
+            gc_safe_point(env);
+        }
     }
 
     // Delete expressions and arguments
+    gc_pop_root();
     lval_del(expr);
     return lval_sexpression();
 }
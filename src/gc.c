@@ -0,0 +1,263 @@
+/*
+ * Mark-sweep garbage collector for pool allocated lvals. Reference counting
+ * frees almost everything as soon as it is released; the collector reclaims
+ * what it misses -- values kept alive only by reference cycles or by a count
+ * that was never released. It runs at safe points between top-level
+ * evaluations, when every live value is reachable from the environment, the
+ * root stack or the symbol table and the arena is empty.
+ *
+ * The evaluator's working state -- the trampoline's frames, the calls waiting
+ * on a result, the virtual machine's value stack, the arena and the values
+ * built-ins hold in C locals -- is deliberately not a root. Built-ins keep
+ * values in C locals while they call back in to the evaluator, and anything
+ * reachable only from those would be swept, so scanning the frames and calls
+ * alone would not make a safe point inside a top-level expression sound. There
+ * are none, and cyclic garbage made while one expression runs, such as
+ * closures rebuilt on every pass of a long loop, stays in the pool until that
+ * expression finishes.
+ */
+
+#include <time.h>
+#include "bytecode.h"
+
+#define GC_MIN_THRESHOLD (64 * 1024)
+#define GC_ROOTS_MIN_CAPACITY 16
+
+gc_statistics gc_stats;
+
+static struct
+{
+    lval **roots;        // values held by evaluations in progress
+    size_t root_count;
+    size_t root_capacity;
+    size_t threshold;    // pool objects in use that trigger the next collection
+    bool requested;
+} gc = { 0, 0, 0, GC_MIN_THRESHOLD, false };
+
+void gc_push_root(lval *v)
+{
+    if (gc.root_count == gc.root_capacity)
+    {
+        gc.root_capacity = gc.root_capacity ? gc.root_capacity * 2 : GC_ROOTS_MIN_CAPACITY;
+        gc.roots = realloc(gc.roots, gc.root_capacity * sizeof(lval*));
+    }
+
+    gc.roots[gc.root_count++] = v;
+}
+
+void gc_pop_root(void)
+{
+    gc.root_count--;
+}
+
+void gc_request(void)
+{
+    gc.requested = true;
+}
+
+/**
+ * Calls fn for each lval a sequence cell holds a reference to, apart from the
+ * rest of the sequence.
+ */
+static void gc_seq_children(lval *v, void (*fn)(lval *v))
+{
+    switch (v->value.seq.source)
+    {
+    case LSEQ_ITEM:
+        fn(v->value.seq.item.first);
+        break;
+    case LSEQ_CALL:
+    case LSEQ_MAP:
+    case LSEQ_FILTER:
+        fn(v->value.seq.call.fn);
+        break;
+    case LSEQ_JOIN:
+        fn(v->value.seq.join.from);
+        break;
+    case LSEQ_LIST:
+        fn(v->value.seq.list.list);
+        break;
+    }
+}
+
+/**
+ * Returns the rest of the sequence a cell is part of, if the cell refers to it.
+ */
+static lval *gc_seq_rest(lval *v)
+{
+    switch (v->value.seq.source)
+    {
+    case LSEQ_ITEM:
+        return v->value.seq.item.rest;
+    case LSEQ_MAP:
+    case LSEQ_FILTER:
+        return v->value.seq.call.from;
+    case LSEQ_TAKE:
+        return v->value.seq.take.from;
+    case LSEQ_JOIN:
+        return v->value.seq.join.next;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Calls fn for each lval that v holds a reference to.
+ */
+static void gc_children(lval *v, void (*fn)(lval *v))
+{
+    switch (v->type)
+    {
+    case LVAL_STRING:
+        if (lval_string_owner(v))
+        {
+            fn(v->value.str.owner);
+        }
+        break;
+    case LVAL_SEXPRESSION:
+    case LVAL_QEXPRESSION:
+        for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+        {
+            fn(LVAL_EXPR_ITEM(v, i));
+        }
+
+        if (v->flags & LVAL_FLAG_COMPILED && v->value.list.code->opt)
+        {
+            fn(v->value.list.code->opt);
+        }
+        break;
+    case LVAL_USER_FUN:
+        lenv_for_each(v->value.user_fun.env, fn);
+        fn(v->value.user_fun.formals);
+        fn(v->value.user_fun.body);
+        break;
+    case LVAL_SEQ:
+        gc_seq_children(v, fn);
+        if (gc_seq_rest(v))
+        {
+            fn(gc_seq_rest(v));
+        }
+        break;
+    case LVAL_MEMO:
+        memo_for_each(v->value.memo, fn);
+        break;
+    }
+}
+
+static void gc_mark(lval *v)
+{
+    // The rest of a sequence is marked by looping rather than recursing as a sequence can be long
+    while (v && !lval_is_immediate(v) && !(v->flags & LVAL_FLAG_MARK))
+    {
+        v->flags |= LVAL_FLAG_MARK;
+        if (v->type != LVAL_SEQ)
+        {
+            gc_children(v, gc_mark);
+            return;
+        }
+
+        gc_seq_children(v, gc_mark);
+        v = gc_seq_rest(v);
+    }
+}
+
+/**
+ * Garbage is unmarked but still counted as in use. Interned symbols belong to
+ * the symbol table and are never collected.
+ */
+static bool gc_is_garbage(const lval *v)
+{
+    return v->refs && !(v->flags & (LVAL_FLAG_MARK | LVAL_FLAG_INTERNED));
+}
+
+static void gc_release_live(lval *v)
+{
+    if (!lval_is_immediate(v) && v->flags & LVAL_FLAG_MARK)
+    {
+        lval_del(v);
+    }
+}
+
+/**
+ * First sweep pass -- garbage gives up its references to live values.
+ */
+static void gc_sweep_references(void *obj)
+{
+    lval *v = obj;
+    if (!gc_is_garbage(v))
+    {
+        return;
+    }
+
+    // Environments are shared between closures so are freed with their last reference
+    if (v->type == LVAL_USER_FUN)
+    {
+        gc_stats.bytes_reclaimed += lenv_release(v->value.user_fun.env, gc_release_live);
+        gc_release_live(v->value.user_fun.formals);
+        gc_release_live(v->value.user_fun.body);
+        return;
+    }
+
+    gc_children(v, gc_release_live);
+}
+
+/**
+ * Second sweep pass -- garbage is freed and the survivors are unmarked.
+ */
+static void gc_sweep_free(void *obj)
+{
+    lval *v = obj;
+    if (gc_is_garbage(v))
+    {
+        gc_stats.bytes_reclaimed += lval_reclaim(v);
+        gc_stats.objects_reclaimed++;
+    }
+    else
+    {
+        v->flags &= ~LVAL_FLAG_MARK;
+    }
+}
+
+static void gc_collect(lenv *env)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    lenv_for_each(env, gc_mark);
+    for (size_t i = 0; i < gc.root_count; i++)
+    {
+        gc_mark(gc.roots[i]);
+    }
+
+    // References between garbage values are simply dropped, only live values need their counts fixed
+    pool_walk(&lval_pool, gc_sweep_references);
+    pool_walk(&lval_pool, gc_sweep_free);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t pause = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    gc_stats.collections++;
+    gc_stats.pause_us += pause;
+    if (pause > gc_stats.max_pause_us)
+    {
+        gc_stats.max_pause_us = pause;
+    }
+}
+
+void lilith_collect_garbage(lenv *env)
+{
+    gc_safe_point(env);
+}
+
+void gc_safe_point(lenv *env)
+{
+    if (!gc.requested && lval_pool.in_use < gc.threshold)
+    {
+        return;
+    }
+
+    gc_collect(env);
+    gc.requested = false;
+
+    // Let the heap double before collecting again
+    gc.threshold = lval_pool.in_use * 2 > GC_MIN_THRESHOLD ? lval_pool.in_use * 2 : GC_MIN_THRESHOLD;
+}
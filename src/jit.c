@@ -0,0 +1,697 @@
+/*
+ * A template JIT for hot numeric functions. A user function that has been
+ * called JIT_HOT_CALLS times and whose body uses only its formals, whole
+ * number and boolean literals, the arithmetic and comparison built-ins, if and
+ * calls to itself is compiled to x86-64 machine code, one fixed template per
+ * construct. Formals are held as untagged longs and calls to itself are native
+ * calls, or jumps when in tail position.
+ *
+ * Such functions have no side effects, so whenever the native code meets
+ * something it does not handle -- a divisor of zero or recursion deeper than
+ * JIT_MAX_DEPTH -- it abandons the whole call and the interpreter runs it again
+ * from the start. Calls whose arguments are not whole numbers, or made while a
+ * local binding shadows one of the symbols the code was compiled against, are
+ * left to the interpreter in the same way.
+ */
+
+#include "bytecode.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_HOT_CALLS 1000
+#define JIT_MAX_DEPTH 10000
+#define JIT_MAX_ARGS 16
+#define JIT_MAX_GUARDS 16
+#define JIT_MIN_CAPACITY 256
+
+/*
+ * A macro defining the built-ins the JIT compiles. The first argument is the
+ * operation; the second the symbol naming the built-in.
+ */
+#define JIT_OPS $(ADD, "+") $(SUB, "-") $(MUL, "*") $(MOD, "%") $(MAX, "max") $(MIN, "min")  \
+    $(GT, ">") $(LT, "<") $(GTE, ">=") $(LTE, "<=") $(IF, "if")
+
+/**
+ * The operations. Generated by the X macro.
+ */
+enum jit_op_enum
+{
+#define $(X, SYM) JIT_OP_##X,
+    JIT_OPS
+#undef $
+    JIT_OP_NONE
+};
+
+/**
+ * Names of the built-ins for each operation. Generated by the X macro.
+ */
+static const char *jit_op_names[] =
+{
+#define $(X, SYM) SYM,
+    JIT_OPS
+#undef $
+};
+
+/**
+ * The types native code works with. Expressions of any other type are not compiled.
+ */
+typedef enum
+{
+    JIT_TYPE_NONE,
+    JIT_TYPE_LONG,
+    JIT_TYPE_BOOL
+} jit_type;
+
+/**
+ * What native code returns, in rax and rdx.
+ */
+typedef struct
+{
+    long value;
+    long bailed;  // non-zero if the call was abandoned
+} jit_result;
+
+/**
+ * Native code takes its arguments as an array and the calls it may still nest.
+ */
+typedef jit_result (*jit_fn)(long *args, long depth);
+
+struct ljit
+{
+    void *code;                       // executable pages
+    size_t size;                      // bytes of machine code
+    size_t mapped;                    // bytes of pages mapped
+    unsigned arity;
+    jit_type returns;
+    lval *self;                       // symbol the function calls itself by, null if it does not
+    lenv_cache self_cache;
+    unsigned guard_count;
+    unsigned guards[JIT_MAX_GUARDS];  // built-in symbols that must not be bound locally
+};
+
+/**
+ * Machine code being assembled for a function.
+ */
+typedef struct
+{
+    unsigned char *buf;
+    size_t count;
+    size_t capacity;
+    size_t *bails;       // offsets of jumps to the bail-out stub
+    size_t bail_count;
+    size_t bail_capacity;
+    size_t body;         // offset of the code after the prologue, where tail calls jump
+    lenv *env;
+    const lval *func;
+    ljit *jit;
+} assembler;
+
+static bool jit_enabled = true;
+
+static void emit_bytes(assembler *a, const unsigned char *bytes, size_t n)
+{
+    if (a->count + n > a->capacity)
+    {
+        while (a->count + n > a->capacity)
+        {
+            a->capacity = a->capacity ? a->capacity * 2 : JIT_MIN_CAPACITY;
+        }
+
+        a->buf = realloc(a->buf, a->capacity);
+    }
+
+    memcpy(a->buf + a->count, bytes, n);
+    a->count += n;
+}
+
+#define EMIT(a, ...) emit_bytes(a, (const unsigned char[]){ __VA_ARGS__ }, sizeof((const unsigned char[]){ __VA_ARGS__ }))
+
+static void emit_u32(assembler *a, uint32_t v)
+{
+    emit_bytes(a, (const unsigned char*)&v, sizeof(v));
+}
+
+/**
+ * Emits the opcode of a jump or call followed by a zero displacement. Returns
+ * the offset of the displacement to patch.
+ */
+static size_t emit_jump(assembler *a, const unsigned char *op, size_t n)
+{
+    emit_bytes(a, op, n);
+    emit_u32(a, 0);
+    return a->count - 4;
+}
+
+/**
+ * Points the displacement at offset at to target.
+ */
+static void patch(assembler *a, size_t at, size_t target)
+{
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    memcpy(a->buf + at, &rel, sizeof(rel));
+}
+
+/**
+ * Emits a conditional jump to the bail-out stub.
+ */
+static void emit_bail_if(assembler *a, unsigned char cc)
+{
+    if (a->bail_count == a->bail_capacity)
+    {
+        a->bail_capacity = a->bail_capacity ? a->bail_capacity * 2 : JIT_MIN_CAPACITY;
+        a->bails = realloc(a->bails, a->bail_capacity * sizeof(size_t));
+    }
+
+    a->bails[a->bail_count++] = emit_jump(a, (const unsigned char[]){ 0x0F, cc }, 2);
+}
+
+/**
+ * Loads a constant in to rax.
+ */
+static void emit_load_const(assembler *a, long v)
+{
+    if (v >= INT32_MIN && v <= INT32_MAX)
+    {
+        EMIT(a, 0x48, 0xC7, 0xC0);  // mov rax, imm32
+        emit_u32(a, (uint32_t)v);
+    }
+    else
+    {
+        EMIT(a, 0x48, 0xB8);        // mov rax, imm64
+        emit_bytes(a, (const unsigned char*)&v, sizeof(v));
+    }
+}
+
+static jit_type compile_expr(assembler *a, lval *v, bool tail);
+static jit_type compile_sexpr(assembler *a, lval *v, bool tail);
+
+/**
+ * Records a symbol the code relies on naming a built-in.
+ */
+static bool add_guard(assembler *a, unsigned id)
+{
+    for (unsigned i = 0; i < a->jit->guard_count; i++)
+    {
+        if (a->jit->guards[i] == id)
+        {
+            return true;
+        }
+    }
+
+    if (a->jit->guard_count == JIT_MAX_GUARDS)
+    {
+        return false;
+    }
+
+    a->jit->guards[a->jit->guard_count++] = id;
+    return true;
+}
+
+/**
+ * Compiles a call to one of the arithmetic built-ins, folding its arguments
+ * left to right as builtin_op does.
+ */
+static jit_type compile_arith(assembler *a, lval *v, enum jit_op_enum op)
+{
+    if (LVAL_EXPR_CNT(v) < 2 || compile_expr(a, LVAL_EXPR_ITEM(v, 1), false) != JIT_TYPE_LONG)
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    if (LVAL_EXPR_CNT(v) == 2 && op == JIT_OP_SUB)
+    {
+        EMIT(a, 0x48, 0xF7, 0xD8);                          // neg rax
+    }
+
+    for (size_t i = 2; i < LVAL_EXPR_CNT(v); i++)
+    {
+        EMIT(a, 0x50);                                      // push rax
+        if (compile_expr(a, LVAL_EXPR_ITEM(v, i), false) != JIT_TYPE_LONG)
+        {
+            return JIT_TYPE_NONE;
+        }
+
+        EMIT(a, 0x48, 0x89, 0xC1, 0x58);                    // mov rcx, rax; pop rax
+        switch (op)
+        {
+        case JIT_OP_ADD:
+            EMIT(a, 0x48, 0x01, 0xC8);                      // add rax, rcx
+            break;
+        case JIT_OP_SUB:
+            EMIT(a, 0x48, 0x29, 0xC8);                      // sub rax, rcx
+            break;
+        case JIT_OP_MUL:
+            EMIT(a, 0x48, 0x0F, 0xAF, 0xC1);                // imul rax, rcx
+            break;
+        case JIT_OP_MAX:
+            EMIT(a, 0x48, 0x39, 0xC8, 0x48, 0x0F, 0x4C, 0xC1);  // cmp rax, rcx; cmovl rax, rcx
+            break;
+        case JIT_OP_MIN:
+            EMIT(a, 0x48, 0x39, 0xC8, 0x48, 0x0F, 0x4F, 0xC1);  // cmp rax, rcx; cmovg rax, rcx
+            break;
+        default:
+            // Divisors of 0 and -1 are left to the interpreter
+            EMIT(a, 0x48, 0x8D, 0x51, 0x01, 0x48, 0x83, 0xFA, 0x01);  // lea rdx, [rcx + 1]; cmp rdx, 1
+            emit_bail_if(a, 0x86);                          // jbe bail
+            EMIT(a, 0x48, 0x99, 0x48, 0xF7, 0xF9, 0x48, 0x89, 0xD0);  // cqo; idiv rcx; mov rax, rdx
+            break;
+        }
+    }
+
+    return JIT_TYPE_LONG;
+}
+
+/**
+ * Compiles a call to one of the comparison built-ins. Like the built-ins it
+ * compares the values as doubles.
+ */
+static jit_type compile_compare(assembler *a, lval *v, enum jit_op_enum op)
+{
+    if (LVAL_EXPR_CNT(v) != 3 || compile_expr(a, LVAL_EXPR_ITEM(v, 1), false) != JIT_TYPE_LONG)
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    EMIT(a, 0x50);                                          // push rax
+    if (compile_expr(a, LVAL_EXPR_ITEM(v, 2), false) != JIT_TYPE_LONG)
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    static const unsigned char setcc[] = { 0x97, 0x92, 0x93, 0x96 };  // seta, setb, setae, setbe
+    EMIT(a, 0x48, 0x89, 0xC1, 0x58);                        // mov rcx, rax; pop rax
+    EMIT(a, 0xF2, 0x48, 0x0F, 0x2A, 0xC0);                  // cvtsi2sd xmm0, rax
+    EMIT(a, 0xF2, 0x48, 0x0F, 0x2A, 0xC9);                  // cvtsi2sd xmm1, rcx
+    EMIT(a, 0x66, 0x0F, 0x2E, 0xC1);                        // ucomisd xmm0, xmm1
+    EMIT(a, 0x0F, setcc[op - JIT_OP_GT], 0xC0);             // setcc al
+    EMIT(a, 0x0F, 0xB6, 0xC0);                              // movzx eax, al
+    return JIT_TYPE_BOOL;
+}
+
+/**
+ * Compiles if. Both branches must be q-expressions giving the same type.
+ */
+static jit_type compile_if(assembler *a, lval *v, bool tail)
+{
+    if (LVAL_EXPR_CNT(v) != 4 || compile_expr(a, LVAL_EXPR_ITEM(v, 1), false) != JIT_TYPE_BOOL ||
+        lval_type(LVAL_EXPR_ITEM(v, 2)) != LVAL_QEXPRESSION || lval_type(LVAL_EXPR_ITEM(v, 3)) != LVAL_QEXPRESSION)
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    EMIT(a, 0x48, 0x85, 0xC0);                              // test rax, rax
+    size_t to_false = emit_jump(a, (const unsigned char[]){ 0x0F, 0x84 }, 2);  // jz false
+    jit_type rv = compile_sexpr(a, LVAL_EXPR_ITEM(v, 2), tail);
+    size_t to_end = emit_jump(a, (const unsigned char[]){ 0xE9 }, 1);          // jmp end
+    patch(a, to_false, a->count);
+    if (rv == JIT_TYPE_NONE || compile_sexpr(a, LVAL_EXPR_ITEM(v, 3), tail) != rv)
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    patch(a, to_end, a->count);
+    return rv;
+}
+
+/**
+ * Compiles a call of the function to itself. The arguments are pushed last
+ * first so they lie in order on the stack, where the callee reads them.
+ */
+static jit_type compile_self_call(assembler *a, lval *v, bool tail)
+{
+    if (LVAL_EXPR_CNT(v) - 1 != a->jit->arity)
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    for (size_t i = LVAL_EXPR_CNT(v) - 1; i > 0; i--)
+    {
+        if (compile_expr(a, LVAL_EXPR_ITEM(v, i), false) != JIT_TYPE_LONG)
+        {
+            return JIT_TYPE_NONE;
+        }
+
+        EMIT(a, 0x50);                                      // push rax
+    }
+
+    if (tail)
+    {
+        // Replace the arguments and start again
+        for (unsigned i = 0; i < a->jit->arity; i++)
+        {
+            EMIT(a, 0x58, 0x48, 0x89, 0x83);                // pop rax; mov [rbx + disp32], rax
+            emit_u32(a, i * sizeof(long));
+        }
+
+        patch(a, emit_jump(a, (const unsigned char[]){ 0xE9 }, 1), a->body);  // jmp body
+        return a->jit->returns;
+    }
+
+    EMIT(a, 0x48, 0x89, 0xE7, 0x4C, 0x89, 0xE6);            // mov rdi, rsp; mov rsi, r12
+    patch(a, emit_jump(a, (const unsigned char[]){ 0xE8 }, 1), 0);  // call self
+    EMIT(a, 0x48, 0x81, 0xC4);                              // add rsp, imm32
+    emit_u32(a, a->jit->arity * sizeof(long));
+    EMIT(a, 0x85, 0xD2);                                    // test edx, edx
+    emit_bail_if(a, 0x85);                                  // jnz bail
+    return a->jit->returns;
+}
+
+/**
+ * Returns true if sym is bound globally to the function being compiled.
+ */
+static bool is_self(assembler *a, lval *sym)
+{
+    if (symbol_is_local(sym->value.sym.id))
+    {
+        return false;
+    }
+
+    lval *f = lenv_get(a->env, sym);
+    bool rv = lval_type(f) == LVAL_USER_FUN && f->value.user_fun.body == a->func->value.user_fun.body &&
+        f->value.user_fun.params.arity == a->jit->arity && !f->value.user_fun.params.variadic;
+    lval_del(f);
+    return rv;
+}
+
+/**
+ * Compiles an s-expression that calls a function.
+ */
+static jit_type compile_call(assembler *a, lval *v, bool tail)
+{
+    lval *head = LVAL_EXPR_FIRST(v);
+    if (lval_type(head) != LVAL_SYMBOL || head->value.sym.slot != LVAL_SLOT_NONE)
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    unsigned id = head->value.sym.id;
+    if (!symbol_builtin(id))
+    {
+        if (a->jit->self ? a->jit->self->value.sym.id != id : !is_self(a, head))
+        {
+            return JIT_TYPE_NONE;
+        }
+
+        if (!a->jit->self)
+        {
+            a->jit->self = symbol_lval(id);
+        }
+
+        return compile_self_call(a, v, tail);
+    }
+
+    enum jit_op_enum op = 0;
+    while (op < JIT_OP_NONE && strcmp(jit_op_names[op], symbol_name(id)))
+    {
+        op++;
+    }
+
+    if (op == JIT_OP_NONE || !add_guard(a, id))
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    switch (op)
+    {
+    case JIT_OP_IF:
+        return compile_if(a, v, tail);
+    case JIT_OP_GT:
+    case JIT_OP_LT:
+    case JIT_OP_GTE:
+    case JIT_OP_LTE:
+        return compile_compare(a, v, op);
+    default:
+        return compile_arith(a, v, op);
+    }
+}
+
+/**
+ * Compiles a list evaluated as an s-expression, such as a function body or a branch of if.
+ */
+static jit_type compile_sexpr(assembler *a, lval *v, bool tail)
+{
+    if (LVAL_EXPR_CNT(v) == 0)
+    {
+        return JIT_TYPE_NONE;
+    }
+
+    // A single value evaluates to itself
+    lval *first = LVAL_EXPR_FIRST(v);
+    if (LVAL_EXPR_CNT(v) == 1 && !(lval_type(first) == LVAL_SYMBOL && symbol_builtin(first->value.sym.id)))
+    {
+        return compile_expr(a, first, tail);
+    }
+
+    return compile_call(a, v, tail);
+}
+
+static jit_type compile_expr(assembler *a, lval *v, bool tail)
+{
+    lval *formals = a->func->value.user_fun.formals;
+    switch (lval_type(v))
+    {
+    case LVAL_LONG:
+        emit_load_const(a, lval_as_long(v));
+        return JIT_TYPE_LONG;
+    case LVAL_BOOL:
+        emit_load_const(a, lval_as_bool(v));
+        return JIT_TYPE_BOOL;
+    case LVAL_SYMBOL:
+        // Only references resolved to the function's own formals
+        if (v->value.sym.slot >= a->jit->arity || LVAL_EXPR_ITEM(formals, v->value.sym.slot)->value.sym.id != v->value.sym.id)
+        {
+            return JIT_TYPE_NONE;
+        }
+
+        EMIT(a, 0x48, 0x8B, 0x83);                          // mov rax, [rbx + disp32]
+        emit_u32(a, v->value.sym.slot * sizeof(long));
+        return JIT_TYPE_LONG;
+    case LVAL_SEXPRESSION:
+        return compile_sexpr(a, v, tail);
+    default:
+        return JIT_TYPE_NONE;
+    }
+}
+
+/**
+ * Assembles a function assuming it returns a value of type returns. Returns
+ * false if the function cannot be compiled that way.
+ */
+static bool assemble(assembler *a, jit_type returns)
+{
+    a->count = 0;
+    a->bail_count = 0;
+    a->jit->returns = returns;
+    a->jit->guard_count = 0;
+    if (a->jit->self)
+    {
+        lval_del(a->jit->self);
+        a->jit->self = 0;
+    }
+
+    EMIT(a, 0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54);      // push rbp; mov rbp, rsp; push rbx; push r12
+    EMIT(a, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4);            // mov rbx, rdi; mov r12, rsi
+    EMIT(a, 0x49, 0xFF, 0xCC);                              // dec r12
+    emit_bail_if(a, 0x8E);                                  // jle bail
+    a->body = a->count;
+
+    if (compile_sexpr(a, a->func->value.user_fun.body, true) != returns)
+    {
+        return false;
+    }
+
+    EMIT(a, 0x31, 0xD2);                                    // xor edx, edx
+    size_t leave = a->count;
+    EMIT(a, 0x48, 0x8D, 0x65, 0xF0);                        // lea rsp, [rbp - 16]
+    EMIT(a, 0x41, 0x5C, 0x5B, 0x5D, 0xC3);                  // pop r12; pop rbx; pop rbp; ret
+
+    for (size_t i = 0; i < a->bail_count; i++)
+    {
+        patch(a, a->bails[i], a->count);
+    }
+
+    EMIT(a, 0xBA, 0x01, 0x00, 0x00, 0x00);                  // mov edx, 1
+    patch(a, emit_jump(a, (const unsigned char[]){ 0xE9 }, 1), leave);  // jmp leave
+    return true;
+}
+
+/**
+ * Compiles a function to native code. Returns null if it cannot be compiled.
+ */
+static ljit *jit_compile(lenv *env, const lval *func)
+{
+    // Each formal must have a slot of its own
+    lval *formals = func->value.user_fun.formals;
+    for (size_t i = 0; i < LVAL_EXPR_CNT(formals); i++)
+    {
+        for (size_t j = 0; j < i; j++)
+        {
+            if (LVAL_EXPR_ITEM(formals, i)->value.sym.id == LVAL_EXPR_ITEM(formals, j)->value.sym.id)
+            {
+                return 0;
+            }
+        }
+    }
+
+    ljit *jit = calloc(1, sizeof(ljit));
+    jit->arity = func->value.user_fun.params.arity;
+
+    assembler a = { 0 };
+    a.env = env;
+    a.func = func;
+    a.jit = jit;
+
+    // Calls to itself are assumed to give whatever the rest of the body does
+    if (assemble(&a, JIT_TYPE_LONG) || assemble(&a, JIT_TYPE_BOOL))
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        jit->size = a.count;
+        jit->mapped = (a.count + page - 1) / page * page;
+        jit->code = mmap(0, jit->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jit->code != MAP_FAILED)
+        {
+            memcpy(jit->code, a.buf, a.count);
+            mprotect(jit->code, jit->mapped, PROT_READ | PROT_EXEC);
+        }
+        else
+        {
+            jit->code = 0;
+        }
+    }
+
+    free(a.buf);
+    free(a.bails);
+
+    if (!jit->code)
+    {
+        jit_free(jit);
+        return 0;
+    }
+
+    return jit;
+}
+
+lval *jit_call(lenv *env, lval *func, lval *args)
+{
+    // Functions made inside an evaluation scope do not live long enough to be worth compiling
+    const lparams *params = &func->value.user_fun.params;
+    lval *body = func->value.user_fun.body;
+    if (!jit_enabled || params->variadic || params->arity > JIT_MAX_ARGS ||
+        LVAL_EXPR_CNT(args) != params->arity || (body->flags & (LVAL_FLAG_ARENA | LVAL_FLAG_COMPILED)) != LVAL_FLAG_COMPILED)
+    {
+        return 0;
+    }
+
+    // Left for the first call to compile, where the formals are bound
+    lcode *code = body->value.list.code;
+    if (!code->jit)
+    {
+        if (++code->calls != JIT_HOT_CALLS || !(code->jit = jit_compile(env, func)))
+        {
+            return 0;
+        }
+    }
+
+    // Guard the assumptions the code was compiled under
+    ljit *jit = code->jit;
+    if (jit->arity != params->arity)
+    {
+        return 0;
+    }
+
+    for (unsigned i = 0; i < jit->guard_count; i++)
+    {
+        if (symbol_is_local(jit->guards[i]))
+        {
+            return 0;
+        }
+    }
+
+    if (jit->self)
+    {
+        lval *f = lenv_get_cached(env, jit->self, &jit->self_cache);
+        bool same = lval_type(f) == LVAL_USER_FUN && f->value.user_fun.body == body &&
+            f->value.user_fun.params.arity == jit->arity && !f->value.user_fun.params.variadic;
+        lval_del(f);
+        if (!same)
+        {
+            return 0;
+        }
+    }
+
+    long argv[JIT_MAX_ARGS];
+    for (size_t i = 0; i < LVAL_EXPR_CNT(args); i++)
+    {
+        if (lval_type(LVAL_EXPR_ITEM(args, i)) != LVAL_LONG)
+        {
+            return 0;
+        }
+
+        argv[i] = lval_as_long(LVAL_EXPR_ITEM(args, i));
+    }
+
+    jit_result rv = ((jit_fn)jit->code)(argv, JIT_MAX_DEPTH);
+    if (rv.bailed)
+    {
+        return 0;
+    }
+
+    lval_del(args);
+    return jit->returns == JIT_TYPE_BOOL ? lval_bool(rv.value) : lval_long(rv.value);
+}
+
+void jit_free(ljit *jit)
+{
+    if (jit->code)
+    {
+        munmap(jit->code, jit->mapped);
+    }
+
+    if (jit->self)
+    {
+        lval_del(jit->self);
+    }
+
+    free(jit);
+}
+
+size_t jit_size(const ljit *jit)
+{
+    return jit->size;
+}
+
+void lilith_set_jit(bool enabled)
+{
+    jit_enabled = enabled;
+}
+
+#else
+
+lval *jit_call(lenv *env, lval *func, lval *args)
+{
+    (void)env;
+    (void)func;
+    (void)args;
+    return 0;
+}
+
+void jit_free(ljit *jit)
+{
+    (void)jit;
+}
+
+size_t jit_size(const ljit *jit)
+{
+    (void)jit;
+    return 0;
+}
+
+void lilith_set_jit(bool enabled)
+{
+    (void)enabled;
+}
+
+#endif
@@ -2,7 +2,6 @@
  * Maintains the Lisp Environment -- the function lookup table.
  */
 
-#include <collections.h>
 #include "lilith_int.h"
 
 #ifdef __linux
@@ -11,135 +10,402 @@ extern char _stdlib_llth_start;
 extern char stdlib_llth_start;
 #endif
 
+#define LENV_FRAME_SLOTS 8
+#define LENV_INDEX_MIN_CAPACITY 32
+
+/**
+ * A binding in an environment, keyed by symbol ID + 1.
+ */
+typedef struct
+{
+    unsigned key;
+    lval *value;
+} lenv_slot;
+
+/**
+ * Bindings are kept in the order they were made, so a function's call frame
+ * holds its formals at fixed slots that the resolution pass in lval_lambda can
+ * point references at. Small frames are searched directly; larger
+ * environments, such as the global one, add a hash index over the slots.
+ */
 struct lenv
 {
     lenv *parent;
-    void *table;
+    lenv *root;        // the environment at the end of the parent chain
+    lenv_slot *slots;  // bindings in the order they were made
+    unsigned *index;   // open addressed index of slot + 1, zero when empty, null for small frames
+    unsigned count;
+    unsigned capacity;
+    unsigned index_capacity;
+    unsigned refs;     // closures share environments until one of them binds a value
+    bool global;       // bindings here do not count as local for symbol_is_local
 };
 
 /**
  * Loads the statically linked Lilith standard library in to the environment.
  */
 static lval *load_std_lib(lenv *env)
+{
+    lval *expr = lilith_read_from_string(stdlib_source());
+    return multi_eval(env, expr);
+}
+
+const char *stdlib_source(void)
 {
 #ifdef __linux
-    char *stdlib = &_stdlib_llth_start;
+    return &_stdlib_llth_start;
 #else
-    char *stdlib = &stdlib_llth_start;
+    return &stdlib_llth_start;
 #endif
+}
 
-    lval *expr = lilith_read_from_string(stdlib);
-    return multi_eval(env, expr);
+static lenv *lenv_alloc(unsigned capacity)
+{
+    lenv *rv = malloc(sizeof(lenv));
+    rv->parent = 0;
+    rv->root = rv;
+    rv->slots = malloc(capacity * sizeof(lenv_slot));
+    rv->index = 0;
+    rv->count = 0;
+    rv->capacity = capacity;
+    rv->index_capacity = 0;
+    rv->refs = 1;
+    rv->global = false;
+    return rv;
+}
+
+/**
+ * Finds the index entry for a symbol ID, either the entry pointing at its slot or the empty entry it belongs in.
+ */
+static unsigned *lenv_index_find(const lenv *e, unsigned id)
+{
+    unsigned mask = e->index_capacity - 1;
+    for (unsigned i = (id * 2654435761u) & mask;; i = (i + 1) & mask)
+    {
+        unsigned *entry = &e->index[i];
+        if (!*entry || e->slots[*entry - 1].key == id + 1)
+        {
+            return entry;
+        }
+    }
+}
+
+/**
+ * Rebuilds the hash index with room for the current slots.
+ */
+static void lenv_index_build(lenv *e)
+{
+    e->index_capacity = e->index_capacity ? e->index_capacity * 2 : LENV_INDEX_MIN_CAPACITY;
+    while (e->count * 2 > e->index_capacity)
+    {
+        e->index_capacity *= 2;
+    }
+
+    free(e->index);
+    e->index = calloc(e->index_capacity, sizeof(unsigned));
+    for (unsigned i = 0; i < e->count; i++)
+    {
+        *lenv_index_find(e, e->slots[i].key - 1) = i + 1;
+    }
+}
+
+/**
+ * Returns the binding for a symbol ID in this environment only, or null if there is none.
+ */
+static lenv_slot *lenv_slot_find(const lenv *e, unsigned id)
+{
+    if (e->index)
+    {
+        unsigned entry = *lenv_index_find(e, id);
+        return entry ? &e->slots[entry - 1] : 0;
+    }
+
+    for (unsigned i = 0; i < e->count; i++)
+    {
+        if (e->slots[i].key == id + 1)
+        {
+            return &e->slots[i];
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Adds a binding for a symbol that is not already in the environment. Takes ownership of value.
+ */
+static void lenv_slot_add(lenv *e, unsigned id, lval *value)
+{
+    if (e->count == e->capacity)
+    {
+        e->capacity *= 2;
+        e->slots = realloc(e->slots, e->capacity * sizeof(lenv_slot));
+    }
+
+    e->slots[e->count].key = id + 1;
+    e->slots[e->count].value = value;
+    e->count++;
+
+    if (!e->global)
+    {
+        symbol_bind_local(id);
+    }
+
+    // Keep the index at most half full
+    if (e->count > LENV_FRAME_SLOTS && e->count * 2 > e->index_capacity)
+    {
+        lenv_index_build(e);
+    }
+    else if (e->index)
+    {
+        *lenv_index_find(e, id) = e->count;
+    }
 }
 
 lenv *lenv_new()
 {
-    lenv *rv = calloc(1, sizeof(lenv));
-    rv->table = hash_table(31);
-    return rv;
+    return lenv_alloc(LENV_FRAME_SLOTS);
 }
 
 void lenv_set_parent(lenv *env, lenv *parent)
 {
     env->parent = parent;
+    env->root = parent ? parent->root : env;
 }
 
 void lenv_del(lenv *e)
 {
-    void *iter = clxns_iter_new(e->table);
-    while (clxns_iter_move_next(iter))
+    if (--e->refs)
+    {
+        return;
+    }
+
+    lenv_for_each(e, lval_del);
+    lenv_free(e);
+}
+
+lenv *lenv_parent(lenv *e)
+{
+    return e->parent;
+}
+
+bool lenv_is_shadowed(lenv *e, lenv *from)
+{
+    for (unsigned i = 0; i < e->count; i++)
     {
-        kvp *val = clxns_iter_get_next(iter);
-        free(val->key);
-        lval_del(val->value);
+        lenv *f = from;
+        while (f != e && !lenv_slot_find(f, e->slots[i].key - 1))
+        {
+            f = f->parent;
+        }
+
+        if (f == e)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+lenv *lenv_ref(lenv *e)
+{
+    e->refs++;
+    return e;
+}
+
+size_t lenv_release(lenv *e, void (*release)(lval *v))
+{
+    if (--e->refs)
+    {
+        return 0;
     }
 
-    clxns_iter_free(iter);
-    clxns_free(e->table, 0);
+    lenv_for_each(e, release);
+    return lenv_free(e);
+}
+
+void lenv_for_each(lenv *e, void (*fn)(lval *v))
+{
+    for (unsigned i = 0; i < e->count; i++)
+    {
+        fn(e->slots[i].value);
+    }
+}
+
+size_t lenv_free(lenv *e)
+{
+    if (!e->global)
+    {
+        for (unsigned i = 0; i < e->count; i++)
+        {
+            symbol_unbind_local(e->slots[i].key - 1);
+        }
+    }
+
+    size_t rv = sizeof(lenv) + e->capacity * sizeof(lenv_slot) + e->index_capacity * sizeof(unsigned);
+    free(e->index);
+    free(e->slots);
     free(e);
+    return rv;
 }
 
+/**
+ * Bumped whenever a global environment changes, invalidating every lenv_cache.
+ */
+static unsigned long global_version = 1;
+
 lval *lenv_get(lenv *e, lval *k)
 {
-    lval *rv;
-    if (hash_table_get(e->table, k->value.str_val, (void**)&rv) == C_OK)
+    unsigned id = k->value.sym.id;
+
+    // A resolved reference to one of the formals of the function this frame belongs to
+    unsigned slot = k->value.sym.slot;
+    if (slot < e->count && e->slots[slot].key == id + 1)
+    {
+        return lval_ref(e->slots[slot].value);
+    }
+
+    // Only the root environment can bind a symbol that no local environment binds, where built-ins are fixed
+    if (!symbol_is_local(id))
+    {
+        lval *builtin = symbol_builtin(id);
+        if (builtin)
+        {
+            return lval_ref(builtin);
+        }
+
+        e = e->root;
+    }
+
+    for (; e; e = e->parent)
+    {
+        lenv_slot *binding = lenv_slot_find(e, id);
+        if (binding)
+        {
+            return lval_ref(binding->value);
+        }
+    }
+
+    return lval_error("unbound symbol '%s'", k->value.sym.name);
+}
+
+lval *lenv_get_cached(lenv *e, lval *k, lenv_cache *cache)
+{
+    if (symbol_is_local(k->value.sym.id))
     {
-        return lval_copy(rv);
+        return lenv_get(e, k);
     }
 
-    if (e->parent)
+    if (cache->root != e->root || cache->version != global_version)
     {
-        return lenv_get(e->parent, k);
+        lenv_slot *binding = lenv_slot_find(e->root, k->value.sym.id);
+        if (!binding)
+        {
+            return lenv_get(e, k);
+        }
+
+        cache->root = e->root;
+        cache->version = global_version;
+        cache->value = binding->value;
     }
 
-    return lval_error("unbound symbol '%s'", k->value.str_val);
+    return lval_ref(cache->value);
 }
 
 bool lenv_put(lenv *e, lval *k, lval *v)
 {
-    lval *ptr;
-    if (hash_table_get(e->table, k->value.str_val, (void**)&ptr) == C_OK && ptr->type == LVAL_BUILTIN_FUN)
+    if (e->global)
+    {
+        global_version++;
+    }
+
+    lenv_slot *binding = lenv_slot_find(e, k->value.sym.id);
+    if (!binding)
+    {
+        lenv_slot_add(e, k->value.sym.id, lval_ref(v));
+        return false;
+    }
+
+    if (lval_type(binding->value) == LVAL_BUILTIN_FUN)
     {
         return true;
     }
 
-    hash_table_add(e->table, strdup(k->value.str_val), lval_copy(v));
+    lval_del(binding->value);
+    binding->value = lval_ref(v);
     return false;
 }
 
 bool lenv_def(lenv *e, lval *k, lval *v)
 {
-    while (e->parent)
+    // Global values outlive the current arena scope
+    lval *x = lval_promote(v);
+    bool rv = lenv_put(e->root, k, x);
+    lval_del(x);
+    return rv;
+}
+
+/**
+ * Copies an environment, passing each value through copy_val. The copy keeps the slot order.
+ */
+static lenv *lenv_copy_with(lenv *e, lval *(*copy_val)(lval*))
+{
+    lenv *rv = lenv_alloc(e->count > LENV_FRAME_SLOTS ? e->count : LENV_FRAME_SLOTS);
+    rv->global = e->global;
+
+    // The parent of a closure's environment may be a frame that has since returned so is not followed
+    rv->parent = e->parent;
+    rv->root = e->root == e ? rv : e->root;
+    for (unsigned i = 0; i < e->count; i++)
     {
-        e = e->parent;
+        lenv_slot_add(rv, e->slots[i].key - 1, copy_val(e->slots[i].value));
     }
 
-    return lenv_put(e, k, v);
+    return rv;
 }
 
 lenv *lenv_copy(lenv *e)
 {
-    lenv *rv = malloc(sizeof(lenv));
-    rv->parent = e->parent;
-    rv->table = hash_table(clxns_count(e->table));
-
-    void *iter = clxns_iter_new(e->table);
-    while (clxns_iter_move_next(iter))
-    {
-        kvp *val = clxns_iter_get_next(iter);
-        hash_table_add(rv->table, strdup(val->key), lval_copy(val->value));
-    }
+    return lenv_copy_with(e, lval_ref);
+}
 
-    clxns_iter_free(iter);
-    return rv; 
+lenv *lenv_promote(lenv *e)
+{
+    return lenv_copy_with(e, lval_promote);
 }
 
 lval *lenv_to_lval(lenv *env)
 {
     lval *rv = lval_qexpression();
-
-    void *iter = clxns_iter_new(env->table);
-    while (clxns_iter_move_next(iter))
+    for (unsigned i = 0; i < env->count; i++)
     {
-        kvp *val = clxns_iter_get_next(iter);
         lval *pair = lval_qexpression();
-        lval_add(pair, lval_string(val->key));
-        lval_add(pair, lval_copy(val->value));
+        lval_add(pair, lval_string(symbol_name(env->slots[i].key - 1)));
+        lval_add(pair, lval_ref(env->slots[i].value));
         lval_add(rv, pair);
     }
 
     return rv;
 }
 
-lenv *lilith_init()
+lenv *lilith_init_runtime()
 {
     lenv *env = lenv_new();
+    env->global = true;
     lenv_add_builtin_sums(env);
     lenv_add_builtin_core(env);
+    lenv_add_builtin_list(env);
     lenv_add_builtin_os(env);
+    lenv_add_builtin_memo(env);
+    return env;
+}
 
+lenv *lilith_init()
+{
+    lenv *env = lilith_init_runtime();
     lval *x = load_std_lib(env);
-    if (x->type == LVAL_ERROR)
+    if (lval_type(x) == LVAL_ERROR)
     {
         lilith_println(x);
         return 0;
@@ -4,16 +4,34 @@
  * Lilith -- a Lisp interpreter.
  */
 
+#include <stdbool.h>
+#include <stddef.h>
+
 struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
 
+/**
+ * The engines that can evaluate Lilith expressions.
+ */
+typedef enum
+{
+    LILITH_ENGINE_TREE,  // walks the expression tree directly
+    LILITH_ENGINE_VM     // compiles expressions to bytecode for a virtual machine
+} lilith_engine;
+
 /**
  * Initialises a new Lilith environment.
  */
 lenv *lilith_init();
 
+/**
+ * Initialises a new Lilith environment with the built-ins but not the standard
+ * library, for programs compiled with lilith_compile_file that bring their own.
+ */
+lenv *lilith_init_runtime();
+
 /**
  * Evaluates a Lilith value, consumes input in the process.
  * 
@@ -39,6 +57,17 @@ lval *lilith_read_from_string(const char *input);
  */
 void lilith_eval_file(lenv *env, const char *filename);
 
+/**
+ * Compiles a Lilith program and the standard library ahead of time in to C.
+ * The output has a main function and is linked with every part of the
+ * interpreter except the REPL. Built-ins must have been set up by lilith_init.
+ *
+ * @param filename the Lilith program
+ * @param output   the C file to write
+ * @returns        zero on success, or non-zero after printing an error
+ */
+int lilith_compile_file(const char *filename, const char *output);
+
 /**
  * Prints the contents of a Lilith value to the screen.
  * 
@@ -53,6 +82,54 @@ void lilith_println(const lval *val);
  */
 void lilith_lval_del(lval *val);
 
+/**
+ * Opens an evaluation scope. Temporary values created until the matching
+ * lilith_arena_end are allocated from an arena and released in bulk. Scopes
+ * may be nested; memory is released when the outermost one closes.
+ */
+void lilith_arena_begin(void);
+
+/**
+ * Closes an evaluation scope. Values created in the scope must have been
+ * freed or stored in the environment before the outermost scope closes.
+ */
+void lilith_arena_end(void);
+
+/**
+ * Runs the garbage collector if a collection is due. Must only be called
+ * between evaluations, outside of any evaluation scope.
+ *
+ * @param env the Lilith environment
+ */
+void lilith_collect_garbage(lenv *env);
+
+/**
+ * Chooses the engine used to evaluate expressions. The bytecode virtual
+ * machine is the default.
+ *
+ * @param engine the engine to use from now on
+ */
+void lilith_set_engine(lilith_engine engine);
+
+/**
+ * Sets how deep calls that are not in tail position may go before evaluation
+ * stops with an error. Calls waiting on a result are kept on the heap rather
+ * than the C stack, so the depth is limited only by this and memory. This only
+ * applies to the bytecode virtual machine. The tree-walking interpreter makes
+ * such calls on the C stack, and stops with an error when that runs low.
+ *
+ * @param depth the maximum number of calls waiting on a result
+ */
+void lilith_set_max_depth(size_t depth);
+
+/**
+ * Turns the JIT on or off. When on, which is the default, the virtual machine
+ * compiles hot numeric functions to native code on x86-64 Linux.
+ *
+ * @param enabled true to compile hot functions
+ */
+void lilith_set_jit(bool enabled);
+
 /**
  * Frees up the Lilith environment.
  */
@@ -2,18 +2,40 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include "lilith.h"
 
 #define LVAL_EXPR_CNT(arg) arg->value.list.count
-#define LVAL_EXPR_FIRST(arg) arg->value.list.head->data
+#define LVAL_EXPR_ITEM(arg, i) arg->value.list.items[i]
+#define LVAL_EXPR_FIRST(arg) LVAL_EXPR_ITEM(arg, 0)
 
 /**
  * Pointer to a built-in function.
  */
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/**
+ * Bytecode compiled from a list.
+ */
+typedef struct lcode lcode;
+
+/**
+ * The results a memoised function has cached.
+ */
+typedef struct lmemo lmemo;
+
+/**
+ * Parameter descriptor, worked out from a function's formals when the function is created.
+ */
+typedef struct
+{
+    unsigned arity;   // formals before any '&'
+    bool variadic;    // an '&' follows, whose symbol takes the remaining arguments
+    bool malformed;   // the '&' is not followed by exactly one symbol
+} lparams;
+
 /**
  * Lisp Value types.
  */
@@ -28,17 +50,79 @@ enum
     LVAL_BUILTIN_FUN,
     LVAL_SEXPRESSION,
     LVAL_QEXPRESSION,
-    LVAL_USER_FUN
+    LVAL_USER_FUN,
+    LVAL_SEQ,
+    LVAL_MEMO
 };
 
 /**
- * A node in an lval linked list.
+ * Where the item of a sequence cell comes from.
  */
-typedef struct _pair
+enum
 {
-    lval *data;
-    struct _pair *next;
-} pair;
+    LSEQ_ITEM,    // the cell has been read and holds its item
+    LSEQ_END,     // the cell has been read and is the end of the sequence
+    LSEQ_CALL,    // the result of calling a function, which gives nil at the end
+    LSEQ_LIST,    // the next item of a q-expression
+    LSEQ_RANGE,   // the next number of a range
+    LSEQ_LINES,   // the next line of a file
+    LSEQ_MAP,     // a function called on the next item of another sequence
+    LSEQ_FILTER,  // the next item of another sequence a predicate is true for
+    LSEQ_TAKE,    // the next item of another sequence until a count runs out
+    LSEQ_JOIN     // the next item of one sequence, then those of another
+};
+
+/**
+ * lval flags.
+ */
+#define LVAL_FLAG_ARENA 0x0001
+#define LVAL_FLAG_MARK 0x0002
+#define LVAL_FLAG_INTERNED 0x0004
+#define LVAL_FLAG_COMPILED 0x0008
+
+/**
+ * Frame slot of a symbol that has not been resolved to a formal.
+ */
+#define LVAL_SLOT_NONE ((unsigned)-1)
+
+/**
+ * Strings up to this length are stored inside the lval.
+ */
+#define LVAL_STRING_INLINE 16
+
+/**
+ * IDs of symbols interned before any others. The special forms -- the built-ins
+ * from SYMBOL_ID_LAMBDA to SYMBOL_ID_DO -- are recognised by the compiler.
+ */
+#define SYMBOL_ID_AMPERSAND 0
+#define SYMBOL_ID_LIST 1
+#define SYMBOL_ID_LAMBDA 2
+#define SYMBOL_ID_IF 3
+#define SYMBOL_ID_AND 4
+#define SYMBOL_ID_OR 5
+#define SYMBOL_ID_TRY 6
+#define SYMBOL_ID_DO 7
+
+/**
+ * A slab pool of fixed-size objects.
+ */
+typedef struct
+{
+    const char *name;  // name reported in the pool statistics
+    size_t size;       // size of each object
+    void *free;        // intrusive list of unused objects
+    void *slabs;       // slabs allocated so far
+    size_t in_use;     // objects currently allocated
+    size_t high_water; // most objects allocated at any one time
+    size_t capacity;   // objects available across all slabs
+} pool;
+
+#define POOL_INIT(pool_name, type) { pool_name, sizeof(type), 0, 0, 0, 0, 0 }
+
+/**
+ * Pool for long-lived lvals.
+ */
+extern pool lval_pool;
 
 /**
  * Lisp Value -- a node in an expression.
@@ -49,33 +133,200 @@ struct lval
     {
         long num_l;
         double num_d;
-        bool bval;
         char *str_val;
 
-        // s-expressions or q-expressions
+        // strings -- len characters at ptr, which points either to buf for short
+        // strings, to a heap buffer, or in to the characters of owner for a slice
+        struct
+        {
+            const char *ptr;
+            size_t len;
+            union
+            {
+                lval *owner;
+                char buf[LVAL_STRING_INLINE];
+            };
+        } str;
+
+        // symbols -- the interned name, its ID and, for references to a
+        // function's formals, the frame slot the formal is bound to
+        struct
+        {
+            const char *name;
+            unsigned id;
+            unsigned slot;
+        } sym;
+
+        // s-expressions or q-expressions -- items points to the first element,
+        // which is start elements in to an array with room for capacity elements,
+        // and code is the list's bytecode once it has been compiled
         struct
         {
+            lval **items;
             size_t count;
-            pair *head;
+            unsigned start;
+            unsigned capacity;
+            lcode *code;
         } list;
 
-        // functions
+        // functions -- env holds arguments bound by partial application
         lbuiltin builtin;
         struct
         {
             lenv *env;
             lval *formals;
             lval *body;
+            lparams params;
         } user_fun;
+
+        // sequences -- a cell of a lazy sequence. A cell is read when its item is
+        // first needed, which takes the item from the cell's source and hands the
+        // source on to a new cell for the rest of the sequence
+        struct
+        {
+            unsigned source;
+            union
+            {
+                struct { lval *first; lval *rest; } item;
+                struct { lval *fn; lval *from; } call;    // also map and filter
+                struct { long n; lval *from; } take;
+                struct { lval *from; lval *next; } join;
+                struct { lval *list; size_t at; } list;
+                struct { long at; long to; } range;
+                FILE *file;
+            };
+        } seq;
+
+        // memo tables -- the results cached by a memoised function, which its
+        // body passes to the built-in that looks them up
+        lmemo *memo;
     } value;
-    unsigned type;
+    unsigned short type;
+    unsigned short flags;
+    unsigned refs;
 };
 
+/*
+ * Immediate values. Numbers and booleans are encoded in the lval pointer itself
+ * rather than allocated. Allocated lvals are at least 8-byte aligned so the low
+ * three bits of a real pointer are always clear:
+ *
+ *   ...xx1 -- a long shifted left by one bit
+ *   ...x10 -- a double with its exponent rotated in to the low bits
+ *   ...100 -- a boolean, 0x04 for #f and 0x0C for #t
+ *
+ * Longs that do not fit in 63 bits and doubles with very large or very small
+ * exponents are allocated as normal.
+ */
+#define LVAL_TAG_MASK 0x7
+#define LVAL_TAG_LONG 0x1
+#define LVAL_TAG_DOUBLE 0x2
+#define LVAL_TAG_BOOL 0x4
+#define LVAL_FALSE ((lval*)0x04)
+#define LVAL_TRUE ((lval*)0x0C)
+#define LVAL_DOUBLE_ZERO ((uintptr_t)0x8000000000000002)
+
+_Static_assert(sizeof(uintptr_t) == sizeof(double), "immediate doubles need 64-bit pointers");
+
+/**
+ * Returns true if the lval is encoded in its pointer.
+ */
+static inline bool lval_is_immediate(const lval *v)
+{
+    return (uintptr_t)v & LVAL_TAG_MASK;
+}
+
+/**
+ * Returns the type of an lval.
+ */
+static inline unsigned lval_type(const lval *v)
+{
+    uintptr_t bits = (uintptr_t)v;
+    if (bits & LVAL_TAG_LONG)
+    {
+        return LVAL_LONG;
+    }
+
+    if (bits & LVAL_TAG_DOUBLE)
+    {
+        return LVAL_DOUBLE;
+    }
+
+    if (bits & LVAL_TAG_BOOL)
+    {
+        return LVAL_BOOL;
+    }
+
+    return v->type;
+}
+
+/**
+ * Returns the value of an LVAL_LONG.
+ */
+static inline long lval_as_long(const lval *v)
+{
+    return (uintptr_t)v & LVAL_TAG_LONG ? (long)((intptr_t)v >> 1) : v->value.num_l;
+}
+
+/**
+ * Returns the value of an LVAL_DOUBLE.
+ */
+static inline double lval_as_double(const lval *v)
+{
+    uintptr_t bits = (uintptr_t)v;
+    if (!(bits & LVAL_TAG_DOUBLE))
+    {
+        return v->value.num_d;
+    }
+
+    if (bits == LVAL_DOUBLE_ZERO)
+    {
+        return 0.0;
+    }
+
+    // Restore the two exponent bits dropped by the encoding then rotate back
+    bits = (bits & ~(uintptr_t)0x3) | (2 - (bits >> 63));
+    bits = (bits >> 3) | (bits << 61);
+
+    double rv;
+    memcpy(&rv, &bits, sizeof(rv));
+    return rv;
+}
+
+/**
+ * Returns the value of an LVAL_BOOL.
+ */
+static inline bool lval_as_bool(const lval *v)
+{
+    return v == LVAL_TRUE;
+}
+
+/**
+ * Returns true if a string's characters are stored inside the lval.
+ */
+static inline bool lval_string_is_inline(const lval *v)
+{
+    return v->value.str.ptr == v->value.str.buf;
+}
+
+/**
+ * Returns the string a slice shares its characters with, or null if v owns its characters.
+ */
+static inline lval *lval_string_owner(const lval *v)
+{
+    return lval_string_is_inline(v) ? 0 : v->value.str.owner;
+}
+
 /**
  * Return an item from the list.
  */
 lval *lval_expr_item(lval *val, unsigned i);
 
+/**
+ * Ensures a list has room for at least count items.
+ */
+void lval_expr_reserve(lval *v, size_t count);
+
 /**
  * Remove and return the first item in the list.
  */
@@ -102,7 +353,7 @@ lval *lval_long(long num);
 lval *lval_double(double num);
 
 /**
- * Generates a nw lval for a boolean.
+ * Generates a new lval for a boolean.
  */
 lval *lval_bool(bool bval);
 
@@ -111,11 +362,32 @@ lval *lval_bool(bool bval);
  */
 lval *lval_string(const char *string);
 
+/**
+ * Generates a new lval for the first len characters of a string.
+ */
+lval *lval_string_len(const char *string, size_t len);
+
+/**
+ * Generates a new lval for len characters of the string v starting at start.
+ * The new string shares its characters with v rather than copying them.
+ */
+lval *lval_substring(lval *v, size_t start, size_t len);
+
+/**
+ * Returns a null terminated copy of a string lval. The caller frees the copy.
+ */
+char *lval_string_dup(const lval *v);
+
 /**
  * Genereates a new lval for a symbol.
  */
 lval *lval_symbol(const char *symbol);
 
+/**
+ * Generates a new lval for a reference to a formal, resolved to its frame slot.
+ */
+lval *lval_formal(const char *symbol, unsigned slot);
+
 /**
  * Generates a new lval for an s-expression. The returned value
  * contains no data and represents the start of an lval hierarchy.
@@ -139,7 +411,58 @@ lval *lval_fun(lbuiltin function);
 lval *lval_lambda(lval *formals, lval* body);
 
 /**
- * Adds an lval to an s-expression.
+ * The resolution pass lval_lambda makes over a function's body. Consumes v.
+ */
+lval *lval_resolve(lval *v, const lval *formals);
+
+/**
+ * Generates a new lval for a function partially applied to its first bound
+ * formals, whose values are bound in env. Consumes env.
+ */
+lval *lval_partial(const lval *func, lenv *env, size_t bound);
+
+/**
+ * Generates a new lval for a sequence cell that takes its item from source.
+ * The caller fills in the source's fields. Cells are read long after they are
+ * made so are never taken from the arena, and anything they hold must be
+ * promoted out of it.
+ */
+lval *lval_seq(unsigned source);
+
+/**
+ * Reads a sequence cell if it has not been read already, leaving it holding
+ * an item or marking the end. An error reading the cell becomes its item and
+ * ends the sequence.
+ */
+void seq_read(lenv *env, lval *seq);
+
+/**
+ * Returns a reference to the next item of a sequence and moves *seq on to the
+ * rest of it, releasing the cell passed, or returns null at the end.
+ */
+lval *seq_next(lenv *env, lval **seq);
+
+/**
+ * Generates a new lval for a memo table. Consumes memo. Like sequence cells,
+ * memo tables outlive the scope they are made in so are never taken from the
+ * arena.
+ */
+lval *lval_memo(lmemo *memo);
+
+/**
+ * Frees a memo table. Returns the number of bytes freed. The function and the
+ * cached arguments and results are released too, unless the garbage collector
+ * frees them itself.
+ */
+size_t memo_free(lmemo *memo, bool release);
+
+/**
+ * Calls fn for each lval a memo table holds a reference to.
+ */
+void memo_for_each(lmemo *memo, void (*fn)(lval *v));
+
+/**
+ * Adds an lval to the end of an s-expression. Amortised O(1).
  */
 lval *lval_add(lval *v, lval *x);
 
@@ -149,20 +472,62 @@ lval *lval_add(lval *v, lval *x);
 void lval_print(const lval *v, unsigned options);
 
 /**
- * Perform a deep copy on an lval.
+ * Copies the top level of an lval. Child values are shared with the original.
  */
 lval *lval_copy(lval *v);
 
+/**
+ * Takes a new reference to an lval. Each reference is released with lval_del.
+ */
+lval *lval_ref(lval *v);
+
+/**
+ * Returns an lval that is safe to modify. If v is shared it is copied and
+ * the caller's reference to v is released.
+ */
+lval *lval_unshare(lval *v);
+
+/**
+ * Returns a reference to a version of v that is safe to keep once the current
+ * arena scope closes. Arena values are copied to the heap, heap values are shared.
+ */
+lval *lval_promote(lval *v);
+
 /**
  * Check two lvals for equality.
  */
 bool lval_is_equal(lval *x, lval *y);
 
 /**
- * Free an lval.
+ * Check two lvals are the same -- equal, and of the same type throughout, so
+ * 1 and 1.0 or -0.0 and 0.0 are not the same.
+ */
+bool lval_is_same(lval *x, lval *y);
+
+/**
+ * Returns a hash of an lval's structure. Values that lval_is_equal finds
+ * equal have the same hash, so 1 and 1.0 hash alike and functions hash by
+ * their formals and body.
+ */
+size_t lval_hash(lval *v);
+
+/**
+ * Returns a hash of an lval's structure for lval_is_same, so 1 and 1.0 hash
+ * differently.
+ */
+size_t lval_hash_same(lval *v);
+
+/**
+ * Release a reference to an lval, freeing it when no references remain.
  */
 void lval_del(lval *v);
 
+/**
+ * Frees an unreachable pool lval without releasing the values or environment
+ * it refers to. Returns the number of bytes freed.
+ */
+size_t lval_reclaim(lval *v);
+
 /**
  * Initialises a new instance of lenv;
  */
@@ -173,16 +538,67 @@ lenv *lenv_new(void);
  */
 void lenv_set_parent(lenv *env, lenv *parent);
 
+/**
+ * Returns an environment's parent, or null for the root environment.
+ */
+lenv *lenv_parent(lenv *env);
+
+/**
+ * Returns true if every symbol bound in e is also bound in from or in one of
+ * the parents between from and e, so a lookup starting at from can never find
+ * anything in e. e must be one of from's parents.
+ */
+bool lenv_is_shadowed(lenv *e, lenv *from);
+
 /**
  * Frees up an lenv.
  */
 void lenv_del(lenv *e);
 
+/**
+ * Takes a new reference to an lenv. Each reference is released with lenv_del.
+ */
+lenv *lenv_ref(lenv *e);
+
+/**
+ * Releases a reference to an lenv during a garbage collection. When no
+ * references remain, release is called for each value and the lenv is freed
+ * without deleting the values. Returns the number of bytes freed.
+ */
+size_t lenv_release(lenv *e, void (*release)(lval *v));
+
+/**
+ * Calls fn for each value bound in the environment, ignoring its parents.
+ */
+void lenv_for_each(lenv *e, void (*fn)(lval *v));
+
+/**
+ * Frees an lenv without releasing its values. Returns the number of bytes freed.
+ */
+size_t lenv_free(lenv *e);
+
 /**
  * Looks up a symbol from the environment.
  */
 lval *lenv_get(lenv *e, lval *k);
 
+/**
+ * An inline cache for a lookup of a global symbol. It holds while nothing is
+ * bound in the global environment, which bumps a version number on each change.
+ */
+typedef struct
+{
+    lenv *root;         // the global environment the value was found in
+    unsigned long version;
+    lval *value;        // borrowed from the global environment
+} lenv_cache;
+
+/**
+ * Looks up a symbol from the environment, using and refilling cache when the
+ * symbol can only be bound in the global environment.
+ */
+lval *lenv_get_cached(lenv *e, lval *k, lenv_cache *cache);
+
 /**
  * Adds a built-in symbol to the environment. Replaces it if already present.
  */
@@ -203,21 +619,60 @@ bool lenv_def(lenv *e, lval *k, lval *v);
  */
 void lenv_add_builtin_sums(lenv *e);
 
+/**
+ * Returns the operation performed by the arithmetic built-in named by id, or
+ * -1 if id does not name one.
+ */
+int arith_op(unsigned id);
+
+/**
+ * Returns the symbol naming an arithmetic operation.
+ */
+const char *arith_name(unsigned op);
+
+/**
+ * Returns the type an arithmetic operation gives for two arguments of the
+ * given type, or 0 if it could also give an error.
+ */
+unsigned arith_type(unsigned op, unsigned type);
+
+/**
+ * Performs an arithmetic operation on two arguments already known to be longs,
+ * or doubles if decimal is set, without the checks the built-in makes.
+ * Consumes x and y.
+ */
+lval *arith_apply(unsigned op, bool decimal, lval *x, lval *y);
+
 /**
  * Add built-in core functions to the environment.
  */
 void lenv_add_builtin_core(lenv *e);
 
+/**
+ * Add built-in list functions to the environment.
+ */
+void lenv_add_builtin_list(lenv *e);
+
 /**
  * Add built-in operating system functions to the environment.
  */
 void lenv_add_builtin_os(lenv *e);
 
 /**
- * Performs a deep copy of the environment.
+ * Add built-in memoisation functions to the environment.
+ */
+void lenv_add_builtin_memo(lenv *e);
+
+/**
+ * Copies the environment. The values are shared with the original.
  */
 lenv *lenv_copy(lenv *e);
 
+/**
+ * Copies the environment with all of its values promoted out of the arena.
+ */
+lenv *lenv_promote(lenv *e);
+
 /**
  * Converts an lenv to an lval.
  */
@@ -232,3 +687,146 @@ char *ltype_name(unsigned type);
  * Evaluates all of the expressions in a parsed result.
  */
 lval *multi_eval(lenv *env, lval *expr);
+
+/**
+ * Returns the source of the standard library linked in to the interpreter.
+ */
+const char *stdlib_source(void);
+
+/**
+ * A call in tail position. Rather than being made where it appears it is
+ * handed back to the evaluator, which makes it without growing the C stack.
+ */
+typedef struct
+{
+    lval *func;
+    lval *args;
+} ltail;
+
+/**
+ * Calls a built-in or user function with a list of arguments. Consumes func and args.
+ */
+lval *lval_call(lenv *env, lval *func, lval *args);
+
+/**
+ * Evaluates a q-expression as an s-expression with the current engine. Calls
+ * in tail position run in constant stack space. Consumes body.
+ */
+lval *lval_eval_body(lenv *env, lval *body);
+
+/**
+ * Evaluates the items of an s-expression with the tree-walking evaluator then
+ * calls the first with the rest. If tail is set a call is not made here but
+ * handed back through tail, and null is returned. Consumes expr.
+ */
+lval *lval_eval_sexpr(lenv *env, lval *expr, ltail *tail);
+
+/**
+ * Takes an object from a pool, growing the pool if it is empty.
+ */
+void *pool_alloc(pool *p);
+
+/**
+ * Returns an object to its pool.
+ */
+void pool_free(pool *p, void *ptr);
+
+/**
+ * Calls visit for every object in the pool's slabs, whether in use or not.
+ */
+void pool_walk(pool *p, void (*visit)(void *obj));
+
+/**
+ * Returns true if an arena scope is open and new lvals are allocated from it.
+ */
+bool arena_active(void);
+
+/**
+ * Allocates a block of memory from the arena.
+ */
+void *arena_alloc(size_t size);
+
+/**
+ * Returns a block of memory to the arena for reuse.
+ */
+void arena_free(void *ptr, size_t size);
+
+/**
+ * Returns the ID of a symbol name, interning the name if it has not been seen before.
+ */
+unsigned symbol_intern(const char *name);
+
+/**
+ * Returns the name of an interned symbol.
+ */
+const char *symbol_name(unsigned id);
+
+/**
+ * Returns a reference to the shared lval for an interned symbol.
+ */
+lval *symbol_lval(unsigned id);
+
+/**
+ * Records that a symbol names a built-in. Returns the shared lval for the
+ * built-in, which is not a new reference.
+ */
+lval *symbol_bind_builtin(unsigned id, lbuiltin func);
+
+/**
+ * Returns the shared lval for the built-in a symbol names, which is not a new
+ * reference, or null if the symbol does not name a built-in.
+ */
+lval *symbol_builtin(unsigned id);
+
+/**
+ * Garbage collector counters.
+ */
+typedef struct
+{
+    size_t collections;        // collections run so far
+    size_t pause_us;           // total time spent collecting
+    size_t max_pause_us;       // longest single collection
+    size_t objects_reclaimed;  // lvals freed by the collector
+    size_t bytes_reclaimed;    // lvals and the memory they owned
+} gc_statistics;
+
+extern gc_statistics gc_stats;
+
+/**
+ * Pushes a value that the collector must treat as live on to the root stack.
+ */
+void gc_push_root(lval *v);
+
+/**
+ * Pops the most recently pushed root.
+ */
+void gc_pop_root(void);
+
+/**
+ * Asks for a collection at the next safe point regardless of heap growth.
+ */
+void gc_request(void);
+
+/**
+ * Collects garbage if one is due. Must only be called between top-level
+ * evaluations, when every live value is reachable from env, the root stack or
+ * the symbol table. The evaluator's working state is not a root, so there is
+ * no safe point inside an evaluation.
+ */
+void gc_safe_point(lenv *env);
+
+/**
+ * Records that a non-global environment has bound a symbol.
+ */
+void symbol_bind_local(unsigned id);
+
+/**
+ * Records that a non-global environment binding a symbol has been freed.
+ */
+void symbol_unbind_local(unsigned id);
+
+/**
+ * Returns true if any non-global environment binds the symbol. If none does,
+ * the symbol can only be bound in the global environment.
+ */
+bool symbol_is_local(unsigned id);
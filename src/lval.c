@@ -3,29 +3,82 @@
  */
 
 #include <stdarg.h>
+#include <limits.h>
 #include "lilith_int.h"
+#include "bytecode.h"
 
 bool is_escapable(char x);
 char *char_escape(char x);
 
-static lval *lval_init(unsigned type)
+#define LVAL_EXPR_MIN_CAPACITY 4
+
+pool lval_pool = POOL_INIT("lval", lval);
+
+/**
+ * Allocates an lval from the arena or the lval pool.
+ */
+static lval *lval_alloc(unsigned type, bool in_arena)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = in_arena ? arena_alloc(sizeof(lval)) : pool_alloc(&lval_pool);
     v->type = type;
+    v->refs = 1;
+    v->flags = in_arena ? LVAL_FLAG_ARENA : 0;
+    return v;
+}
+
+static lval *lval_init(unsigned type)
+{
+    return lval_alloc(type, arena_active());
+}
+
+/**
+ * List item arrays are allocated from the same place as the list that owns them.
+ */
+static lval **items_alloc(const lval *owner, size_t capacity)
+{
+    size_t size = capacity * sizeof(lval*);
+    return owner->flags & LVAL_FLAG_ARENA ? arena_alloc(size) : malloc(size);
+}
+
+static void items_free(const lval *owner)
+{
+    if (!owner->value.list.capacity)
+    {
+        return;
+    }
+
+    lval **base = owner->value.list.items - owner->value.list.start;
+    if (owner->flags & LVAL_FLAG_ARENA)
+    {
+        arena_free(base, owner->value.list.capacity * sizeof(lval*));
+    }
+    else
+    {
+        free(base);
+    }
+}
+
+static lval *lval_expr_init(lval *v)
+{
+    v->value.list.items = 0;
+    v->value.list.count = 0;
+    v->value.list.start = 0;
+    v->value.list.capacity = 0;
+    v->value.list.code = 0;
     return v;
 }
 
 static void lval_expr_print(const lval *v, char open, char close, unsigned options)
 {
     putchar(open);
-    for (pair *ptr = v->value.list.head; ptr; ptr = ptr->next)
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
     {
-        if (ptr != v->value.list.head)
+        if (i)
         {
             putchar(' ');
         }
 
-        lval_print(ptr->data, options);
+        lval_print(LVAL_EXPR_ITEM(v, i), options);
     }
 
     putchar(close);
@@ -34,16 +87,15 @@ static void lval_expr_print(const lval *v, char open, char close, unsigned optio
 static void lval_print_string(const lval *str_val)
 {
     putchar('"');
-    size_t len = strlen(str_val->value.str_val);
-    for (size_t i = 0; i < len; i++)
+    for (size_t i = 0; i < str_val->value.str.len; i++)
     {
-        if (is_escapable(str_val->value.str_val[i]))
+        if (is_escapable(str_val->value.str.ptr[i]))
         {
-            printf("%s", char_escape(str_val->value.str_val[i]));
+            printf("%s", char_escape(str_val->value.str.ptr[i]));
         }
         else
         {
-            putchar(str_val->value.str_val[i]);
+            putchar(str_val->value.str.ptr[i]);
         }
     }
 
@@ -52,45 +104,58 @@ static void lval_print_string(const lval *str_val)
 
 lval *lval_expr_item(lval *val, unsigned i)
 {
-    unsigned expr_item = 0;
-    for (pair *ptr = val->value.list.head; ptr; ptr = ptr->next)
+    return i < LVAL_EXPR_CNT(val) ? LVAL_EXPR_ITEM(val, i) : 0;
+}
+
+void lval_expr_reserve(lval *v, size_t count)
+{
+    size_t start = v->value.list.start;
+    size_t capacity = v->value.list.capacity;
+    if (start + count <= capacity)
     {
-        if (expr_item++ == i)
-        {
-            return ptr->data;
-        }
+        return;
     }
 
-    return 0;
+    // Reclaim the space left at the front by lval_pop if at least half the array is free
+    lval **base = v->value.list.items - start;
+    if (count <= capacity && start >= capacity / 2)
+    {
+        memmove(base, v->value.list.items, LVAL_EXPR_CNT(v) * sizeof(lval*));
+        v->value.list.items = base;
+        v->value.list.start = 0;
+        return;
+    }
+
+    size_t new_capacity = capacity ? capacity : LVAL_EXPR_MIN_CAPACITY;
+    while (new_capacity < count)
+    {
+        new_capacity *= 2;
+    }
+
+    lval **items = items_alloc(v, new_capacity);
+    if (LVAL_EXPR_CNT(v))
+    {
+        memcpy(items, v->value.list.items, LVAL_EXPR_CNT(v) * sizeof(lval*));
+    }
+
+    items_free(v);
+    v->value.list.items = items;
+    v->value.list.start = 0;
+    v->value.list.capacity = new_capacity;
 }
 
 lval *lval_pop(lval *val)
 {
-    pair *rv = val->value.list.head;
-    val->value.list.head = rv->next;
-    rv->next = 0;
+    lval *rv = LVAL_EXPR_FIRST(val);
+    val->value.list.items++;
+    val->value.list.start++;
     LVAL_EXPR_CNT(val)--;
-
-    lval *r = rv->data;
-    free(rv);
-    return r;
+    return rv;
 }
 
 lval *lval_take(lval *val, unsigned i)
 {
-    unsigned cnt = 0;
-    while (cnt++ < i)
-    {
-        lval_del(lval_pop(val));
-    }
-
-    lval *rv = lval_pop(val);
-
-    while (LVAL_EXPR_CNT(val))
-    {
-        lval_del(lval_pop(val));
-    }
-
+    lval *rv = lval_ref(LVAL_EXPR_ITEM(val, i));
     lval_del(val);
     return rv;
 }
@@ -119,6 +184,11 @@ lval *lval_error(const char *fmt, ...)
 
 lval *lval_long(long num)
 {
+    if (num >= LONG_MIN / 2 && num <= LONG_MAX / 2)
+    {
+        return (lval*)(((uintptr_t)num << 1) | LVAL_TAG_LONG);
+    }
+
     lval *rv = lval_init(LVAL_LONG);
     rv->value.num_l = num;
     return rv;
@@ -126,6 +196,21 @@ lval *lval_long(long num)
 
 lval *lval_double(double num)
 {
+    uintptr_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+
+    // Immediate when the top three exponent bits are 011 or 100, i.e. roughly 1e-77 to 1e77
+    unsigned exp_bits = (bits >> 60) & 0x7;
+    if (bits != 0x3000000000000000 && (exp_bits == 3 || exp_bits == 4))
+    {
+        return (lval*)((((bits << 3) | (bits >> 61)) & ~(uintptr_t)0x1) | LVAL_TAG_DOUBLE);
+    }
+
+    if (bits == 0)
+    {
+        return (lval*)LVAL_DOUBLE_ZERO;
+    }
+
     lval *rv = lval_init(LVAL_DOUBLE);
     rv->value.num_d = num;
     return rv;
@@ -133,41 +218,91 @@ lval *lval_double(double num)
 
 lval *lval_bool(bool bval)
 {
-    lval *rv = lval_init(LVAL_BOOL);
-    rv->value.bval = bval;
-    return rv;
+    return bval ? LVAL_TRUE : LVAL_FALSE;
 }
 
 lval *lval_string(const char *string)
+{
+    return lval_string_len(string, strlen(string));
+}
+
+/**
+ * Fills in an lval's string fields with a copy of len characters.
+ */
+static void string_set(lval *v, const char *string, size_t len)
+{
+    char *buf;
+    if (len <= LVAL_STRING_INLINE)
+    {
+        buf = v->value.str.buf;
+    }
+    else
+    {
+        buf = malloc(len);
+        v->value.str.owner = 0;
+    }
+
+    memcpy(buf, string, len);
+    v->value.str.ptr = buf;
+    v->value.str.len = len;
+}
+
+lval *lval_string_len(const char *string, size_t len)
 {
     lval *rv = lval_init(LVAL_STRING);
-    rv->value.str_val = malloc(strlen(string) + 1);
-    strcpy(rv->value.str_val, string);
+    string_set(rv, string, len);
+    return rv;
+}
+
+lval *lval_substring(lval *v, size_t start, size_t len)
+{
+    // Short strings are cheaper to copy than to share
+    if (len <= LVAL_STRING_INLINE)
+    {
+        return lval_string_len(v->value.str.ptr + start, len);
+    }
+
+    // Slices always refer to the string that owns the characters, never to another slice
+    lval *owner = lval_string_owner(v) ? lval_string_owner(v) : v;
+
+    lval *rv = lval_init(LVAL_STRING);
+    rv->value.str.ptr = v->value.str.ptr + start;
+    rv->value.str.len = len;
+    rv->value.str.owner = lval_ref(owner);
+    return rv;
+}
+
+char *lval_string_dup(const lval *v)
+{
+    char *rv = malloc(v->value.str.len + 1);
+    memcpy(rv, v->value.str.ptr, v->value.str.len);
+    rv[v->value.str.len] = 0;
     return rv;
 }
 
 lval *lval_symbol(const char *symbol)
+{
+    return symbol_lval(symbol_intern(symbol));
+}
+
+lval *lval_formal(const char *symbol, unsigned slot)
 {
     lval *rv = lval_init(LVAL_SYMBOL);
-    rv->value.str_val = malloc(strlen(symbol) + 1);
-    strcpy(rv->value.str_val, symbol);
+    unsigned id = symbol_intern(symbol);
+    rv->value.sym.name = symbol_name(id);
+    rv->value.sym.id = id;
+    rv->value.sym.slot = slot;
     return rv;
 }
 
 lval *lval_sexpression()
 {
-    lval *rv = lval_init(LVAL_SEXPRESSION);
-    rv->value.list.count = 0;
-    rv->value.list.head = 0;
-    return rv;
+    return lval_expr_init(lval_init(LVAL_SEXPRESSION));
 }
 
 lval *lval_qexpression()
 {
-    lval *rv = lval_init(LVAL_QEXPRESSION);
-    rv->value.list.count = 0;
-    rv->value.list.head = 0;
-    return rv;
+    return lval_expr_init(lval_init(LVAL_QEXPRESSION));
 }
 
 lval *lval_fun(lbuiltin function)
@@ -177,6 +312,97 @@ lval *lval_fun(lbuiltin function)
     return rv;
 }
 
+/**
+ * Returns the frame slot a formal is bound to when the function is called, or
+ * LVAL_SLOT_NONE if id is not one of the formals. Formals are bound in order
+ * and '&' itself is never bound.
+ */
+static unsigned formal_slot(const lval *formals, unsigned id)
+{
+    unsigned slot = 0;
+    for (size_t i = 0; i < LVAL_EXPR_CNT(formals); i++)
+    {
+        unsigned formal = LVAL_EXPR_ITEM(formals, i)->value.sym.id;
+        if (formal == id)
+        {
+            return slot;
+        }
+
+        if (formal != SYMBOL_ID_AMPERSAND)
+        {
+            slot++;
+        }
+    }
+
+    return LVAL_SLOT_NONE;
+}
+
+/*
+ * The resolution pass. Replaces each reference to a formal in v with a symbol
+ * that records the formal's frame slot, so lenv_get can load it directly
+ * rather than search for it. Under dynamic scope a body may be evaluated in
+ * other frames too, so lenv_get checks the slot holds the symbol before using
+ * it. Lists are copied only if something in them changes.
+ */
+lval *lval_resolve(lval *v, const lval *formals)
+{
+    switch (lval_type(v))
+    {
+    case LVAL_SYMBOL:
+    {
+        unsigned slot = formal_slot(formals, v->value.sym.id);
+        if (slot == LVAL_SLOT_NONE || slot == v->value.sym.slot)
+        {
+            return v;
+        }
+
+        lval *rv = lval_init(LVAL_SYMBOL);
+        rv->value.sym = v->value.sym;
+        rv->value.sym.slot = slot;
+        lval_del(v);
+        return rv;
+    }
+    case LVAL_SEXPRESSION:
+    case LVAL_QEXPRESSION:
+        for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+        {
+            lval *item = lval_resolve(lval_ref(LVAL_EXPR_ITEM(v, i)), formals);
+            if (item == LVAL_EXPR_ITEM(v, i))
+            {
+                lval_del(item);
+                continue;
+            }
+
+            v = lval_unshare(v);
+            lval_del(LVAL_EXPR_ITEM(v, i));
+            LVAL_EXPR_ITEM(v, i) = item;
+        }
+        return v;
+    default:
+        return v;
+    }
+}
+
+/**
+ * Works out the parameter descriptor for a list of formals.
+ */
+static lparams lval_params(const lval *formals)
+{
+    lparams rv = { LVAL_EXPR_CNT(formals), false, false };
+    for (size_t i = 0; i < LVAL_EXPR_CNT(formals); i++)
+    {
+        if (LVAL_EXPR_ITEM(formals, i)->value.sym.id == SYMBOL_ID_AMPERSAND)
+        {
+            rv.arity = i;
+            rv.variadic = true;
+            rv.malformed = LVAL_EXPR_CNT(formals) != i + 2;
+            break;
+        }
+    }
+
+    return rv;
+}
+
 lval *lval_lambda(lval *formals, lval* body)
 {
     lval *rv = lval_init(LVAL_USER_FUN);
@@ -186,37 +412,64 @@ lval *lval_lambda(lval *formals, lval* body)
 
     // Set formals and body
     rv->value.user_fun.formals = formals;
-    rv->value.user_fun.body = body;
+    rv->value.user_fun.body = lval_resolve(body, formals);
+    rv->value.user_fun.params = lval_params(formals);
     return rv;
 }
 
-lval *lval_add(lval *v, lval *x)
+lval *lval_partial(const lval *func, lenv *env, size_t bound)
 {
-    v->value.list.count++;
-    pair **ptr = &v->value.list.head;
-    for (; *ptr; ptr = &(*ptr)->next)
+    lval *formals = func->value.user_fun.formals;
+    lval *rest = lval_qexpression();
+    lval_expr_reserve(rest, LVAL_EXPR_CNT(formals) - bound);
+    for (size_t i = bound; i < LVAL_EXPR_CNT(formals); i++)
     {
+        lval_add(rest, lval_ref(LVAL_EXPR_ITEM(formals, i)));
     }
 
-    pair *n = malloc(sizeof(pair));
-    n->next = 0;
-    n->data = x;
-    *ptr = n;
+    // The body's slot hints still hold as the bound formals keep the first slots of env
+    lval *rv = lval_init(LVAL_USER_FUN);
+    rv->value.user_fun.env = env;
+    rv->value.user_fun.formals = rest;
+    rv->value.user_fun.body = lval_ref(func->value.user_fun.body);
+    rv->value.user_fun.params = func->value.user_fun.params;
+    rv->value.user_fun.params.arity -= bound;
+    return rv;
+}
+
+lval *lval_seq(unsigned source)
+{
+    lval *rv = lval_alloc(LVAL_SEQ, false);
+    rv->value.seq.source = source;
+    return rv;
+}
+
+lval *lval_memo(lmemo *memo)
+{
+    lval *rv = lval_alloc(LVAL_MEMO, false);
+    rv->value.memo = memo;
+    return rv;
+}
+
+lval *lval_add(lval *v, lval *x)
+{
+    lval_expr_reserve(v, LVAL_EXPR_CNT(v) + 1);
+    LVAL_EXPR_ITEM(v, LVAL_EXPR_CNT(v)++) = x;
     return v;
 }
 
 void lval_print(const lval *v, unsigned options)
 {
-    switch (v->type)
+    switch (lval_type(v))
     {
     case LVAL_LONG:
-        printf("%li", v->value.num_l);
+        printf("%li", lval_as_long(v));
         break;
     case LVAL_DOUBLE:
-        printf("%f", v->value.num_d);
+        printf("%f", lval_as_double(v));
         break;
     case LVAL_BOOL:
-        printf("%s", v->value.bval ? "#t" : "#f");
+        printf("%s", lval_as_bool(v) ? "#t" : "#f");
         break;
     case LVAL_STRING:
         if (!options)
@@ -225,11 +478,11 @@ void lval_print(const lval *v, unsigned options)
         }
         else
         {
-            printf("%s", v->value.str_val);
+            fwrite(v->value.str.ptr, 1, v->value.str.len, stdout);
         }
         break;
     case LVAL_SYMBOL:
-        printf("%s", v->value.str_val);
+        printf("%s", v->value.sym.name);
         break;
     case LVAL_ERROR:
         printf("Error: %s", v->value.str_val);
@@ -250,39 +503,52 @@ void lval_print(const lval *v, unsigned options)
         lval_print(v->value.user_fun.body, options);
         putchar(')');
         break;
+    case LVAL_SEQ:
+        printf("<sequence>");
+        break;
+    case LVAL_MEMO:
+        printf("<memo>");
+        break;
     }
 }
 
 bool lval_is_equal(lval *x, lval *y)
 {
-    if (x->type != y->type)
+    unsigned type = lval_type(x);
+    if (type != lval_type(y))
     {
-        if (x->type == LVAL_LONG && y->type == LVAL_DOUBLE)
+        if (type == LVAL_LONG && lval_type(y) == LVAL_DOUBLE)
         {
-            return x->value.num_l == y->value.num_d;
+            return lval_as_long(x) == lval_as_double(y);
         }
-        else if (x->type == LVAL_DOUBLE && y->type == LVAL_LONG)
+        else if (type == LVAL_DOUBLE && lval_type(y) == LVAL_LONG)
         {
-            return x->value.num_d == y->value.num_l;
+            return lval_as_double(x) == lval_as_long(y);
         }
 
         return 0;
     }
 
-    switch (x->type)
+    switch (type)
     {
     case LVAL_LONG:
-        return x->value.num_l == y->value.num_l;
+        return lval_as_long(x) == lval_as_long(y);
     case LVAL_DOUBLE:
-        return x->value.num_d == y->value.num_d;
+        return lval_as_double(x) == lval_as_double(y);
     case LVAL_BOOL:
-        return x->value.bval == y->value.bval;
+        return x == y;
     case LVAL_STRING:
+        return x->value.str.len == y->value.str.len &&
+            memcmp(x->value.str.ptr, y->value.str.ptr, x->value.str.len) == 0;
     case LVAL_ERROR:
-    case LVAL_SYMBOL:
         return (strcmp(x->value.str_val, y->value.str_val) == 0);
+    case LVAL_SYMBOL:
+        return x->value.sym.id == y->value.sym.id;
     case LVAL_BUILTIN_FUN:
         return x->value.builtin == y->value.builtin;
+    case LVAL_SEQ:
+    case LVAL_MEMO:
+        return x == y;
     case LVAL_USER_FUN:
         return lval_is_equal(x->value.user_fun.formals, y->value.user_fun.formals) &&
             lval_is_equal(x->value.user_fun.body, y->value.user_fun.body);
@@ -293,11 +559,9 @@ bool lval_is_equal(lval *x, lval *y)
             return false;
         }
 
-        for (pair *ptrx = x->value.list.head, *ptry = x->value.list.head;
-             ptrx && ptry;
-             ptrx = ptrx->next, ptry = ptry->next)
+        for (size_t i = 0; i < LVAL_EXPR_CNT(x); i++)
         {
-            if (!lval_is_equal(ptrx->data, ptry->data))
+            if (!lval_is_equal(LVAL_EXPR_ITEM(x, i), LVAL_EXPR_ITEM(y, i)))
             {
                 return 0;
             }
@@ -309,45 +573,310 @@ bool lval_is_equal(lval *x, lval *y)
     return false; 
 }
 
+/**
+ * Mixes x in to a hash so that every bit of the result depends on every bit
+ * of both, as the hash tables keyed on it index by the low bits.
+ */
+static size_t hash_mix(size_t h, size_t x)
+{
+    h ^= x;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCD;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53;
+    return h ^ (h >> 33);
+}
+
+/**
+ * FNV-1a hash of len bytes mixed in to a hash.
+ */
+static size_t hash_bytes(size_t h, const char *s, size_t len)
+{
+    size_t rv = 0xCBF29CE484222325;
+    for (size_t i = 0; i < len; i++)
+    {
+        rv = (rv ^ (unsigned char)s[i]) * 0x100000001B3;
+    }
+
+    return hash_mix(h, rv);
+}
+
+/**
+ * Returns the bits of a double, which lval_is_same compares.
+ */
+static unsigned long double_bits(double d)
+{
+    unsigned long rv;
+    memcpy(&rv, &d, sizeof(rv));
+    return rv;
+}
+
+bool lval_is_same(lval *x, lval *y)
+{
+    unsigned type = lval_type(x);
+    if (type != lval_type(y))
+    {
+        return false;
+    }
+
+    switch (type)
+    {
+    case LVAL_DOUBLE:
+        return double_bits(lval_as_double(x)) == double_bits(lval_as_double(y));
+    case LVAL_USER_FUN:
+        return lval_is_same(x->value.user_fun.formals, y->value.user_fun.formals) &&
+            lval_is_same(x->value.user_fun.body, y->value.user_fun.body);
+    case LVAL_QEXPRESSION:
+    case LVAL_SEXPRESSION:
+        if (LVAL_EXPR_CNT(x) != LVAL_EXPR_CNT(y))
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < LVAL_EXPR_CNT(x); i++)
+        {
+            if (!lval_is_same(LVAL_EXPR_ITEM(x, i), LVAL_EXPR_ITEM(y, i)))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    default:
+        return lval_is_equal(x, y);
+    }
+}
+
+/**
+ * Hashes a number by its value as a double, which is how longs and doubles are
+ * compared with each other, so that equal numbers of either type hash the same.
+ */
+static size_t hash_number(double d)
+{
+    // -0.0 equals 0.0
+    return hash_mix(LVAL_LONG, double_bits(d == 0 ? 0 : d));
+}
+
+/**
+ * Hashes an lval's structure so that values lval_is_same finds the same hash
+ * alike, or if same is not set those lval_is_equal finds equal.
+ */
+static size_t hash_value(lval *v, bool same)
+{
+    unsigned type = lval_type(v);
+    size_t rv = hash_mix(0, type);
+    switch (type)
+    {
+    case LVAL_LONG:
+        return same ? hash_mix(rv, lval_as_long(v)) : hash_number(lval_as_long(v));
+    case LVAL_DOUBLE:
+        return same ? hash_mix(rv, double_bits(lval_as_double(v))) : hash_number(lval_as_double(v));
+    case LVAL_BOOL:
+        return hash_mix(rv, lval_as_bool(v));
+    case LVAL_STRING:
+        return hash_bytes(rv, v->value.str.ptr, v->value.str.len);
+    case LVAL_ERROR:
+        return hash_bytes(rv, v->value.str_val, strlen(v->value.str_val));
+    case LVAL_SYMBOL:
+        return hash_mix(rv, v->value.sym.id);
+    case LVAL_BUILTIN_FUN:
+        return hash_mix(rv, (size_t)v->value.builtin);
+    case LVAL_USER_FUN:
+        rv = hash_mix(rv, hash_value(v->value.user_fun.formals, same));
+        return hash_mix(rv, hash_value(v->value.user_fun.body, same));
+    case LVAL_QEXPRESSION:
+    case LVAL_SEXPRESSION:
+        for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+        {
+            rv = hash_mix(rv, hash_value(LVAL_EXPR_ITEM(v, i), same));
+        }
+        return rv;
+    default:
+        return hash_mix(rv, (size_t)v);
+    }
+}
+
+size_t lval_hash(lval *v)
+{
+    return hash_value(v, false);
+}
+
+size_t lval_hash_same(lval *v)
+{
+    return hash_value(v, true);
+}
+
+/**
+ * Releases what a sequence cell holds and returns the rest of the sequence,
+ * which the caller releases.
+ */
+static lval *seq_release(lval *v)
+{
+    switch (v->value.seq.source)
+    {
+    case LSEQ_ITEM:
+        lval_del(v->value.seq.item.first);
+        return v->value.seq.item.rest;
+    case LSEQ_CALL:
+        lval_del(v->value.seq.call.fn);
+        break;
+    case LSEQ_MAP:
+    case LSEQ_FILTER:
+        lval_del(v->value.seq.call.fn);
+        return v->value.seq.call.from;
+    case LSEQ_TAKE:
+        return v->value.seq.take.from;
+    case LSEQ_JOIN:
+        lval_del(v->value.seq.join.from);
+        return v->value.seq.join.next;
+    case LSEQ_LIST:
+        lval_del(v->value.seq.list.list);
+        break;
+    case LSEQ_LINES:
+        fclose(v->value.seq.file);
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * Frees a sequence cell and the cells after it that nothing else refers to,
+ * looping rather than recursing as a sequence can be long. Cells are never
+ * taken from the arena.
+ */
+static void seq_free(lval *v)
+{
+    do
+    {
+        lval *rest = seq_release(v);
+        pool_free(&lval_pool, v);
+        v = rest;
+    }
+    while (v && !--v->refs);
+}
+
 void lval_del(lval *v)
 {
-    pair *tmp, *ptr;
+    if (lval_is_immediate(v) || --v->refs)
+    {
+        return;
+    }
 
     switch (v->type)
     {
     case LVAL_LONG:
     case LVAL_DOUBLE:
+    case LVAL_SYMBOL:
     case LVAL_BUILTIN_FUN:
-    case LVAL_BOOL:
         break;
     case LVAL_STRING:
+        if (lval_string_owner(v))
+        {
+            lval_del(v->value.str.owner);
+        }
+        else if (!lval_string_is_inline(v))
+        {
+            free((char*)v->value.str.ptr);
+        }
+        break;
     case LVAL_ERROR:
-    case LVAL_SYMBOL:
         free(v->value.str_val);
         break;
     case LVAL_SEXPRESSION:
     case LVAL_QEXPRESSION:
-        ptr = v->value.list.head;
-        while (ptr)
+        for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
         {
-            tmp = ptr;
-            ptr = ptr->next;
-            lval_del(tmp->data);
-            free(tmp);
+            lval_del(LVAL_EXPR_ITEM(v, i));
         }
+
+        if (v->flags & LVAL_FLAG_COMPILED)
+        {
+            lcode_free(v, true);
+        }
+
+        items_free(v);
         break;
     case LVAL_USER_FUN:
         lenv_del(v->value.user_fun.env);
         lval_del(v->value.user_fun.formals);
         lval_del(v->value.user_fun.body);
         break;
+    case LVAL_SEQ:
+        seq_free(v);
+        return;
+    case LVAL_MEMO:
+        memo_free(v->value.memo, true);
+        break;
     }
 
-    free(v);
+    if (v->flags & LVAL_FLAG_ARENA)
+    {
+        arena_free(v, sizeof(lval));
+    }
+    else
+    {
+        pool_free(&lval_pool, v);
+    }
+}
+
+size_t lval_reclaim(lval *v)
+{
+    size_t rv = sizeof(lval);
+    switch (v->type)
+    {
+    case LVAL_STRING:
+        if (!lval_string_owner(v) && !lval_string_is_inline(v))
+        {
+            rv += v->value.str.len;
+            free((char*)v->value.str.ptr);
+        }
+        break;
+    case LVAL_ERROR:
+        rv += strlen(v->value.str_val) + 1;
+        free(v->value.str_val);
+        break;
+    case LVAL_SEXPRESSION:
+    case LVAL_QEXPRESSION:
+        rv += v->value.list.capacity * sizeof(lval*);
+        if (v->flags & LVAL_FLAG_COMPILED)
+        {
+            rv += lcode_free(v, false);
+        }
+
+        items_free(v);
+        break;
+    case LVAL_SEQ:
+        if (v->value.seq.source == LSEQ_LINES)
+        {
+            fclose(v->value.seq.file);
+        }
+        break;
+    case LVAL_MEMO:
+        rv += memo_free(v->value.memo, false);
+        break;
+    }
+
+    v->refs = 0;
+    pool_free(&lval_pool, v);
+    return rv;
 }
 
 lval *lval_copy(lval *v)
 {
+    if (lval_is_immediate(v))
+    {
+        return v;
+    }
+
+    // Symbols are interned, strings are never modified in place, sequences
+    // only change by being read, which the copy would have to share, and a
+    // memoised function's copies share its results
+    if (v->type == LVAL_SYMBOL || v->type == LVAL_STRING || v->type == LVAL_SEQ || v->type == LVAL_MEMO)
+    {
+        return lval_ref(v);
+    }
+
     lval *rv = lval_init(v->type);
 
     switch (v->type)
@@ -358,31 +887,114 @@ lval *lval_copy(lval *v)
     case LVAL_DOUBLE:
         rv->value.num_d = v->value.num_d;
         break;
-    case LVAL_BOOL:
-        rv->value.bval = v->value.bval;
+    case LVAL_ERROR:
+        rv->value.str_val = malloc(strlen(v->value.str_val) + 1);
+        strcpy(rv->value.str_val, v->value.str_val);
+        break;
+    case LVAL_BUILTIN_FUN:
+        rv->value.builtin = v->value.builtin;
+        break;
+    case LVAL_QEXPRESSION:
+    case LVAL_SEXPRESSION:
+        lval_expr_reserve(lval_expr_init(rv), LVAL_EXPR_CNT(v));
+        for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+        {
+            lval_add(rv, lval_ref(LVAL_EXPR_ITEM(v, i)));
+        }
+        break;
+    case LVAL_USER_FUN:
+        rv->value.user_fun.env = lenv_ref(v->value.user_fun.env);
+        rv->value.user_fun.formals = lval_ref(v->value.user_fun.formals);
+        rv->value.user_fun.body = lval_ref(v->value.user_fun.body);
+        rv->value.user_fun.params = v->value.user_fun.params;
+        break;
+    }
+
+    return rv;
+}
+
+lval *lval_ref(lval *v)
+{
+    if (!lval_is_immediate(v))
+    {
+        v->refs++;
+    }
+
+    return v;
+}
+
+lval *lval_unshare(lval *v)
+{
+    // Immediate values are never modified in place
+    if (lval_is_immediate(v))
+    {
+        return v;
+    }
+
+    // Heap values must not gain references to arena values so are copied while a
+    // scope is open, and compiled lists keep their items for as long as they have code
+    if (v->refs == 1 && !(v->flags & LVAL_FLAG_COMPILED) && (v->flags & LVAL_FLAG_ARENA || !arena_active()))
+    {
+        return v;
+    }
+
+    lval *rv = lval_copy(v);
+    lval_del(v);
+    return rv;
+}
+
+lval *lval_promote(lval *v)
+{
+    // Heap values never reference arena values so can be shared as they are
+    if (lval_is_immediate(v) || !(v->flags & LVAL_FLAG_ARENA))
+    {
+        return lval_ref(v);
+    }
+
+    lval *rv = lval_alloc(v->type, false);
+    switch (v->type)
+    {
+    case LVAL_LONG:
+        rv->value.num_l = v->value.num_l;
+        break;
+    case LVAL_DOUBLE:
+        rv->value.num_d = v->value.num_d;
         break;
     case LVAL_STRING:
+        // Slices of heap strings keep sharing, anything else takes its own copy of the characters
+        if (lval_string_owner(v) && !(lval_string_owner(v)->flags & LVAL_FLAG_ARENA))
+        {
+            rv->value.str = v->value.str;
+            lval_ref(rv->value.str.owner);
+        }
+        else
+        {
+            string_set(rv, v->value.str.ptr, v->value.str.len);
+        }
+        break;
     case LVAL_ERROR:
-    case LVAL_SYMBOL:
         rv->value.str_val = malloc(strlen(v->value.str_val) + 1);
         strcpy(rv->value.str_val, v->value.str_val);
         break;
+    case LVAL_SYMBOL:
+        rv->value.sym = v->value.sym;
+        break;
     case LVAL_BUILTIN_FUN:
         rv->value.builtin = v->value.builtin;
         break;
     case LVAL_QEXPRESSION:
     case LVAL_SEXPRESSION:
-        rv->value.list.count = 0;
-        rv->value.list.head = 0;
-        for (pair *ptr = v->value.list.head; ptr; ptr = ptr->next)
+        lval_expr_reserve(lval_expr_init(rv), LVAL_EXPR_CNT(v));
+        for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
         {
-            lval_add(rv, lval_copy(ptr->data));
+            lval_add(rv, lval_promote(LVAL_EXPR_ITEM(v, i)));
         }
         break;
     case LVAL_USER_FUN:
-        rv->value.user_fun.env = lenv_copy(v->value.user_fun.env);
-        rv->value.user_fun.formals = lval_copy(v->value.user_fun.formals);
-        rv->value.user_fun.body = lval_copy(v->value.user_fun.body);
+        rv->value.user_fun.env = lenv_promote(v->value.user_fun.env);
+        rv->value.user_fun.formals = lval_promote(v->value.user_fun.formals);
+        rv->value.user_fun.body = lval_promote(v->value.user_fun.body);
+        rv->value.user_fun.params = v->value.user_fun.params;
         break;
     }
 
@@ -412,6 +1024,10 @@ char *ltype_name(unsigned type)
             return "S-Expression";
         case LVAL_QEXPRESSION:
             return "Q-Expression";
+        case LVAL_SEQ:
+            return "Sequence";
+        case LVAL_MEMO:
+            return "Memo";
         default:
             return "Unknown";
     }
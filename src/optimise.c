@@ -0,0 +1,647 @@
+/*
+ * The optimiser. Rewrites a list before it is compiled -- calls to small
+ * functions are replaced by their bodies, calls to pure built-ins with constant
+ * arguments by their results, and an if with a constant condition by the
+ * branch it takes. Scope is dynamic so a rewrite only holds while the symbols
+ * it relied on keep their values. Each one is recorded with the optimised form
+ * and checked before the code runs. Nothing is rewritten once the code has
+ * made a call that could rebind one of them part way through, such as to def
+ * or to a user-defined function.
+ */
+
+#include "builtin_symbols.h"
+#include "bytecode.h"
+
+#define OPT_INLINE_SIZE 24   // most items a function body can have and still be inlined
+#define OPT_INLINE_DEPTH 4   // most calls deep inlining goes, which also stops at recursion
+
+/**
+ * Built-ins that only compute a value from their arguments, so can be called
+ * when the code is compiled.
+ */
+static const char *opt_pure[] =
+{
+    "+", "-", "*", "/", "%", "^", "max", "min", ">", "<", ">=", "<=",
+    BUILTIN_SYM_EQ, BUILTIN_SYM_NOT, BUILTIN_SYM_AND, BUILTIN_SYM_OR
+};
+
+/**
+ * Other built-ins with no side effects, which an inlined function can call.
+ * head, tail, join and len are not among them as reading a sequence can call
+ * any function.
+ */
+static const char *opt_safe[] =
+{
+    BUILTIN_SYM_IF, BUILTIN_SYM_LIST, BUILTIN_SYM_SUBSTRING, BUILTIN_SYM_CONS, BUILTIN_SYM_INIT,
+    BUILTIN_SYM_IS_STRING, BUILTIN_SYM_IS_LONG, BUILTIN_SYM_IS_DOUBLE, BUILTIN_SYM_IS_BOOL,
+    BUILTIN_SYM_IS_QEXPR, BUILTIN_SYM_IS_SEXPR
+};
+
+/**
+ * An optimisation in progress.
+ */
+typedef struct
+{
+    lenv *env;
+    lval *assumed;   // pairs of a symbol and the value the optimised form relies on it having
+    bool rebound;    // the code so far may have rebound a symbol, so checking the assumptions on entry is not enough
+} optimiser;
+
+/**
+ * How an inlined function uses one of its formals.
+ */
+typedef struct
+{
+    unsigned count;   // times the formal is evaluated
+    unsigned plain;   // times it is evaluated whatever the values of the arguments
+    size_t order;     // position of its first use among all the formal uses
+} opt_use;
+
+/**
+ * A function body being checked for inlining.
+ */
+typedef struct
+{
+    const lval *formals;
+    const lval *outer[OPT_INLINE_DEPTH];   // formals of the functions it is to be inlined in to
+    size_t outer_count;
+    size_t size;                           // items in the body
+    size_t uses;                           // formal uses seen so far
+    opt_use *usage;                        // one per formal, null if not needed
+} opt_body;
+
+static lval *opt_expr(optimiser *o, lval *v, unsigned depth);
+
+static bool opt_named(unsigned id, const char **names, size_t count)
+{
+    const char *name = symbol_name(id);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Returns the ID of a symbol that is not a formal and names a built-in, or 0.
+ */
+static unsigned opt_builtin(const lval *v)
+{
+    if (lval_type(v) != LVAL_SYMBOL || v->value.sym.slot != LVAL_SLOT_NONE || !symbol_builtin(v->value.sym.id))
+    {
+        return 0;
+    }
+
+    return v->value.sym.id;
+}
+
+static bool opt_is_constant(const lval *v)
+{
+    switch (lval_type(v))
+    {
+    case LVAL_LONG:
+    case LVAL_DOUBLE:
+    case LVAL_BOOL:
+    case LVAL_STRING:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Returns true if evaluating a list that has not been rewritten may call
+ * something that rebinds a symbol. Only the built-ins with no side effects,
+ * do and lambda are known not to. An if left as a call may evaluate branches
+ * the optimiser has not seen. A list of one item at most calls a built-in with
+ * no arguments, none of which rebinds anything.
+ */
+static bool opt_may_rebind(const lval *v)
+{
+    if (lval_type(v) != LVAL_SEXPRESSION && lval_type(v) != LVAL_QEXPRESSION)
+    {
+        return false;
+    }
+
+    if (LVAL_EXPR_CNT(v) < 2 || opt_is_constant(LVAL_EXPR_FIRST(v)))
+    {
+        return false;
+    }
+
+    unsigned id = opt_builtin(LVAL_EXPR_FIRST(v));
+    if (!id || id == SYMBOL_ID_IF)
+    {
+        return true;
+    }
+
+    return id != SYMBOL_ID_DO && id != SYMBOL_ID_LAMBDA && !opt_named(id, opt_pure, sizeof(opt_pure) / sizeof(char*)) &&
+        !opt_named(id, opt_safe, sizeof(opt_safe) / sizeof(char*));
+}
+
+/**
+ * Records that the optimised form relies on sym being bound to expected. Consumes expected.
+ */
+static void opt_assume(optimiser *o, const lval *sym, lval *expected)
+{
+    for (size_t i = 0; i < LVAL_EXPR_CNT(o->assumed); i += 2)
+    {
+        if (LVAL_EXPR_ITEM(o->assumed, i)->value.sym.id == sym->value.sym.id &&
+            LVAL_EXPR_ITEM(o->assumed, i + 1) == expected)
+        {
+            lval_del(expected);
+            return;
+        }
+    }
+
+    lval_add(o->assumed, symbol_lval(sym->value.sym.id));
+    lval_add(o->assumed, expected);
+}
+
+static void opt_assume_builtin(optimiser *o, const lval *sym)
+{
+    opt_assume(o, sym, lval_ref(symbol_builtin(sym->value.sym.id)));
+}
+
+/**
+ * Drops the assumptions made since there were count of them.
+ */
+static void opt_forget(optimiser *o, size_t count)
+{
+    while (LVAL_EXPR_CNT(o->assumed) > count)
+    {
+        lval_del(LVAL_EXPR_ITEM(o->assumed, --LVAL_EXPR_CNT(o->assumed)));
+    }
+}
+
+/**
+ * Returns a list of the given type holding the items of v. Consumes v.
+ */
+static lval *opt_retype(lval *v, unsigned type)
+{
+    if (lval_type(v) == type)
+    {
+        return v;
+    }
+
+    lval *rv = type == LVAL_SEXPRESSION ? lval_sexpression() : lval_qexpression();
+    if (lval_type(v) != LVAL_SEXPRESSION && lval_type(v) != LVAL_QEXPRESSION)
+    {
+        return lval_add(rv, v);
+    }
+
+    lval_expr_reserve(rv, LVAL_EXPR_CNT(v));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+    {
+        lval_add(rv, lval_ref(LVAL_EXPR_ITEM(v, i)));
+    }
+
+    lval_del(v);
+    return rv;
+}
+
+static lval *opt_item(optimiser *o, lval *v, unsigned depth)
+{
+    return lval_type(v) == LVAL_SEXPRESSION ? opt_expr(o, v, depth) : lval_ref(v);
+}
+
+/**
+ * Optimises the items of a list evaluated as an s-expression. Returns the list
+ * itself if none changes.
+ */
+static lval *opt_items(optimiser *o, lval *v, unsigned depth)
+{
+    lval *rv = 0;
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+    {
+        lval *item = opt_item(o, LVAL_EXPR_ITEM(v, i), depth);
+        if (!rv && item != LVAL_EXPR_ITEM(v, i))
+        {
+            rv = lval_type(v) == LVAL_SEXPRESSION ? lval_sexpression() : lval_qexpression();
+            lval_expr_reserve(rv, LVAL_EXPR_CNT(v));
+            for (size_t j = 0; j < i; j++)
+            {
+                lval_add(rv, lval_ref(LVAL_EXPR_ITEM(v, j)));
+            }
+        }
+
+        if (rv)
+        {
+            lval_add(rv, item);
+        }
+        else
+        {
+            lval_del(item);
+        }
+    }
+
+    return rv ? rv : lval_ref(v);
+}
+
+/**
+ * Optimises an if. A constant condition leaves just the branch it chooses.
+ */
+static lval *opt_if(optimiser *o, lval *v, unsigned depth)
+{
+    lval *test = opt_item(o, LVAL_EXPR_ITEM(v, 1), depth);
+    if (test == LVAL_TRUE || test == LVAL_FALSE)
+    {
+        opt_assume_builtin(o, LVAL_EXPR_FIRST(v));
+        return opt_retype(opt_expr(o, LVAL_EXPR_ITEM(v, test == LVAL_TRUE ? 2 : 3), depth), lval_type(v));
+    }
+
+    lval *then = opt_retype(opt_expr(o, LVAL_EXPR_ITEM(v, 2), depth), LVAL_QEXPRESSION);
+    lval *other = opt_retype(opt_expr(o, LVAL_EXPR_ITEM(v, 3), depth), LVAL_QEXPRESSION);
+    if (test == LVAL_EXPR_ITEM(v, 1) && then == LVAL_EXPR_ITEM(v, 2) && other == LVAL_EXPR_ITEM(v, 3))
+    {
+        lval_del(test);
+        lval_del(then);
+        lval_del(other);
+        return lval_ref(v);
+    }
+
+    // A local if would be called with the branches as data, so they must be as written
+    if (then != LVAL_EXPR_ITEM(v, 2) || other != LVAL_EXPR_ITEM(v, 3))
+    {
+        opt_assume_builtin(o, LVAL_EXPR_FIRST(v));
+    }
+
+    lval *rv = lval_type(v) == LVAL_SEXPRESSION ? lval_sexpression() : lval_qexpression();
+    lval_add(rv, lval_ref(LVAL_EXPR_FIRST(v)));
+    lval_add(rv, test);
+    lval_add(rv, then);
+    return lval_add(rv, other);
+}
+
+/**
+ * Calls a pure built-in whose arguments are all constants. Returns null if the
+ * call cannot be folded or gives an error, which is left for run time.
+ */
+static lval *opt_fold(optimiser *o, const lval *v)
+{
+    unsigned id = opt_builtin(LVAL_EXPR_FIRST(v));
+    if (!id || LVAL_EXPR_CNT(v) < 2 || symbol_is_local(id) || !opt_named(id, opt_pure, sizeof(opt_pure) / sizeof(char*)))
+    {
+        return 0;
+    }
+
+    lval *args = lval_sexpression();
+    for (size_t i = 1; i < LVAL_EXPR_CNT(v); i++)
+    {
+        if (!opt_is_constant(LVAL_EXPR_ITEM(v, i)))
+        {
+            lval_del(args);
+            return 0;
+        }
+
+        lval_add(args, lval_ref(LVAL_EXPR_ITEM(v, i)));
+    }
+
+    lval *rv = call_builtin(o->env, id, args);
+    if (lval_type(rv) == LVAL_ERROR)
+    {
+        lval_del(rv);
+        return 0;
+    }
+
+    opt_assume_builtin(o, LVAL_EXPR_FIRST(v));
+    return rv;
+}
+
+/**
+ * Returns true if id is a formal of a function the body is being inlined in
+ * to. Such a symbol means something else once the body is inlined.
+ */
+static bool opt_is_outer(const opt_body *b, unsigned id)
+{
+    for (size_t i = 0; i < b->outer_count; i++)
+    {
+        for (size_t j = 0; j < LVAL_EXPR_CNT(b->outer[i]); j++)
+        {
+            if (LVAL_EXPR_ITEM(b->outer[i], j)->value.sym.id == id)
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Returns true if a function can be inlined for a call with argc arguments --
+ * it is user-defined, takes exactly that many, and binds nothing from partial application.
+ */
+static bool opt_is_inlinable(const lval *func, size_t argc)
+{
+    return lval_type(func) == LVAL_USER_FUN && !func->value.user_fun.params.variadic &&
+        !func->value.user_fun.params.malformed && func->value.user_fun.params.arity == argc &&
+        LVAL_EXPR_CNT(func->value.user_fun.formals) == argc && argc > 0;
+}
+
+static bool opt_scan(optimiser *o, opt_body *b, const lval *v, bool conditional, unsigned depth);
+
+/**
+ * Checks a call to a global function from a body being inlined. It need not be
+ * inlined itself but must not rely on the formals of the functions around it.
+ */
+static bool opt_scan_call(optimiser *o, const opt_body *b, const lval *v, unsigned depth)
+{
+    lval *func = lenv_get(o->env, LVAL_EXPR_FIRST(v));
+    if (depth + 1 >= OPT_INLINE_DEPTH || !opt_is_inlinable(func, LVAL_EXPR_CNT(v) - 1))
+    {
+        lval_del(func);
+        return false;
+    }
+
+    opt_body inner = { .formals = func->value.user_fun.formals, .outer_count = b->outer_count + 1 };
+    memcpy(inner.outer, b->outer, b->outer_count * sizeof(lval*));
+    inner.outer[b->outer_count] = b->formals;
+    if (!opt_scan(o, &inner, func->value.user_fun.body, false, depth + 1))
+    {
+        lval_del(func);
+        return false;
+    }
+
+    opt_assume(o, LVAL_EXPR_FIRST(v), func);
+    return true;
+}
+
+/**
+ * Checks a list in a function body can be inlined, counting the uses of the
+ * formals. Only built-ins without side effects and functions that can
+ * themselves be inlined are called.
+ */
+static bool opt_scan(optimiser *o, opt_body *b, const lval *v, bool conditional, unsigned depth)
+{
+    size_t count = LVAL_EXPR_CNT(v);
+    b->size += count;
+    if (b->size > OPT_INLINE_SIZE)
+    {
+        return false;
+    }
+
+    unsigned form = 0;
+    const lval *first = count ? LVAL_EXPR_FIRST(v) : 0;
+    if (count && (lval_type(first) == LVAL_SEXPRESSION || lval_type(first) == LVAL_QEXPRESSION))
+    {
+        return false;
+    }
+
+    if (count && lval_type(first) == LVAL_SYMBOL)
+    {
+        unsigned id = first->value.sym.id;
+        if (first->value.sym.slot != LVAL_SLOT_NONE || opt_is_outer(b, id))
+        {
+            return false;
+        }
+
+        if (symbol_builtin(id))
+        {
+            if (!opt_named(id, opt_pure, sizeof(opt_pure) / sizeof(char*)) &&
+                !opt_named(id, opt_safe, sizeof(opt_safe) / sizeof(char*)))
+            {
+                return false;
+            }
+
+            if (id == SYMBOL_ID_IF)
+            {
+                if (count != 4 || lval_type(LVAL_EXPR_ITEM(v, 2)) != LVAL_QEXPRESSION ||
+                    lval_type(LVAL_EXPR_ITEM(v, 3)) != LVAL_QEXPRESSION)
+                {
+                    return false;
+                }
+
+                opt_assume_builtin(o, first);
+            }
+
+            form = id;
+        }
+        else if (count == 1 || !opt_scan_call(o, b, v, depth))
+        {
+            return false;
+        }
+    }
+
+    for (size_t i = count && lval_type(first) == LVAL_SYMBOL; i < count; i++)
+    {
+        const lval *item = LVAL_EXPR_ITEM(v, i);
+        bool cond = conditional || (i > 1 && (form == SYMBOL_ID_IF || form == SYMBOL_ID_AND || form == SYMBOL_ID_OR));
+        switch (lval_type(item))
+        {
+        case LVAL_SYMBOL:
+            if (item->value.sym.slot == LVAL_SLOT_NONE)
+            {
+                if (opt_is_outer(b, item->value.sym.id))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                unsigned slot = item->value.sym.slot;
+                if (slot >= LVAL_EXPR_CNT(b->formals) || LVAL_EXPR_ITEM(b->formals, slot)->value.sym.id != item->value.sym.id)
+                {
+                    return false;
+                }
+
+                if (b->usage)
+                {
+                    opt_use *use = &b->usage[slot];
+                    if (!use->count++)
+                    {
+                        use->order = b->uses;
+                    }
+
+                    use->plain += !cond;
+                    b->uses++;
+                }
+            }
+            break;
+        case LVAL_QEXPRESSION:
+            if (form != SYMBOL_ID_IF || i < 2)
+            {
+                return false;
+            }
+
+            // fall through
+        case LVAL_SEXPRESSION:
+            if (!opt_scan(o, b, item, cond, depth))
+            {
+                return false;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Returns true if the arguments of a call can take the place of the formals.
+ * An argument that may have an effect or fail must still be evaluated once,
+ * and in order.
+ */
+static bool opt_args(const opt_body *b, const lval *v)
+{
+    bool ordered = false;
+    size_t last = 0;
+    for (size_t i = 1; i < LVAL_EXPR_CNT(v); i++)
+    {
+        const lval *arg = LVAL_EXPR_ITEM(v, i);
+        const opt_use *use = &b->usage[i - 1];
+        bool global = lval_type(arg) == LVAL_SYMBOL && arg->value.sym.slot == LVAL_SLOT_NONE;
+        if (!global && lval_type(arg) != LVAL_SEXPRESSION)
+        {
+            continue;
+        }
+
+        if (!use->plain || use->count != use->plain || (!global && use->count != 1) || (ordered && use->order <= last))
+        {
+            return false;
+        }
+
+        ordered = true;
+        last = use->order;
+    }
+
+    return true;
+}
+
+/**
+ * Returns a copy of a function body with the arguments of a call in place of its formals.
+ */
+static lval *opt_substitute(const lval *v, const lval *call)
+{
+    lval *rv = lval_type(v) == LVAL_SEXPRESSION ? lval_sexpression() : lval_qexpression();
+    lval_expr_reserve(rv, LVAL_EXPR_CNT(v));
+    for (size_t i = 0; i < LVAL_EXPR_CNT(v); i++)
+    {
+        lval *item = LVAL_EXPR_ITEM(v, i);
+        switch (lval_type(item))
+        {
+        case LVAL_SYMBOL:
+            lval_add(rv, lval_ref(item->value.sym.slot == LVAL_SLOT_NONE ? item : LVAL_EXPR_ITEM(call, item->value.sym.slot + 1)));
+            break;
+        case LVAL_SEXPRESSION:
+        case LVAL_QEXPRESSION:
+            lval_add(rv, opt_substitute(item, call));
+            break;
+        default:
+            lval_add(rv, lval_ref(item));
+            break;
+        }
+    }
+
+    return rv;
+}
+
+/**
+ * Replaces a call to a small global function with its body. Returns null if
+ * the function cannot be inlined.
+ */
+static lval *opt_inline(optimiser *o, lval *v, unsigned depth)
+{
+    lval *first = LVAL_EXPR_FIRST(v);
+    size_t argc = LVAL_EXPR_CNT(v) - 1;
+    if (depth >= OPT_INLINE_DEPTH || lval_type(first) != LVAL_SYMBOL || first->value.sym.slot != LVAL_SLOT_NONE ||
+        symbol_builtin(first->value.sym.id))
+    {
+        return 0;
+    }
+
+    lval *func = lenv_get(o->env, first);
+    if (!opt_is_inlinable(func, argc))
+    {
+        lval_del(func);
+        return 0;
+    }
+
+    size_t assumed = LVAL_EXPR_CNT(o->assumed);
+    opt_use usage[argc];
+    memset(usage, 0, sizeof(usage));
+    opt_body b = { .formals = func->value.user_fun.formals, .usage = usage };
+    if (!opt_scan(o, &b, func->value.user_fun.body, false, depth) || !opt_args(&b, v))
+    {
+        opt_forget(o, assumed);
+        lval_del(func);
+        return 0;
+    }
+
+    lval *body = opt_substitute(func->value.user_fun.body, v);
+    opt_assume(o, first, func);
+    lval *rv = opt_expr(o, body, depth + 1);
+    lval_del(body);
+    return opt_retype(rv, lval_type(v));
+}
+
+/**
+ * Optimises a list evaluated as an s-expression. Returns the list itself if
+ * nothing changes, otherwise a list of the same type or a constant.
+ */
+static lval *opt_expr(optimiser *o, lval *v, unsigned depth)
+{
+    // The guards are only checked on entry, so a symbol rebound since then must not be relied on
+    if (!LVAL_EXPR_CNT(v) || o->rebound)
+    {
+        return lval_ref(v);
+    }
+
+    lval *rv;
+    lval *x;
+    if (opt_builtin(LVAL_EXPR_FIRST(v)) == SYMBOL_ID_IF && LVAL_EXPR_CNT(v) == 4 &&
+        lval_type(LVAL_EXPR_ITEM(v, 2)) == LVAL_QEXPRESSION && lval_type(LVAL_EXPR_ITEM(v, 3)) == LVAL_QEXPRESSION)
+    {
+        rv = opt_if(o, v, depth);
+    }
+    else
+    {
+        rv = opt_items(o, v, depth);
+        if (!o->rebound && ((x = opt_fold(o, rv)) || (x = opt_inline(o, rv, depth))))
+        {
+            lval_del(rv);
+            rv = x;
+        }
+        else
+        {
+            // Whatever follows in evaluation order is left as written if this call could rebind a symbol
+            o->rebound = o->rebound || opt_may_rebind(rv);
+        }
+    }
+
+    // What is left of a rewrite may be a constant on its own, which evaluates to itself
+    if (rv != v && (lval_type(rv) == LVAL_SEXPRESSION || lval_type(rv) == LVAL_QEXPRESSION) && LVAL_EXPR_CNT(rv) == 1 &&
+        (opt_is_constant(LVAL_EXPR_FIRST(rv)) || lval_type(LVAL_EXPR_FIRST(rv)) == LVAL_QEXPRESSION))
+    {
+        x = lval_ref(LVAL_EXPR_FIRST(rv));
+        lval_del(rv);
+        rv = x;
+    }
+
+    return rv;
+}
+
+lval *lval_optimise(lenv *env, lval *v)
+{
+    optimiser o = { env, lval_sexpression(), false };
+    lval *opt = opt_expr(&o, v, 0);
+    if (opt == v)
+    {
+        lval_del(opt);
+        lval_del(o.assumed);
+        return 0;
+    }
+
+    lval *rv = lval_add(lval_sexpression(), opt_retype(opt, lval_type(v)));
+    lval_expr_reserve(rv, LVAL_EXPR_CNT(o.assumed) + 1);
+    for (size_t i = 0; i < LVAL_EXPR_CNT(o.assumed); i++)
+    {
+        lval_add(rv, lval_ref(LVAL_EXPR_ITEM(o.assumed, i)));
+    }
+
+    lval_del(o.assumed);
+    return rv;
+}
@@ -0,0 +1,87 @@
+/*
+ * Slab pools for fixed-size objects. Objects are carved out of slabs and
+ * returned to an intrusive free list when released, so the hot lval
+ * structure avoids the general-purpose allocator. Slabs are zero filled and
+ * can be walked object by object, which the garbage collector uses to find
+ * every lval.
+ */
+
+#include <stddef.h>
+#include "lilith_int.h"
+
+#define POOL_SLAB_OBJECTS 1024
+
+/**
+ * An unused object on a pool's free list.
+ */
+typedef struct _pool_free
+{
+    struct _pool_free *next;
+} pool_free_node;
+
+/**
+ * A slab of objects. The objects follow the header.
+ */
+typedef struct _pool_slab
+{
+    struct _pool_slab *next;
+    max_align_t data[];
+} pool_slab;
+
+/**
+ * Allocates a new slab and threads its objects on to the free list.
+ */
+static void pool_grow(pool *p)
+{
+    pool_slab *slab = calloc(1, sizeof(pool_slab) + p->size * POOL_SLAB_OBJECTS);
+    slab->next = p->slabs;
+    p->slabs = slab;
+
+    char *obj = (char*)slab->data;
+    for (size_t i = 0; i < POOL_SLAB_OBJECTS; i++, obj += p->size)
+    {
+        pool_free_node *node = (pool_free_node*)obj;
+        node->next = p->free;
+        p->free = node;
+    }
+
+    p->capacity += POOL_SLAB_OBJECTS;
+}
+
+void *pool_alloc(pool *p)
+{
+    if (!p->free)
+    {
+        pool_grow(p);
+    }
+
+    pool_free_node *rv = p->free;
+    p->free = rv->next;
+
+    if (++p->in_use > p->high_water)
+    {
+        p->high_water = p->in_use;
+    }
+
+    return rv;
+}
+
+void pool_free(pool *p, void *ptr)
+{
+    pool_free_node *node = ptr;
+    node->next = p->free;
+    p->free = node;
+    p->in_use--;
+}
+
+void pool_walk(pool *p, void (*visit)(void *obj))
+{
+    for (pool_slab *slab = p->slabs; slab; slab = slab->next)
+    {
+        char *obj = (char*)slab->data;
+        for (size_t i = 0; i < POOL_SLAB_OBJECTS; i++, obj += p->size)
+        {
+            visit(obj);
+        }
+    }
+}
@@ -75,7 +75,7 @@ static lval *read_list(tokeniser *tok, lval *list)
         if (t.type == TOK_LIST_BEGIN)
         {
             lval *x = read_list(tok, (*t.token == '(') ? lval_sexpression() : lval_qexpression());
-            if (x->type == LVAL_ERROR)
+            if (lval_type(x) == LVAL_ERROR)
             {
                 lval_del(rv);
                 return x;
@@ -85,8 +85,8 @@ static lval *read_list(tokeniser *tok, lval *list)
         }
         else if (t.type == TOK_LIST_END)
         {
-            if ((rv->type == LVAL_SEXPRESSION && !strcmp(t.token, "}")) ||
-                (rv->type == LVAL_QEXPRESSION && !strcmp(t.token, ")")))
+            if ((lval_type(rv) == LVAL_SEXPRESSION && !strcmp(t.token, "}")) ||
+                (lval_type(rv) == LVAL_QEXPRESSION && !strcmp(t.token, ")")))
             {
                 lval_del(rv);
                 return lval_error("at %d:%d - unexpected '%s'", get_line_number(tok), get_position(tok), t.token);
@@ -97,7 +97,7 @@ static lval *read_list(tokeniser *tok, lval *list)
         else
         {
             lval *x = read_element(tok, &t);
-            if (x->type == LVAL_ERROR)
+            if (lval_type(x) == LVAL_ERROR)
             {
                 lval_del(rv);
                 return x;
@@ -125,7 +125,7 @@ lval *lilith_read_from_string(const char *input)
         if (t.type == TOK_LIST_BEGIN)
         {
             next = read_list(tok, (*t.token == '(') ? lval_sexpression() : lval_qexpression());
-            if (next->type == LVAL_ERROR)
+            if (lval_type(next) == LVAL_ERROR)
             {
                 lval_del(rv);
                 rv = next;
@@ -137,7 +137,7 @@ lval *lilith_read_from_string(const char *input)
         else
         {
             next = read_element(tok, &t);
-            if (next->type == LVAL_ERROR)
+            if (lval_type(next) == LVAL_ERROR)
             {
                 lval_del(rv);
                 rv = next;
@@ -21,11 +21,19 @@ static void version()
 static void usage()
 {
     version();
-    printf("usage: lilith [-h] [-v] [-l] file...\n");
+    printf("usage: lilith [-h] [-v] [-l] [-t | -b] [-n] [-d depth] file...\n");
+    printf("       lilith --compile file -o output.c\n");
     printf("  -h : display this help message\n");
     printf("  -v : display version number\n");
     printf("  -l : load and evaluate file(s) and enter interpreter\n");
+    printf("  -t : evaluate with the tree-walking interpreter\n");
+    printf("  -b : evaluate with the bytecode virtual machine (default)\n");
+    printf("  -n : do not compile hot functions to native code\n");
+    printf("  -d : maximum depth of calls not in tail position on the virtual machine\n");
+    printf("       (default 1000000) -- the tree-walking interpreter is limited by the C stack\n");
     printf("Additional arguments read as files and evaluated\n");
+    printf("  --compile : compile file and the standard library in to C, to link with\n");
+    printf("              the interpreter's objects other than the REPL\n");
 }
 
 int main(int argc, char *argv[])
@@ -50,12 +58,43 @@ int main(int argc, char *argv[])
             version();
             running = false;
         }
+        else if (strcmp(argv[1], "--compile") == 0)
+        {
+            int rv = 1;
+            if (argc == 5 && strcmp(argv[3], "-o") == 0)
+            {
+                rv = lilith_compile_file(argv[2], argv[4]);
+            }
+            else
+            {
+                usage();
+            }
+
+            lilith_cleanup(env);
+            return rv;
+        }
         else
         {
             running = (strcmp(argv[1], "-l") == 0);
             for (int i = 1; i < argc; i++)
             {
-                if (argv[i][0] != '-')
+                if (strcmp(argv[i], "-t") == 0)
+                {
+                    lilith_set_engine(LILITH_ENGINE_TREE);
+                }
+                else if (strcmp(argv[i], "-b") == 0)
+                {
+                    lilith_set_engine(LILITH_ENGINE_VM);
+                }
+                else if (strcmp(argv[i], "-n") == 0)
+                {
+                    lilith_set_jit(false);
+                }
+                else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+                {
+                    lilith_set_max_depth(strtoul(argv[++i], 0, 10));
+                }
+                else if (argv[i][0] != '-')
                 {
                     lilith_eval_file(env, argv[i]);
                 }
@@ -82,9 +121,12 @@ int main(int argc, char *argv[])
             }
             else
             {
+                lilith_arena_begin();
                 lval *result = lilith_eval_expr(env, lilith_read_from_string(input));
                 lilith_println(result);
                 lilith_lval_del(result);
+                lilith_arena_end();
+                lilith_collect_garbage(env);
             }
 
             free(input);
@@ -0,0 +1,181 @@
+/*
+ * The symbol table. Every distinct symbol name is interned once and given a
+ * small integer ID, so environments and equality checks compare integers rather
+ * than strings. Each interned symbol owns a single shared lval which is handed
+ * out by reference; neither the names nor the lvals are ever freed. The table
+ * also counts each symbol's bindings outside the global environment so that
+ * lookups of purely global symbols can skip the rest of the environment chain,
+ * and holds the built-in each built-in symbol names. Built-ins can never be
+ * rebound so a reference to one that no local environment binds is resolved
+ * here without searching any environment.
+ */
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+#define SYMBOL_MIN_CAPACITY 256
+
+/**
+ * An interned symbol. The entry's index in the table is the symbol's ID.
+ */
+typedef struct
+{
+    char *name;
+    unsigned hash;         // hash of the name, kept for rehashing
+    unsigned local_binds;  // bindings of this symbol in non-global environments
+    lval *val;             // the shared lval for this symbol
+    lval *builtin;         // the built-in the symbol names, null for other symbols
+} symbol_entry;
+
+static struct
+{
+    symbol_entry *entries;  // indexed by symbol ID
+    size_t count;
+    unsigned *slots;        // open addressed index of symbol ID + 1, zero when empty
+    size_t capacity;        // size of both the entries and slots arrays, a power of two
+} symbols;
+
+/**
+ * FNV-1a hash of a symbol name.
+ */
+static unsigned symbol_hash(const char *name)
+{
+    unsigned rv = 2166136261u;
+    for (; *name; name++)
+    {
+        rv = (rv ^ (unsigned char)*name) * 16777619u;
+    }
+
+    return rv;
+}
+
+/**
+ * Finds the slot for a name, either the slot holding it or the empty slot it belongs in.
+ */
+static unsigned *symbol_slot(const char *name, unsigned hash)
+{
+    size_t mask = symbols.capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        unsigned *slot = &symbols.slots[i];
+        if (!*slot || (symbols.entries[*slot - 1].hash == hash && !strcmp(symbols.entries[*slot - 1].name, name)))
+        {
+            return slot;
+        }
+    }
+}
+
+/**
+ * Doubles the size of the table. Entries keep their IDs, only the index is rebuilt.
+ */
+static void symbol_grow(void)
+{
+    symbols.capacity = symbols.capacity ? symbols.capacity * 2 : SYMBOL_MIN_CAPACITY;
+    symbols.entries = realloc(symbols.entries, symbols.capacity * sizeof(symbol_entry));
+
+    free(symbols.slots);
+    symbols.slots = calloc(symbols.capacity, sizeof(unsigned));
+    for (size_t i = 0; i < symbols.count; i++)
+    {
+        *symbol_slot(symbols.entries[i].name, symbols.entries[i].hash) = i + 1;
+    }
+}
+
+static unsigned symbol_add(const char *name, unsigned hash, unsigned *slot)
+{
+    // Keep the index at most half full
+    if ((symbols.count + 1) * 2 > symbols.capacity)
+    {
+        symbol_grow();
+        slot = symbol_slot(name, hash);
+    }
+
+    unsigned id = symbols.count++;
+    symbol_entry *entry = &symbols.entries[id];
+    entry->name = strdup(name);
+    entry->hash = hash;
+    entry->local_binds = 0;
+    entry->builtin = 0;
+
+    // Symbols live for the life of the program so never come from the arena
+    entry->val = pool_alloc(&lval_pool);
+    entry->val->type = LVAL_SYMBOL;
+    entry->val->refs = 1;
+    entry->val->flags = LVAL_FLAG_INTERNED;
+    entry->val->value.sym.name = entry->name;
+    entry->val->value.sym.id = id;
+    entry->val->value.sym.slot = LVAL_SLOT_NONE;
+
+    *slot = id + 1;
+    return id;
+}
+
+unsigned symbol_intern(const char *name)
+{
+    if (!symbols.capacity)
+    {
+        symbol_grow();
+
+        // Symbols the interpreter checks for by ID, in the order of their SYMBOL_ID constants
+        static const char *fixed[] =
+        {
+            "&", BUILTIN_SYM_LIST, BUILTIN_SYM_LAMBDA, BUILTIN_SYM_IF, BUILTIN_SYM_AND,
+            BUILTIN_SYM_OR, BUILTIN_SYM_TRY, BUILTIN_SYM_DO
+        };
+
+        for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+        {
+            symbol_add(fixed[i], symbol_hash(fixed[i]), symbol_slot(fixed[i], symbol_hash(fixed[i])));
+        }
+    }
+
+    unsigned hash = symbol_hash(name);
+    unsigned *slot = symbol_slot(name, hash);
+    return *slot ? *slot - 1 : symbol_add(name, hash, slot);
+}
+
+const char *symbol_name(unsigned id)
+{
+    return symbols.entries[id].name;
+}
+
+lval *symbol_lval(unsigned id)
+{
+    return lval_ref(symbols.entries[id].val);
+}
+
+lval *symbol_bind_builtin(unsigned id, lbuiltin func)
+{
+    symbol_entry *entry = &symbols.entries[id];
+    if (!entry->builtin)
+    {
+        // Like the symbol itself the built-in is shared by every reference and never freed
+        entry->builtin = pool_alloc(&lval_pool);
+        entry->builtin->type = LVAL_BUILTIN_FUN;
+        entry->builtin->refs = 1;
+        entry->builtin->flags = LVAL_FLAG_INTERNED;
+    }
+
+    entry->builtin->value.builtin = func;
+    return entry->builtin;
+}
+
+lval *symbol_builtin(unsigned id)
+{
+    return symbols.entries[id].builtin;
+}
+
+void symbol_bind_local(unsigned id)
+{
+    symbols.entries[id].local_binds++;
+}
+
+void symbol_unbind_local(unsigned id)
+{
+    symbols.entries[id].local_binds--;
+}
+
+bool symbol_is_local(unsigned id)
+{
+    return symbols.entries[id].local_binds;
+}
@@ -138,14 +138,17 @@ static CHAR_TYPE get_char_type(char c)
 }
 
 /**
- * Make sure the buffer is big enough to contain the token. Realloc it if not.
+ * Make sure the buffer is big enough to contain the token and its terminator.
+ * Realloc it if not, moving ptr to the same offset in the new buffer.
  */
-static void check_next_buff(tokeniser *tok, const char *ptr)
+static void check_next_buff(tokeniser *tok, char **ptr)
 {
-    if (ptr - tok->next >= (long)tok->next_size)
+    long used = *ptr - tok->next;
+    if (used + 1 >= (long)tok->next_size)
     {
         tok->next = realloc(tok->next, tok->next_size * 2);
         tok->next_size *= 2;
+        *ptr = tok->next + used;
     }
 }
 
@@ -292,7 +295,7 @@ bool get_next_token(tokeniser *tok, token *token)
     {
         current_type = best_type;
         copy_char(&ptr, tok, current_type);
-        check_next_buff(tok, ptr);
+        check_next_buff(tok, &ptr);
         increment_head(tok);
     }
 
@@ -0,0 +1,343 @@
+/*
+ * The bytecode virtual machine. A stack machine that runs code from the
+ * compiler, dispatching each instruction with a computed goto. Built-ins are
+ * called through lval_call so they behave exactly as they do in the
+ * tree-walking evaluator. Calls to user functions are handed back to the
+ * trampoline, which makes them without growing the C stack.
+ */
+
+#include "builtin_symbols.h"
+#include "bytecode.h"
+
+#define VM_SEGMENT_SLOTS 4096
+
+/**
+ * A block of the value stack. Code is given a region of the top segment, or of
+ * a new one if it does not fit, so a region never moves while code waits on a
+ * call and the stack grows only as deep as the calls waiting go.
+ */
+typedef struct vm_segment
+{
+    struct vm_segment *prev;
+    size_t capacity;
+    size_t used;
+    lval *slots[];
+} vm_segment;
+
+static vm_segment *segment;
+static vm_segment *spare;    // the last segment emptied, kept for the next to be needed
+
+/**
+ * Takes a region of count slots from the top of the value stack.
+ */
+static lval **stack_alloc(size_t count)
+{
+    if (!segment || segment->used + count > segment->capacity)
+    {
+        vm_segment *s = spare;
+        spare = 0;
+        if (!s || s->capacity < count)
+        {
+            free(s);
+            size_t capacity = count > VM_SEGMENT_SLOTS ? count : VM_SEGMENT_SLOTS;
+            s = malloc(sizeof(vm_segment) + capacity * sizeof(lval*));
+            s->capacity = capacity;
+        }
+
+        s->prev = segment;
+        s->used = 0;
+        segment = s;
+    }
+
+    lval **rv = segment->slots + segment->used;
+    segment->used += count;
+    return rv;
+}
+
+/**
+ * Returns the region starting at base, the top one on the value stack.
+ */
+static void stack_release(lval **base)
+{
+    segment->used = base - segment->slots;
+    if (!segment->used && segment->prev)
+    {
+        free(spare);
+        spare = segment;
+        segment = segment->prev;
+    }
+}
+
+lval *vm_prepare_call(lval **vals, size_t count, ltail *call)
+{
+    lval *first = vals[0];
+
+    // Errors propagate and a single non-builtin value evaluates to itself
+    if (lval_type(first) == LVAL_ERROR || (count == 1 && lval_type(first) != LVAL_BUILTIN_FUN))
+    {
+        for (size_t i = 1; i < count; i++)
+        {
+            lval_del(vals[i]);
+        }
+
+        return first;
+    }
+
+    if (lval_type(first) != LVAL_BUILTIN_FUN && lval_type(first) != LVAL_USER_FUN)
+    {
+        lval *rv = lval_error("s-expression does not start with function, '%s'", ltype_name(lval_type(first)));
+        for (size_t i = 0; i < count; i++)
+        {
+            lval_del(vals[i]);
+        }
+
+        return rv;
+    }
+
+    // The arguments move straight from the stack in to the list
+    lval *args = lval_sexpression();
+    if (count > 1)
+    {
+        lval_expr_reserve(args, count - 1);
+        memcpy(args->value.list.items, vals + 1, (count - 1) * sizeof(lval*));
+        LVAL_EXPR_CNT(args) = count - 1;
+    }
+
+    call->func = first;
+    call->args = args;
+    return 0;
+}
+
+lval *vm_form(lenv *env, lval *form)
+{
+    if (!symbol_is_local(LVAL_EXPR_FIRST(form)->value.sym.id))
+    {
+        return 0;
+    }
+
+    return lval_eval_sexpr(env, lval_ref(form), 0);
+}
+
+lval *vm_test_error(lenv *env, unsigned id, lval *v)
+{
+    lval *args = lval_add(lval_sexpression(), v);
+    if (id == SYMBOL_ID_IF)
+    {
+        lval_add(args, lval_qexpression());
+        lval_add(args, lval_qexpression());
+    }
+
+    return call_builtin(env, id, args);
+}
+
+/**
+ * Returns true if every symbol the code relies on still has the value it was
+ * compiled with, and every formal a value of the type it was specialised for.
+ * A built-in can only change by a local binding it.
+ */
+static bool vm_guards_hold(lenv *env, const lcode *code)
+{
+    for (size_t i = 0; i < code->guard_count; i++)
+    {
+        lguard *guard = &code->guards[i];
+        if (!guard->expected)
+        {
+            lval *v = lenv_get(env, guard->sym);
+            bool held = lval_type(v) == guard->type;
+            lval_del(v);
+            if (!held)
+            {
+                return false;
+            }
+
+            continue;
+        }
+
+        if (lval_type(guard->expected) == LVAL_BUILTIN_FUN)
+        {
+            if (symbol_is_local(guard->sym->value.sym.id))
+            {
+                return false;
+            }
+
+            continue;
+        }
+
+        lval *v = lenv_get_cached(env, guard->sym, &guard->cache);
+        bool held = v == guard->expected;
+        lval_del(v);
+        if (!held)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void vm_enter(lenv *env, const lcode *code, lvm *vm)
+{
+    if (code->guard_count && !vm_guards_hold(env, code))
+    {
+        code = code->generic;
+    }
+
+    vm->code = code;
+    vm->ip = code->instrs;
+    vm->base = vm->sp = code->native ? 0 : stack_alloc(code->max_stack);
+}
+
+lval *vm_run(lenv *env, lvm *vm, ltail *call)
+{
+    static void *jump_table[] =
+    {
+#define $(X, NAME) &&JT_##X,
+        OPCODES
+#undef $
+    };
+
+    const lcode *code = vm->code;
+    if (code->native)
+    {
+        vm->ip = 0;
+        return code->native(env, code, call);
+    }
+
+    lval **sp = vm->sp;
+    const unsigned *ip = vm->ip;
+    unsigned instr;
+    lval *rv;
+    lval *v;
+
+#define DISPATCH()  \
+    instr = *ip++;  \
+    goto *(jump_table[INSTR_OP(instr)])
+
+    DISPATCH();
+
+JT_CONST:
+    *sp++ = lval_ref(code->consts[INSTR_ARG(instr)]);
+    DISPATCH();
+
+JT_LOAD:
+    *sp++ = lenv_get(env, code->consts[INSTR_ARG(instr)]);
+    DISPATCH();
+
+JT_BUILTIN:
+    *sp++ = vm_builtin(env, code->consts[INSTR_ARG(instr)]);
+    DISPATCH();
+
+JT_GLOBAL:
+    *sp++ = lenv_get_cached(env, code->sites[INSTR_ARG(instr)].sym, &code->sites[INSTR_ARG(instr)].cache);
+    DISPATCH();
+
+JT_EMPTY:
+    *sp++ = lval_sexpression();
+    DISPATCH();
+
+JT_CALL:
+    sp -= INSTR_ARG(instr);
+    rv = vm_prepare_call(sp, INSTR_ARG(instr), call);
+    if (!rv && lval_type(call->func) == LVAL_USER_FUN)
+    {
+        // The code waits here for the result
+        vm->ip = ip;
+        vm->sp = sp;
+        return 0;
+    }
+
+    *sp++ = rv ? rv : lval_call(env, call->func, call->args);
+    DISPATCH();
+
+JT_TAIL:
+    sp -= INSTR_ARG(instr);
+    rv = vm_prepare_call(sp, INSTR_ARG(instr), call);
+    stack_release(vm->base);
+    vm->ip = 0;
+    return rv;
+
+JT_RETURN:
+    rv = *--sp;
+    stack_release(vm->base);
+    vm->ip = 0;
+    return rv;
+
+JT_FORM:
+    if ((rv = vm_form(env, code->consts[INSTR_ARG(instr)])))
+    {
+        *sp++ = rv;
+    }
+    else
+    {
+        ip++;
+    }
+    DISPATCH();
+
+JT_LAMBDA:
+    *sp++ = vm_lambda(code->consts[INSTR_ARG(instr)]);
+    DISPATCH();
+
+JT_JUMP:
+    ip = code->instrs + INSTR_ARG(instr);
+    DISPATCH();
+
+JT_IF:
+    v = *--sp;
+    if (v == LVAL_FALSE)
+    {
+        ip = code->instrs + INSTR_ARG(instr);
+    }
+    else if (v != LVAL_TRUE)
+    {
+        *sp++ = vm_test_error(env, SYMBOL_ID_IF, v);
+        ip = code->instrs + INSTR_ARG(instr) - 1;
+    }
+    DISPATCH();
+
+JT_AND:
+    v = *--sp;
+    if (v != LVAL_TRUE)
+    {
+        *sp++ = v == LVAL_FALSE ? v : vm_test_error(env, SYMBOL_ID_AND, v);
+        ip = code->instrs + INSTR_ARG(instr);
+    }
+    DISPATCH();
+
+JT_OR:
+    v = *--sp;
+    if (v != LVAL_FALSE)
+    {
+        *sp++ = v == LVAL_TRUE ? v : vm_test_error(env, SYMBOL_ID_OR, v);
+        ip = code->instrs + INSTR_ARG(instr);
+    }
+    DISPATCH();
+
+JT_TRY:
+    if (lval_type(sp[-1]) == LVAL_ERROR)
+    {
+        lval_del(*--sp);
+    }
+    else
+    {
+        ip = code->instrs + INSTR_ARG(instr);
+    }
+    DISPATCH();
+
+JT_DROP:
+    if (lval_type(sp[-1]) == LVAL_ERROR)
+    {
+        ip = code->instrs + INSTR_ARG(instr);
+    }
+    else
+    {
+        lval_del(*--sp);
+    }
+    DISPATCH();
+
+JT_ARITH:
+    sp--;
+    sp[-1] = arith_apply(INSTR_ARG(instr) / 2, INSTR_ARG(instr) % 2, sp[-1], sp[0]);
+    DISPATCH();
+
+#undef DISPATCH
+}